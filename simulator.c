@@ -8,6 +8,21 @@
 #include <string.h>
 #include <time.h> 
 #include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "traffic_env.h"
 
 #define WINDOW_WIDTH 1280
 #define MAIN_FONT "DejaVuSans.ttf"
@@ -17,18 +32,93 @@
 #define LANE_WIDTH 70   
 #define VEHICLE_SIZE 40
 #define VEHICLE_LENGTH 60  
-#define MAX_VEHICLES 500   
+#define VEHICLE_CHUNK 512 // Vehicle slots allocated at a time
+#define MAX_VEHICLE_CHUNKS 2048 // Addressable pool, about a million vehicles
+#define ARENA_ALIGN 64 // Cache line; arena allocations never share one
 #define VEHICLE_SPEED 3
 #define LEFT_TURN 1
 #define STRAIGHT 2
 #define RIGHT_TURN 3
 #define STOP_DISTANCE 175 // Distance from traffic light where vehicles should stop
-#define MAX_QUEUE_SIZE 200 // Maximum size for our traffic queues
+#define QUEUE_INITIAL_CAPACITY 16 // Slots a lane queue starts with; it doubles when full
 #define NUM_LANES 4 // A, B, C, D lanes
+#define LANE_GROUPS_PER_JUNCTION (NUM_LANES * 3) // One per approach lane and sublane
+#define MAX_JUNCTIONS 64
+#define MIN_JUNCTION_SPACING 400 // Room for a stop line, the junction box and turn exits
+#define MAX_LANE_GROUPS (MAX_JUNCTIONS * LANE_GROUPS_PER_JUNCTION)
+#define MAX_PENDING_SPAWNS 8 // Spawn requests a lane group holds between ticks
+#define NETWORK_FILE "network.data"
+#define TICK_MS 16 // Simulated time advanced by one updateVehicles() call
+#define CHECKPOINT_FILE "world.ckpt"
+#define CHECKPOINT_MAGIC 0x54504B43 // "CKPT"
+#define CHECKPOINT_VERSION 14
+#define MAX_PATH_POINTS 256 // Samples per precomputed turn path
+#define CONFLICT_GRID 8 // Conflict cells per side of a junction box, so a junction's cells fit in a Uint64
+#define SPATIAL_CELL 128 // px per side of a spatial hash cell, about two vehicle lengths
+#define PIXELS_PER_METRE 12 // A 60 px vehicle is 5 m long
+#define MAX_DETECTORS_PER_JUNCTION 16
+#define MAX_DETECTORS (MAX_JUNCTIONS * MAX_DETECTORS_PER_JUNCTION)
+#define DETECTOR_EVENT_RING 256 // On/off events a junction's controller may fall behind by
+#define STOP_BAR_LENGTH (6 * PIXELS_PER_METRE)       // Default presence loop, ending at the stop line
+#define ADVANCE_LOOP_SETBACK (30 * PIXELS_PER_METRE) // Default count loop, this far before the stop line
+#define ADVANCE_LOOP_LENGTH (2 * PIXELS_PER_METRE)
+
+// Intelligent Driver Model defaults, varied per vehicle at spawn
+#define IDM_DESIRED_SPEED (VEHICLE_SPEED * 1000.0f / TICK_MS) // px/s, the old constant cruise speed
+#define IDM_MAX_ACCEL (2.0f * PIXELS_PER_METRE)               // px/s^2
+#define IDM_COMFORT_DECEL (2.0f * PIXELS_PER_METRE)           // px/s^2
+#define IDM_MIN_GAP (2.0f * PIXELS_PER_METRE)                 // px, bumper to bumper when stopped
+#define IDM_TIME_HEADWAY 1.2f                                 // s
+#define IDM_REACTION_TIME 0.6f                                // s, delay before pulling away
+#define SIGNAL_STOP_DECEL (4.5f * PIXELS_PER_METRE)           // px/s^2, firmest braking for a light about to change
+#define MAX_WORKERS 64 // Threads stepping regions of the network in parallel
+#define MAX_RUN_THREADS 8 // Generator, controller, file reader and any later background threads
+#define BENCH_MIN_MS 200 // Shortest timed run of one microbenchmark
+#define BENCH_QUEUE_SIZE 200 // Queue the enqueue/dequeue benchmark fills to its occupancy
+#define ENV_BENCH_EPISODE_STEPS 600 // One-second environment steps in the envStep benchmark's peak-hour episode
+#define ENV_BENCH_SWITCH_STEPS 30 // Steps between the phase changes it asks for
+#define SCENARIO_TOLERANCE 0.10f // Fraction a scenario may fall below its baseline before it is a regression
+#define MAX_SCENARIOS 16
+#define PROFILE_WINDOW 240 // Latest samples per profiled section, 4 s of frames at 60 FPS
+#define PROFILE_BUCKETS 16 // Power-of-two microsecond histogram buckets, the last open-ended
+#define METRICS_BODY_SIZE (512 * 1024) // Room for every junction's queue, light and detector series
+#define METRICS_POLL_MS 200 // How often the metrics thread checks for shutdown between scrapes
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS MSG_NOSIGNAL // A scraper hanging up must not kill the simulator
+#else
+#define METRICS_SEND_FLAGS 0
+#endif
+#define TELEMETRY_MAGIC "TRAFCOL1"
+#define TELEMETRY_RING 128 // Samples buffered for the telemetry writer, about 2 s at 60 Hz
+#define TELEMETRY_CHUNK_SAMPLES 64 // Samples encoded together into one chunk of each table
+#define TELEMETRY_MAX_COLUMNS 8
+#define TELEMETRY_POLL_MS 50 // How long the telemetry writer sleeps when the ring is empty
+#define MAX_TRACE_EVENTS (1 << 18) // Events kept for --trace, several minutes of a busy run
+#define MAX_TRACE_THREADS (MAX_WORKERS + MAX_RUN_THREADS + 1)
+
+// Green-wave coordination of junctions along a corridor
+#define COORD_SATURATION_FLOW (1.0f / 2.2f)  // veh/s through one green lane, the IDM discharge headway
+#define COORD_LOST_TIME 4.0f                 // s lost at each phase change until one is measured
+#define COORD_MIN_CYCLE 30.0f                // s
+#define COORD_MAX_CYCLE 120.0f               // s
+#define COORD_MIN_GREEN 7.0f                 // s
+#define COORD_MAX_CYCLE_CHANGE 0.15f         // Fraction the common cycle may change per plan
+#define COORD_MAX_OFFSET_STEP 0.2f           // Fraction of a cycle an offset may move per cycle
+#define COORD_FLOW_SMOOTHING 0.3f            // Weight of the newest flow measurement
+#define COORD_PLAN_TICKS (60000 / TICK_MS)   // Re-plan once a simulated minute
+#define MERGE_STEP 2.0f                      // px per tick a merging vehicle moves sideways
+
+// Signal timing; a T line in the network file sets a junction's own
+#define SIGNAL_YELLOW 3.5f       // s of yellow ending every green, whichever controller asked for the change
+#define SIGNAL_ALL_RED 1.5f      // s with the lanes that lost green red before any new green
+#define ACTUATED_MIN_GREEN 7.0f  // s, fully actuated control (--actuated)
+#define ACTUATED_PASSAGE 2.5f    // s of green added by each vehicle leaving a loop
+#define ACTUATED_MAX_GREEN 40.0f // s from the first call on the other phase
 
 typedef struct {
     char id[9];        
-    int x, y;          
+    float x, y;          
+    int junction;       // Junction whose approach (or box) the vehicle is on
     char lane;        
     int sublane;       
     bool active;
@@ -37,12 +127,144 @@ typedef struct {
     char target_lane;  
     int target_sublane; 
     int choice;
+    bool merging;       // Drifting sideways into the controlled sublane after a handoff
+    int pathId;         // Index into turnPaths while crossing the junction, -1 on a lane
+    int pathIndex;      // Current sample along that path
+    float pathDistance; // Arc length travelled along that path, px
+    bool cleared;       // Holds the conflict cells of the path it is about to enter
+    float speed;        // px/s along the lane or path
+    float accel;        // px/s^2 applied on the last tick
+    float desiredSpeed; // Car-following parameters, see IDM_* defaults
+    float maxAccel;
+    float comfortDecel;
+    float minGap;
+    float timeHeadway;
+    float reactionTime;
+    float waitTime;     // Time spent stopped with room ahead, compared against reactionTime
+    bool goOnYellow;    // Decided as its light turned yellow to carry on over the stop line
+    Uint64 queuedTick;  // Tick it joined its lane queue
+    Uint64 askingTick;  // One past the tick it first asked for conflict cells, 0 when not asking
     SDL_Color color;
 } Vehicle;
 
-Vehicle vehicles[MAX_VEHICLES];
+// Vehicle pool, grown a chunk at a time up to vehicleLimit. Chunks never move, so vehicle
+// indices and pointers stay valid while the pool grows.
+Vehicle* vehicleChunks[MAX_VEHICLE_CHUNKS];
+int vehicleCapacity = 0;                               // Slots allocated so far
+int vehicleSpan = 0;                                   // Slots up to the last active vehicle; scans stop here
+int vehicleLimit = MAX_VEHICLE_CHUNKS * VEHICLE_CHUNK; // Hard limit, --max-vehicles
+int queueLimit = 0;                                    // Hard limit per lane queue, --max-queue; 0 for none
+bool limitsConfigured = false;
+_Atomic Uint64 droppedSpawns = 0;       // Spawn requests refused: pool at its limit or spawn queue full
+_Atomic Uint64 droppedQueueEntries = 0; // Vehicles left out of a lane queue at its limit
+
+Vehicle* getVehicle(int i) {
+    return &vehicleChunks[i / VEHICLE_CHUNK][i % VEHICLE_CHUNK];
+}
+
+bool reserveVehicles(int capacity); // Defined with the lane store, which grows with the pool
+
+// Resize an array to hold count elements; on failure it keeps its old size and contents.
+// The simulator allocates through SDL's memory functions only, so --bench can count it.
+bool growArray(void** array, int count, size_t size) {
+    void* grown = SDL_realloc(*array, (size_t)count * size);
+    if (!grown) return false;
+    *array = grown;
+    return true;
+}
+
+// Memory for one simulation run. The vehicle pool, the lane store and the lane queues are
+// carved from it, sized up front from the run's configuration, and released together when
+// the next run starts. The arena keeps the most any run needed as a single block, so a
+// batch of runs stops going to malloc after the first. Used by the simulation thread only.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char* data; // ARENA_ALIGN aligned, inside the same allocation
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks; // Newest first; allocations come from the head
+    size_t reserved;    // Bytes across every block
+    size_t used;        // Bytes handed out this run, including space given up by growth
+    size_t peak;        // Most bytes any run used
+} Arena;
+
+Arena runArena;
+
+ArenaBlock* addArenaBlock(Arena* arena, size_t size) {
+    ArenaBlock* block = SDL_malloc(sizeof(ArenaBlock) + ARENA_ALIGN + size);
+    if (!block) return NULL;
+    uintptr_t data = ((uintptr_t)(block + 1) + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+    block->data = (char*)data;
+    block->size = size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->reserved += size;
+    return block;
+}
+
+// Uninitialised memory for the rest of the run, or NULL when out of memory. A run that
+// outgrows its reservation gets another block at least as large as all the others.
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        block = addArenaBlock(arena, arena->reserved > size ? arena->reserved : size);
+        if (!block) return NULL;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    return memory;
+}
+
+void releaseArena(Arena* arena) {
+    while (arena->blocks) {
+        ArenaBlock* next = arena->blocks->next;
+        SDL_free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->reserved = 0;
+    arena->used = 0;
+}
+
+// Drop everything allocated so far and make room for at least size bytes, or for as much
+// as the busiest run so far, in a single block. Every pointer into the arena is invalid.
+bool resetArena(Arena* arena, size_t size) {
+    if (size < arena->peak) size = arena->peak;
+    if (arena->blocks && !arena->blocks->next && arena->blocks->size >= size) {
+        arena->blocks->used = 0;
+        arena->used = 0;
+        return true;
+    }
+    releaseArena(arena);
+    return addArenaBlock(arena, size) != NULL;
+}
+
+// Move an array into a larger one from the run arena. The old space is only reclaimed when
+// the run ends, so callers grow geometrically.
+bool growRunArray(void** array, int oldCount, int count, size_t size) {
+    void* grown = arenaAlloc(&runArena, (size_t)count * size);
+    if (!grown) return false;
+    if (*array) memcpy(grown, *array, (size_t)oldCount * size);
+    *array = grown;
+    return true;
+}
 
-SDL_mutex* vehicleMutex;
+// Ownership between threads. The vehicle pool and the lane store belong to the simulation
+// thread (and its workers during a tick); everything shared has its own guard:
+//   networkMutex       topology, corridors and the coordination plan
+//   junctionLocks[j]   lane queues and adaptive controller state of junction j
+//   spawnLocks[g]      pending spawns of lane group g
+//   signal phases are published with a sequence lock; arrivals, rngState are atomics
+// Locks are taken in that order, junctions by ascending index, at most one spawn lock at a time.
+SDL_mutex* networkMutex;
+SDL_mutex* junctionLocks[MAX_JUNCTIONS];
+SDL_mutex* spawnLocks[MAX_LANE_GROUPS];
 
 
 typedef struct{
@@ -52,22 +274,788 @@ typedef struct{
 
 
 
-typedef struct {
-    bool green;
-} TrafficLight;
 
-TrafficLight trafficLights[4];
 
 
 // Queue implementation for traffic management
 typedef struct {
-    int vehicleIndices[MAX_QUEUE_SIZE]; // Stores indices of vehicles in queue
+    int* vehicleIndices; // Ring of vehicle indices, grown as the queue fills
+    int capacity;
     int front;
     int rear;
     int size;
 } TrafficQueue;
 
-TrafficQueue laneQueues[NUM_LANES];
+// Interval of a junction's signal
+typedef enum {
+    INTERVAL_GREEN,   // Showing the green lanes the controller asked for, or none
+    INTERVAL_YELLOW,  // Lanes losing their green show yellow
+    INTERVAL_ALL_RED  // They have turned red and the junction clears, before any new green
+} SignalInterval;
+
+// State kept by the advanced traffic light controller between decisions. Junctions on a
+// coordinated corridor instead run a fixed-time plan: east-west green for the first
+// greenTicks of every cycle, north-south for the rest, shifted by offsetTicks.
+typedef struct {
+    int currentServingLane;
+    int highestPriorityLane;
+    Uint64 lastRotationTick;
+    bool coordinated;
+    Uint32 greenTicks;
+    Uint32 pendingGreenTicks;  // Takes effect at the start of the junction's next cycle
+    Uint32 offsetTicks;
+    Uint32 targetOffsetTicks;  // Reached a bounded step per cycle
+    _Atomic int arrivals[NUM_LANES]; // Vehicles joining each controlled approach since the last plan
+    float flow[NUM_LANES];     // Smoothed arrival rate per approach, veh/s
+    // The junction's loops as the controller last read them from its detector feed
+    Uint64 detectorWindowStart;                          // Tick the current occupancy window began
+    bool detectorOccupied[MAX_DETECTORS_PER_JUNCTION];
+    Uint64 detectorOnSince[MAX_DETECTORS_PER_JUNCTION];  // Tick the loop last went occupied
+    Uint32 detectorOnTicks[MAX_DETECTORS_PER_JUNCTION];  // Occupied ticks within the window
+    float occupancy[NUM_LANES];   // Share of the last window each approach's stop-bar loop was occupied
+    int advanceCounts[NUM_LANES]; // Vehicles each approach's advance loops saw in the last window
+    int windowCounts[NUM_LANES];  // Seen so far in the current window
+    Uint64 lastActuation[NUM_LANES]; // Tick a loop of the approach last went occupied or clear
+    bool called[NUM_LANES];          // A vehicle drove onto an advance loop of the approach while it was red
+    // Actuated control, stepped every tick by applyActuatedLights()
+    int actuatedPhase;        // Asked for: 0 east-west (lanes A and B), 1 north-south (C and D), -1 none yet
+    bool maxTiming;           // The other phase has called since this green began
+    Uint64 maxStart;          // Tick of that first call
+} ControllerState;
+
+// Current signal phase of a junction, published lock-free with a sequence lock: the
+// sequence number is odd while a thread is writing, and readers retry until they see the
+// same even number before and after reading the fields. Controllers write the request;
+// the simulation thread moves the lights towards it, see stepSignals().
+typedef struct {
+    _Atomic Uint32 sequence;
+    _Atomic Uint32 phaseId;        // Incremented every time the lights change
+    _Atomic Uint32 greenMask;      // Bit n set while lane 'A' + n has a green light
+    _Atomic Uint32 yellowMask;     // Bit n set while lane 'A' + n shows yellow
+    _Atomic int interval;          // SignalInterval
+    _Atomic Uint64 startTick;      // Tick the lights last changed
+    _Atomic Uint32 requestedMask;  // Green lanes the controller asks for
+    _Atomic Uint64 plannedEndTick; // Tick the controller currently plans to end them, 0 if open-ended
+} SignalState;
+
+// A consistent copy of a SignalState
+typedef struct {
+    Uint32 phaseId;
+    Uint32 greenMask;
+    Uint32 yellowMask;
+    SignalInterval interval;
+    Uint64 startTick;
+    Uint32 requestedMask;
+    Uint64 plannedEndTick;
+} SignalPhase;
+
+// Time a junction's signal loses to changes of green, kept by stepSignals(). The totals
+// feed the corridor plans on the controller thread and are copied out to --metrics.
+typedef struct {
+    Uint64 yellowStart;    // Tick the last change of green began
+    Uint32 clearingMask;   // Lanes that lost their green then, until the next green comes on
+    Uint64 greenStart;     // Tick the lanes below got their green
+    Uint32 startingMask;   // Lanes with vehicles waiting then, until the first one crosses
+    Uint64 clearanceTicks; // Of the last change: yellow and all-red after the last vehicle through
+    _Atomic Uint64 changes;            // Changes of green cleared through yellow and all-red this run
+    _Atomic Uint64 totalClearanceTicks;
+    _Atomic Uint64 totalStartupTicks;  // Green before the first waiting vehicle crossed
+} LostTime;
+
+// One signalised crossing. Lanes A-D keep their meaning at every junction: A travels
+// east, B west, C south and D north, so a vehicle keeps its lane letter from one
+// junction to the next.
+typedef struct {
+    int id;
+    int cx, cy;                         // Centre in world coordinates
+    int neighbour[NUM_LANES];           // Junction reached by leaving on lane A-D, -1 at the network edge
+    TrafficQueue laneQueues[NUM_LANES];
+    SignalState signal;
+    LostTime lostTime;
+    ControllerState controller;
+} Junction;
+
+Junction junctions[MAX_JUNCTIONS];
+int numJunctions = 0;
+
+// Timing plan of an actuated junction, in seconds
+typedef struct {
+    float minGreen;
+    float passage;  // Gap after the last vehicle that ends a green with the other phase calling
+    float maxGreen; // Longest green once the other phase calls
+    float yellow;
+    float allRed;
+} SignalTiming;
+
+const SignalTiming defaultSignalTiming = {
+    ACTUATED_MIN_GREEN, ACTUATED_PASSAGE, ACTUATED_MAX_GREEN, SIGNAL_YELLOW, SIGNAL_ALL_RED
+};
+SignalTiming signalTimings[MAX_JUNCTIONS]; // Per junction, from the network file
+bool actuatedControl = false; // --actuated: junctions off the corridor plans run the actuated controller
+
+typedef enum {
+    DETECTOR_PRESENCE, // Stop-bar loop: whether anything is standing or moving over it
+    DETECTOR_COUNT,    // Advance loop: counts the vehicles driving onto it
+    NUM_DETECTOR_TYPES
+} DetectorType;
+
+// A virtual loop detector on one lane group. A vehicle is over it while its body overlaps
+// the stretch of lane from setback + length to setback pixels before the stop line.
+typedef struct {
+    int group;          // Lane group it sits in
+    DetectorType type;
+    float setback;      // px from the stop line back to the loop's downstream edge
+    float length;       // px along the lane
+    // Updated by the lane group's step
+    int occupants;      // Vehicles over the loop
+    bool changed;       // Went occupied or clear on the last tick
+    Uint64 count;       // Vehicles that have driven onto the loop
+    Uint64 onTicks;     // Ticks spent occupied
+} Detector;
+
+// Loops of the whole network, sorted by lane group: group g has detectors
+// detectorStart[g] .. detectorStart[g + 1] - 1. Laid out by buildDetectors().
+Detector detectors[MAX_DETECTORS];
+int numDetectors = 0;
+int detectorStart[MAX_LANE_GROUPS + 1];
+Detector detectorSpecs[MAX_DETECTORS]; // Loops given in the network file
+int numDetectorSpecs = 0;
+
+// A loop going occupied or clear
+typedef struct {
+    Uint64 tick;
+    int detector; // Index into detectors
+    bool occupied;
+} DetectorEvent;
+
+// Detector events of one junction, from the simulation thread to whichever controller holds
+// the junction's lock. Events that find the ring full are dropped and counted.
+typedef struct {
+    DetectorEvent ring[DETECTOR_EVENT_RING];
+    _Atomic Uint64 head; // Events posted by the simulation thread
+    _Atomic Uint64 tail; // Events read by the controller
+} DetectorFeed;
+
+DetectorFeed detectorFeeds[MAX_JUNCTIONS];
+_Atomic Uint64 droppedDetectorEvents = 0;
+
+// Tick the last vehicle of each lane group crossed its stop line, set by the group's step
+Uint64 lastDischargeTick[MAX_LANE_GROUPS];
+
+// Area covered by the network; roads at the edge of the network run out to it
+int worldMinX, worldMinY, worldMaxX, worldMaxY;
+
+// Simulation clock, counted in ticks of TICK_MS
+_Atomic Uint64 simTick = 0; // Advanced by the simulation thread, read by the controllers
+
+bool pacedTicks = true; // updateVehicles() waits out each tick; headless runs go flat out
+bool logEvents = true; // Print a line for every vehicle spawned or read and every light decision
+
+// Random number generator state (xorshift64*), advanced lock-free by any thread
+_Atomic Uint64 rngState = 0x9E3779B97F4A7C15ULL;
+
+void seedRandom(Uint64 seed) {
+    atomic_store(&rngState, seed ? seed : 0x9E3779B97F4A7C15ULL); // xorshift must not start at zero
+}
+
+// Returns a value in [0, 2^31), same range as rand()
+int simRandom() {
+    Uint64 state = atomic_load_explicit(&rngState, memory_order_relaxed);
+    Uint64 next;
+    do {
+        next = state;
+        next ^= next >> 12;
+        next ^= next << 25;
+        next ^= next >> 27;
+    } while (!atomic_compare_exchange_weak_explicit(&rngState, &state, next, memory_order_relaxed, memory_order_relaxed));
+    return (int)((next * 0x2545F4914F6CDD1DULL) >> 33);
+}
+
+// Create every lock up front, so they survive network reloads and checkpoint restores
+bool initLocks() {
+    networkMutex = SDL_CreateMutex();
+    if (!networkMutex) return false;
+    for (int j = 0; j < MAX_JUNCTIONS; j++) {
+        junctionLocks[j] = SDL_CreateMutex();
+        if (!junctionLocks[j]) return false;
+    }
+    for (int g = 0; g < MAX_LANE_GROUPS; g++) {
+        spawnLocks[g] = SDL_CreateMutex();
+        if (!spawnLocks[g]) return false;
+    }
+    return true;
+}
+
+void destroyLocks() {
+    for (int g = 0; g < MAX_LANE_GROUPS; g++) {
+        if (spawnLocks[g]) SDL_DestroyMutex(spawnLocks[g]);
+    }
+    for (int j = 0; j < MAX_JUNCTIONS; j++) {
+        if (junctionLocks[j]) SDL_DestroyMutex(junctionLocks[j]);
+    }
+    if (networkMutex) SDL_DestroyMutex(networkMutex);
+}
+
+// Lifecycle of the background threads. Each one loops until a stop is requested and
+// waits between rounds with waitForStop(), so it wakes at once on shutdown, finishes
+// the round it is in without holding a lock, and is joined by stopRunThreads().
+typedef struct {
+    _Atomic bool stopRequested;
+    pthread_mutex_t mutex;
+    pthread_cond_t stopped; // Broadcast when a stop is requested
+    pthread_t threads[MAX_RUN_THREADS];
+    const char* names[MAX_RUN_THREADS];
+    int numThreads;
+    clockid_t clock; // The one pthread_cond_timedwait() measures deadlines on
+} RunControl;
+
+RunControl runControl;
+
+bool initRunControl() {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) return false;
+    // Timed waits immune to clock changes where the threads library can do it. winpthreads
+    // waits on the realtime clock whatever the attribute says, and macOS has no setclock.
+    runControl.clock = CLOCK_REALTIME;
+#if !defined(_WIN32) && defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION > 0
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0) runControl.clock = CLOCK_MONOTONIC;
+#endif
+    bool ok = pthread_mutex_init(&runControl.mutex, NULL) == 0;
+    if (ok && pthread_cond_init(&runControl.stopped, &attr) != 0) {
+        pthread_mutex_destroy(&runControl.mutex);
+        ok = false;
+    }
+    pthread_condattr_destroy(&attr);
+    atomic_store(&runControl.stopRequested, false);
+    runControl.numThreads = 0;
+    return ok;
+}
+
+void destroyRunControl() {
+    pthread_cond_destroy(&runControl.stopped);
+    pthread_mutex_destroy(&runControl.mutex);
+}
+
+bool isStopRequested() {
+    return atomic_load_explicit(&runControl.stopRequested, memory_order_acquire);
+}
+
+void requestStop() {
+    pthread_mutex_lock(&runControl.mutex);
+    atomic_store_explicit(&runControl.stopRequested, true, memory_order_release);
+    pthread_cond_broadcast(&runControl.stopped);
+    pthread_mutex_unlock(&runControl.mutex);
+}
+
+// Sleep for up to ms milliseconds; returns true if a stop was requested
+bool waitForStop(Uint32 ms) {
+    struct timespec deadline;
+    clock_gettime(runControl.clock, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&runControl.mutex);
+    while (!isStopRequested()) {
+        if (pthread_cond_timedwait(&runControl.stopped, &runControl.mutex, &deadline) != 0) break; // Timed out
+    }
+    pthread_mutex_unlock(&runControl.mutex);
+    return isStopRequested();
+}
+
+bool startRunThread(const char* name, void* (*threadMain)(void*)) {
+    if (runControl.numThreads >= MAX_RUN_THREADS) return false;
+    if (pthread_create(&runControl.threads[runControl.numThreads], NULL, threadMain, NULL) != 0) {
+        SDL_Log("Failed to create %s thread", name);
+        return false;
+    }
+    runControl.names[runControl.numThreads++] = name;
+    return true;
+}
+
+// Ask every background thread to stop, join them newest first and flush what they wrote.
+// The run control is ready for the next run afterwards.
+void stopRunThreads() {
+    requestStop();
+    while (runControl.numThreads > 0) {
+        runControl.numThreads--;
+        pthread_join(runControl.threads[runControl.numThreads], NULL);
+        printf("Stopped %s thread\n", runControl.names[runControl.numThreads]);
+    }
+    fflush(stdout);
+    atomic_store(&runControl.stopRequested, false);
+}
+
+// Where each frame's time goes. Sections are timed with profileBegin()/profileEnd() on
+// whichever thread runs them and kept both as a rolling window, shown by the F3 overlay,
+// and as totals for the whole run, printed on exit.
+typedef enum {
+    PROF_EVENTS,
+    PROF_INGEST,
+    PROF_VEHICLES,
+    PROF_PACING,   // updateVehicles() waiting out a paced tick
+    PROF_QUEUES,
+    PROF_CONTROLLER,
+    PROF_GENERATE,
+    PROF_PARSE_FILE,
+    PROF_DRAW_ROADS,
+    PROF_DRAW_LIGHTS,
+    PROF_DRAW_VEHICLES,
+    PROF_DRAW_QUEUES,
+    PROF_PRESENT,
+    PROF_FRAME,    // Work done in one frame, before the frame cap wait
+    PROF_INTERVAL, // Start to start of consecutive frames
+    NUM_PROFILE_SECTIONS
+} ProfileSection;
+
+const char* profileNames[NUM_PROFILE_SECTIONS] = {
+    "events", "ingest spawns", "update vehicles", "tick pacing", "update queues", "controller", "generate vehicles",
+    "parse vehicle file", "draw roads",
+    "draw lights", "draw vehicles", "draw queues", "present", "frame work", "frame interval"
+};
+
+typedef struct {
+    Uint32 window[PROFILE_WINDOW];    // Latest durations, us
+    int next;
+    int filled;
+    Uint64 buckets[PROFILE_BUCKETS];  // Histogram of the window
+    Uint64 runBuckets[PROFILE_BUCKETS]; // Histogram of the whole run
+    Uint64 count;
+    Uint64 totalMicros;
+    Uint32 maxMicros;
+} ProfileStats;
+
+ProfileStats profile[NUM_PROFILE_SECTIONS];
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+_Atomic bool profiling = false;   // Switched on by the windowed run; headless runs leave it off
+_Atomic bool showProfile = false; // F3 overlay, toggled by the UI thread while others read it
+
+// Bucket b holds durations below 2^b us
+int getProfileBucket(Uint32 micros) {
+    int bucket = 0;
+    while (micros > 0 && bucket < PROFILE_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Upper bound of the bucket holding the given fraction of the samples, capped at the largest
+Uint32 getProfilePercentile(const Uint64* buckets, Uint64 count, float fraction, Uint32 max) {
+    Uint64 seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > 0 && seen >= count * fraction) return (1u << b) < max ? (1u << b) : max;
+    }
+    return max;
+}
+
+void recordProfile(ProfileSection section, Uint32 micros) {
+    ProfileStats* stats = &profile[section];
+    int bucket = getProfileBucket(micros);
+    pthread_mutex_lock(&profileMutex);
+    if (stats->filled == PROFILE_WINDOW) {
+        stats->buckets[getProfileBucket(stats->window[stats->next])]--; // Oldest sample leaves the window
+    } else {
+        stats->filled++;
+    }
+    stats->window[stats->next] = micros;
+    stats->next = (stats->next + 1) % PROFILE_WINDOW;
+    stats->buckets[bucket]++;
+    stats->runBuckets[bucket]++;
+    stats->count++;
+    stats->totalMicros += micros;
+    if (micros > stats->maxMicros) stats->maxMicros = micros;
+    pthread_mutex_unlock(&profileMutex);
+}
+
+// Trace of every phase on every thread, written with --trace as Chrome trace event JSON
+// (chrome://tracing, Perfetto). Threads append to one fixed buffer through an atomic
+// index; it is written out once the threads have been joined.
+typedef struct {
+    const char* name;
+    const char* category;
+    Uint64 start;   // Performance counter
+    Uint64 end;     // Same as start for an instant event
+    int thread;
+    int junction;   // Light changes only
+    Uint32 mask;    // Green lanes of a light change
+    Uint32 yellowMask;
+    char phase;     // 'X' span, 'i' instant
+} TraceEvent;
+
+_Atomic bool tracing = false;
+TraceEvent traceEvents[MAX_TRACE_EVENTS];
+_Atomic Uint32 traceCount = 0;
+_Atomic Uint32 traceDropped = 0;
+Uint64 traceOrigin;
+char traceThreadNames[MAX_TRACE_THREADS][24];
+_Atomic int traceThreads = 0;
+static _Thread_local int traceThread = -1;
+
+// Name the calling thread in the trace; unnamed threads are numbered on their first event
+void traceThreadName(const char* name) {
+    if (traceThread < 0) {
+        int thread = atomic_fetch_add(&traceThreads, 1);
+        if (thread >= MAX_TRACE_THREADS) {
+            atomic_fetch_sub(&traceThreads, 1);
+            return;
+        }
+        traceThread = thread;
+    }
+    snprintf(traceThreadNames[traceThread], sizeof(traceThreadNames[0]), "%s", name);
+}
+
+TraceEvent* appendTraceEvent() {
+    if (traceThread < 0) {
+        char name[24];
+        snprintf(name, sizeof(name), "thread %d", atomic_load(&traceThreads));
+        traceThreadName(name);
+        if (traceThread < 0) return NULL;
+    }
+    Uint32 index = atomic_fetch_add_explicit(&traceCount, 1, memory_order_relaxed);
+    if (index >= MAX_TRACE_EVENTS) {
+        atomic_fetch_add_explicit(&traceDropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    TraceEvent* event = &traceEvents[index];
+    event->thread = traceThread;
+    event->junction = -1;
+    event->mask = 0;
+    event->yellowMask = 0;
+    return event;
+}
+
+// A span from start until now
+void traceSpan(const char* name, const char* category, Uint64 start) {
+    if (!tracing) return;
+    Uint64 end = SDL_GetPerformanceCounter();
+    TraceEvent* event = appendTraceEvent();
+    if (!event) return;
+    event->name = name;
+    event->category = category;
+    event->start = start;
+    event->end = end;
+    event->phase = 'X';
+}
+
+void traceLightChange(int junction, Uint32 greenMask, Uint32 yellowMask) {
+    if (!tracing) return;
+    TraceEvent* event = appendTraceEvent();
+    if (!event) return;
+    event->name = "light change";
+    event->category = "signal";
+    event->start = event->end = SDL_GetPerformanceCounter();
+    event->junction = junction;
+    event->mask = greenMask;
+    event->yellowMask = yellowMask;
+    event->phase = 'i';
+}
+
+bool writeTrace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror("Error opening trace file");
+        return false;
+    }
+    double microsPerTick = 1000000.0 / SDL_GetPerformanceFrequency();
+    Uint32 count = atomic_load(&traceCount);
+    if (count > MAX_TRACE_EVENTS) count = MAX_TRACE_EVENTS;
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"simulator\"}}");
+    int threads = atomic_load(&traceThreads);
+    for (int t = 0; t < threads && t < MAX_TRACE_THREADS; t++) {
+        fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                t, traceThreadNames[t]);
+    }
+    for (Uint32 k = 0; k < count; k++) {
+        const TraceEvent* event = &traceEvents[k];
+        double ts = (Sint64)(event->start - traceOrigin) * microsPerTick;
+        if (event->phase == 'X') {
+            fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+                    event->name, event->category, ts, (event->end - event->start) * microsPerTick, event->thread);
+        } else {
+            fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"junction\": %d, \"green\": \"%s%s%s%s\", \"yellow\": \"%s%s%s%s\"}}",
+                    event->name, event->category, ts, event->thread, event->junction,
+                    event->mask & 1 ? "A" : "", event->mask & 2 ? "B" : "", event->mask & 4 ? "C" : "", event->mask & 8 ? "D" : "",
+                    event->yellowMask & 1 ? "A" : "", event->yellowMask & 2 ? "B" : "", event->yellowMask & 4 ? "C" : "",
+                    event->yellowMask & 8 ? "D" : "");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    bool ok = fclose(file) == 0;
+
+    Uint32 dropped = atomic_load(&traceDropped);
+    printf("Trace of %u events written to %s%s\n", count, path, dropped ? " (buffer full, later events dropped)" : "");
+    return ok;
+}
+
+Uint64 profileBegin() {
+    return profiling || tracing ? SDL_GetPerformanceCounter() : 0;
+}
+
+void profileEnd(ProfileSection section, Uint64 start) {
+    if (profiling) {
+        Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+        recordProfile(section, (Uint32)(elapsed * 1000000 / SDL_GetPerformanceFrequency()));
+    }
+    traceSpan(profileNames[section], "phase", start);
+}
+
+// Every place a shared lock is taken, with how often it was taken there, how long it
+// waited and how long it was held. Kept in atomics so the statistics add no lock of their
+// own; collected whenever the profiler or the trace is on.
+typedef enum {
+    LOCK_CONTROLLER_NETWORK,
+    LOCK_CONTROLLER_JUNCTION,
+    LOCK_QUEUES_JUNCTION,
+    LOCK_COORDINATED_LIGHTS,
+    LOCK_ACTUATED_NETWORK,
+    LOCK_ACTUATED_JUNCTION,
+    LOCK_ADMIT_SPAWNS,
+    LOCK_POST_SPAWN,
+    LOCK_SPAWN_ENTRY,
+    LOCK_GENERATOR_NETWORK,
+    LOCK_CHECKPOINT_NETWORK,
+    LOCK_CHECKPOINT_JUNCTION,
+    NUM_LOCK_SITES
+} LockSite;
+
+const char* lockSiteNames[NUM_LOCK_SITES] = {
+    "controller: network", "controller: junction", "updateTrafficQueues: junction",
+    "updateVehicles: coordinated lights", "updateVehicles: actuated network", "updateVehicles: actuated junction",
+    "updateVehicles: admit spawns", "spawnVehicleAt: spawn queue", "spawnVehicle: entry lookup",
+    "generateVehicles: network", "checkpoint: network", "checkpoint: junction"
+};
+
+typedef struct {
+    _Atomic Uint64 acquisitions;
+    _Atomic Uint64 contended;        // Waited a microsecond or more
+    _Atomic Uint64 waitMicros;
+    _Atomic Uint64 holdMicros;
+    _Atomic Uint32 maxWaitMicros;
+    _Atomic Uint32 maxHoldMicros;
+    _Atomic Uint64 waitBuckets[PROFILE_BUCKETS];
+    _Atomic Uint64 holdBuckets[PROFILE_BUCKETS];
+} LockStats;
+
+LockStats lockStats[NUM_LOCK_SITES];
+
+Uint32 getElapsedMicros(Uint64 start, Uint64 end) {
+    return (Uint32)((end - start) * 1000000 / SDL_GetPerformanceFrequency());
+}
+
+void raiseAtomicMax(_Atomic Uint32* max, Uint32 value) {
+    Uint32 current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(max, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Take a lock at a call site; returns when it was acquired, for unlockMutex()
+Uint64 lockMutex(SDL_mutex* mutex, LockSite site) {
+    if (!profiling && !tracing) {
+        SDL_LockMutex(mutex);
+        return 0;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    SDL_LockMutex(mutex);
+    Uint64 acquired = SDL_GetPerformanceCounter();
+
+    LockStats* stats = &lockStats[site];
+    Uint32 wait = getElapsedMicros(start, acquired);
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->waitBuckets[getProfileBucket(wait)], 1, memory_order_relaxed);
+    if (wait > 0) {
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->waitMicros, wait, memory_order_relaxed);
+        raiseAtomicMax(&stats->maxWaitMicros, wait);
+        traceSpan(lockSiteNames[site], "lock wait", start);
+    }
+    return acquired;
+}
+
+void unlockMutex(SDL_mutex* mutex, LockSite site, Uint64 acquired) {
+    if (acquired == 0) {
+        SDL_UnlockMutex(mutex);
+        return;
+    }
+    Uint32 hold = getElapsedMicros(acquired, SDL_GetPerformanceCounter());
+    SDL_UnlockMutex(mutex);
+
+    LockStats* stats = &lockStats[site];
+    atomic_fetch_add_explicit(&stats->holdMicros, hold, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->holdBuckets[getProfileBucket(hold)], 1, memory_order_relaxed);
+    raiseAtomicMax(&stats->maxHoldMicros, hold);
+}
+
+// Copy a site's histograms out of the atomics
+void readLockBuckets(LockStats* stats, Uint64* waitBuckets, Uint64* holdBuckets) {
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        waitBuckets[b] = atomic_load_explicit(&stats->waitBuckets[b], memory_order_relaxed);
+        holdBuckets[b] = atomic_load_explicit(&stats->holdBuckets[b], memory_order_relaxed);
+    }
+}
+
+// One line per call site that took its lock, with the wait and hold histograms as counts
+// per power-of-two microsecond bucket
+void printLockStats() {
+    printf("%-36s %9s %10s %9s %9s %9s %9s %9s  (us)\n", "lock site", "count", "contended", "wait avg", "wait p95",
+           "wait max", "hold avg", "hold max");
+    for (int site = 0; site < NUM_LOCK_SITES; site++) {
+        LockStats* stats = &lockStats[site];
+        Uint64 count = atomic_load(&stats->acquisitions);
+        if (count == 0) continue;
+        Uint64 waitBuckets[PROFILE_BUCKETS], holdBuckets[PROFILE_BUCKETS];
+        readLockBuckets(stats, waitBuckets, holdBuckets);
+        Uint32 maxWait = atomic_load(&stats->maxWaitMicros);
+        printf("%-36s %9llu %9.1f%% %9.2f %9u %9u %9.2f %9u\n", lockSiteNames[site], (unsigned long long)count,
+               100.0 * atomic_load(&stats->contended) / count, (double)atomic_load(&stats->waitMicros) / count,
+               getProfilePercentile(waitBuckets, count, 0.95f, maxWait), maxWait,
+               (double)atomic_load(&stats->holdMicros) / count, atomic_load(&stats->maxHoldMicros));
+        printf("    wait histogram:");
+        for (int b = 0; b < PROFILE_BUCKETS; b++) printf(" %llu", (unsigned long long)waitBuckets[b]);
+        printf("\n    hold histogram:");
+        for (int b = 0; b < PROFILE_BUCKETS; b++) printf(" %llu", (unsigned long long)holdBuckets[b]);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Live counters for the --metrics endpoint. The simulation thread publishes them as plain
+// atomics and the endpoint only ever reads these, never the vehicles or the junctions.
+typedef struct {
+    _Atomic Uint64 spawns;                           // Vehicles admitted onto the network
+    _Atomic Uint64 discharges;                       // Vehicles crossing a stop line
+    _Atomic Uint64 conflictWaits;                    // Ticks vehicles spent refused their conflict cells
+    _Atomic Uint64 ticks;
+    _Atomic Uint64 tickMicros;                       // Sum of tick durations
+    _Atomic Uint32 maxTickMicros;
+    _Atomic Uint64 tickBuckets[PROFILE_BUCKETS];     // Power-of-two microsecond buckets
+    _Atomic Uint64 simTick;
+    _Atomic int activeVehicles;
+    _Atomic int junctions;
+    _Atomic int junctionIds[MAX_JUNCTIONS];
+    _Atomic int queueLengths[MAX_JUNCTIONS][NUM_LANES];
+    _Atomic Uint32 greenMasks[MAX_JUNCTIONS];
+    _Atomic Uint32 yellowMasks[MAX_JUNCTIONS];
+    _Atomic Uint32 phaseIds[MAX_JUNCTIONS];
+    _Atomic Uint64 phaseStartTicks[MAX_JUNCTIONS];
+    _Atomic Uint64 gapOuts[MAX_JUNCTIONS];           // Actuated greens ended by a gap in traffic
+    _Atomic Uint64 maxOuts[MAX_JUNCTIONS];           // Actuated greens ended by max green
+    _Atomic Uint64 greenChanges[MAX_JUNCTIONS];      // Changes of green cleared through yellow and all-red
+    _Atomic Uint64 clearanceLostTicks[MAX_JUNCTIONS]; // Yellow and all-red after the last vehicle through
+    _Atomic Uint64 startupLostTicks[MAX_JUNCTIONS];  // Green before the first waiting vehicle crossed
+    _Atomic int detectors;
+    _Atomic int detectorKeys[MAX_DETECTORS];      // Lane group * NUM_DETECTOR_TYPES + type
+    _Atomic Uint64 detectorCounts[MAX_DETECTORS];
+    _Atomic Uint64 detectorOnTicks[MAX_DETECTORS];
+} Metrics;
+
+Metrics metrics;
+bool metricsEnabled = false; // Set when --metrics is serving
+
+void recordTickMetrics(Uint32 micros) {
+    atomic_fetch_add_explicit(&metrics.ticks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.tickMicros, micros, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.tickBuckets[getProfileBucket(micros)], 1, memory_order_relaxed);
+    raiseAtomicMax(&metrics.maxTickMicros, micros);
+}
+
+// Vehicles and queue entries refused for lack of room, shown when a limit was set or
+// anything was dropped
+void printDrops() {
+    Uint64 spawns = atomic_load(&droppedSpawns);
+    Uint64 entries = atomic_load(&droppedQueueEntries);
+    if (!limitsConfigured && spawns == 0 && entries == 0) return;
+    printf("Vehicle pool: %d slots, limit %d, dropped %llu spawn requests\n", vehicleCapacity, vehicleLimit,
+           (unsigned long long)spawns);
+    if (queueLimit > 0) {
+        printf("Lane queues: limit %d, dropped %llu entries\n", queueLimit, (unsigned long long)entries);
+    } else {
+        printf("Lane queues: no limit, dropped %llu entries\n", (unsigned long long)entries);
+    }
+    fflush(stdout);
+}
+
+// Whole-run summary, one line per section that ran
+void printProfile() {
+    pthread_mutex_lock(&profileMutex);
+    printf("%-16s %8s %9s %9s %9s %9s %9s  (ms)\n", "section", "count", "mean", "p50", "p95", "p99", "max");
+    for (int s = 0; s < NUM_PROFILE_SECTIONS; s++) {
+        const ProfileStats* stats = &profile[s];
+        if (stats->count == 0) continue;
+        printf("%-16s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n", profileNames[s], (unsigned long long)stats->count,
+               stats->totalMicros / 1000.0 / stats->count,
+               getProfilePercentile(stats->runBuckets, stats->count, 0.5f, stats->maxMicros) / 1000.0,
+               getProfilePercentile(stats->runBuckets, stats->count, 0.95f, stats->maxMicros) / 1000.0,
+               getProfilePercentile(stats->runBuckets, stats->count, 0.99f, stats->maxMicros) / 1000.0,
+               stats->maxMicros / 1000.0);
+    }
+    pthread_mutex_unlock(&profileMutex);
+    fflush(stdout);
+}
+
+// Read the whole phase consistently, without blocking the controller
+void readSignalPhase(Junction* junction, SignalPhase* phase) {
+    SignalState* signal = &junction->signal;
+    Uint32 before, after;
+    do {
+        before = atomic_load_explicit(&signal->sequence, memory_order_acquire);
+        phase->phaseId = atomic_load_explicit(&signal->phaseId, memory_order_relaxed);
+        phase->greenMask = atomic_load_explicit(&signal->greenMask, memory_order_relaxed);
+        phase->yellowMask = atomic_load_explicit(&signal->yellowMask, memory_order_relaxed);
+        phase->interval = atomic_load_explicit(&signal->interval, memory_order_relaxed);
+        phase->startTick = atomic_load_explicit(&signal->startTick, memory_order_relaxed);
+        phase->requestedMask = atomic_load_explicit(&signal->requestedMask, memory_order_relaxed);
+        phase->plannedEndTick = atomic_load_explicit(&signal->plannedEndTick, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&signal->sequence, memory_order_relaxed);
+    } while (before != after || (before & 1));
+}
+
+// Claim the odd sequence number; a controller and the simulation thread write in turn
+Uint32 beginSignalWrite(SignalState* signal) {
+    Uint32 sequence = atomic_load_explicit(&signal->sequence, memory_order_relaxed);
+    while ((sequence & 1) || !atomic_compare_exchange_weak_explicit(&signal->sequence, &sequence, sequence + 1,
+                                                                     memory_order_acquire, memory_order_relaxed)) {
+        sequence = atomic_load_explicit(&signal->sequence, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+    return sequence;
+}
+
+void endSignalWrite(SignalState* signal, Uint32 sequence) {
+    atomic_store_explicit(&signal->sequence, sequence + 2, memory_order_release);
+}
+
+// Ask for the lanes that should be green and when the controller expects to change them.
+// The lights follow on the next tick, through yellow and all-red for any lane losing its
+// green; the same green lanes only update the planned end.
+void requestSignalPhase(Junction* junction, Uint32 greenMask, Uint64 plannedEndTick) {
+    SignalState* signal = &junction->signal;
+    Uint32 sequence = beginSignalWrite(signal);
+    atomic_store_explicit(&signal->requestedMask, greenMask, memory_order_relaxed);
+    atomic_store_explicit(&signal->plannedEndTick, plannedEndTick, memory_order_relaxed);
+    endSignalWrite(signal, sequence);
+}
+
+// Change the lights themselves. Only the simulation thread does, between ticks.
+void showSignal(Junction* junction, SignalInterval interval, Uint32 greenMask, Uint32 yellowMask) {
+    SignalState* signal = &junction->signal;
+    Uint32 sequence = beginSignalWrite(signal);
+    atomic_store_explicit(&signal->phaseId, atomic_load_explicit(&signal->phaseId, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&signal->greenMask, greenMask, memory_order_relaxed);
+    atomic_store_explicit(&signal->yellowMask, yellowMask, memory_order_relaxed);
+    atomic_store_explicit(&signal->interval, interval, memory_order_relaxed);
+    atomic_store_explicit(&signal->startTick, simTick, memory_order_relaxed);
+    endSignalWrite(signal, sequence);
+    traceLightChange(junction->id, greenMask, yellowMask);
+}
 
 // Initialize a new queue
 void initQueue(TrafficQueue* queue) {
@@ -77,10 +1065,18 @@ void initQueue(TrafficQueue* queue) {
 }
 
 void initTrafficLights() {
-    for (int i = 0; i < 4; i++) {
-        trafficLights[i].green = false;
-        initQueue(&laneQueues[i]); // Initialize all lane queues
+    for (int j = 0; j < numJunctions; j++) {
+        memset(&junctions[j].signal, 0, sizeof(SignalState));
+        for (int i = 0; i < 4; i++) {
+            initQueue(&junctions[j].laneQueues[i]); // Initialize all lane queues
+        }
+        memset(&junctions[j].lostTime, 0, sizeof(LostTime));
+        junctions[j].controller = (ControllerState){ .currentServingLane = -1, .highestPriorityLane = -1,
+                                                     .actuatedPhase = -1 };
+        // Events an earlier run left unread describe loops that are gone
+        atomic_store(&detectorFeeds[j].tail, atomic_load(&detectorFeeds[j].head));
     }
+    memset(lastDischargeTick, 0, sizeof(lastDischargeTick));
 }
 // Check if queue is empty
 bool isQueueEmpty(TrafficQueue* queue) {
@@ -89,16 +1085,35 @@ bool isQueueEmpty(TrafficQueue* queue) {
 
 // Check if queue is full
 bool isQueueFull(TrafficQueue* queue) {
-    return queue->size == MAX_QUEUE_SIZE;
+    return queue->size == queue->capacity && queue->capacity == queueLimit;
+}
+
+// Move the queue into a ring of the given capacity from the run arena, oldest entry first
+bool growQueue(TrafficQueue* queue, int capacity) {
+    int* indices = arenaAlloc(&runArena, sizeof(int) * capacity);
+    if (!indices) return false;
+    for (int k = 0; k < queue->size; k++) {
+        indices[k] = queue->vehicleIndices[(queue->front + k) % queue->capacity];
+    }
+    queue->vehicleIndices = indices;
+    queue->capacity = capacity;
+    queue->front = 0;
+    queue->rear = queue->size - 1;
+    return true;
 }
 
-// Add a vehicle index to the queue
+// Add a vehicle index to the queue, doubling it when full up to queueLimit
 bool enqueue(TrafficQueue* queue, int vehicleIndex) {
-    if (isQueueFull(queue)) {
-        return false;
+    if (queue->size == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : QUEUE_INITIAL_CAPACITY;
+        if (queueLimit > 0 && capacity > queueLimit) capacity = queueLimit;
+        if (capacity <= queue->capacity || !growQueue(queue, capacity)) {
+            atomic_fetch_add_explicit(&droppedQueueEntries, 1, memory_order_relaxed);
+            return false;
+        }
     }
     
-    queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
+    queue->rear = (queue->rear + 1) % queue->capacity;
     queue->vehicleIndices[queue->rear] = vehicleIndex;
     queue->size++;
     return true;
@@ -111,7 +1126,7 @@ int dequeue(TrafficQueue* queue) {
     }
     
     int vehicleIndex = queue->vehicleIndices[queue->front];
-    queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
+    queue->front = (queue->front + 1) % queue->capacity;
     queue->size--;
     return vehicleIndex;
 }
@@ -125,16 +1140,216 @@ int peek(TrafficQueue* queue) {
     return queue->vehicleIndices[queue->front];
 }
 
-// Create a queue for each lane to track vehicles waiting at lights
-TrafficQueue laneQueues[NUM_LANES];
+// Remove a vehicle that has left the queue together with any stale entries ahead of it.
+// A vehicle that is not in the queue, such as one left out at the limit, changes nothing.
+bool dequeueThrough(TrafficQueue* queue, int vehicleIndex) {
+    for (int k = 0; k < queue->size; k++) {
+        if (queue->vehicleIndices[(queue->front + k) % queue->capacity] != vehicleIndex) continue;
+        queue->front = (queue->front + k + 1) % queue->capacity;
+        queue->size -= k + 1;
+        return true;
+    }
+    return false;
+}
+
+// Copy a queue's entries, oldest first, into another that keeps its own buffer
+bool copyQueue(TrafficQueue* to, const TrafficQueue* from) {
+    initQueue(to);
+    if (to->capacity < from->size && !growQueue(to, from->capacity)) return false;
+    for (int k = 0; k < from->size; k++) {
+        to->vehicleIndices[k] = from->vehicleIndices[(from->front + k) % from->capacity];
+    }
+    to->size = from->size;
+    to->rear = from->size - 1;
+    return true;
+}
+
+// Lane travelling the opposite way: A <-> B, C <-> D
+int getOppositeLane(int laneIndex) {
+    return laneIndex ^ 1;
+}
+
+int getLaneGroup(int junction, int laneIndex, int sublaneIndex) {
+    return junction * LANE_GROUPS_PER_JUNCTION + laneIndex * 3 + sublaneIndex;
+}
+
+// Add a junction to the network, returning its index or -1 when full
+int addJunction(int id, int cx, int cy) {
+    if (numJunctions >= MAX_JUNCTIONS) return -1;
+    Junction* junction = &junctions[numJunctions];
+    TrafficQueue queues[NUM_LANES];
+    memcpy(queues, junction->laneQueues, sizeof(queues)); // Reuse the slot's queue buffers
+    memset(junction, 0, sizeof(*junction));
+    junction->id = id;
+    junction->cx = cx;
+    junction->cy = cy;
+    signalTimings[numJunctions] = defaultSignalTiming;
+    for (int i = 0; i < NUM_LANES; i++) {
+        junction->neighbour[i] = -1;
+        junction->laneQueues[i] = queues[i];
+        initQueue(&junction->laneQueues[i]);
+    }
+    return numJunctions++;
+}
+
+int findJunction(int id) {
+    for (int j = 0; j < numJunctions; j++) {
+        if (junctions[j].id == id) return j;
+    }
+    return -1;
+}
+
+// Connect two junctions with a two-way road leaving `from` on the given lane
+bool linkJunctions(int from, char lane, int to) {
+    Junction* a = &junctions[from];
+    Junction* b = &junctions[to];
+    int laneIndex = lane - 'A';
+    bool aligned = false;
+    switch (lane) {
+        case 'A': aligned = a->cy == b->cy && b->cx - a->cx >= MIN_JUNCTION_SPACING; break;
+        case 'B': aligned = a->cy == b->cy && a->cx - b->cx >= MIN_JUNCTION_SPACING; break;
+        case 'C': aligned = a->cx == b->cx && b->cy - a->cy >= MIN_JUNCTION_SPACING; break;
+        case 'D': aligned = a->cx == b->cx && a->cy - b->cy >= MIN_JUNCTION_SPACING; break;
+    }
+    if (!aligned || a->neighbour[laneIndex] != -1 || b->neighbour[getOppositeLane(laneIndex)] != -1) {
+        return false;
+    }
+    a->neighbour[laneIndex] = to;
+    b->neighbour[getOppositeLane(laneIndex)] = from;
+    return true;
+}
+
+// The world spans the junctions plus half a window on every side, which for a
+// single junction at the window centre is exactly the window
+void updateWorldBounds() {
+    worldMinX = worldMaxX = junctions[0].cx;
+    worldMinY = worldMaxY = junctions[0].cy;
+    for (int j = 1; j < numJunctions; j++) {
+        if (junctions[j].cx < worldMinX) worldMinX = junctions[j].cx;
+        if (junctions[j].cx > worldMaxX) worldMaxX = junctions[j].cx;
+        if (junctions[j].cy < worldMinY) worldMinY = junctions[j].cy;
+        if (junctions[j].cy > worldMaxY) worldMaxY = junctions[j].cy;
+    }
+    worldMinX -= WINDOW_WIDTH / 2;
+    worldMaxX += WINDOW_WIDTH / 2;
+    worldMinY -= WINDOW_HEIGHT / 2;
+    worldMaxY += WINDOW_HEIGHT / 2;
+}
+
+// The original single crossing in the middle of the window
+void initDefaultNetwork() {
+    numJunctions = 0;
+    numDetectorSpecs = 0;
+    addJunction(0, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
+    updateWorldBounds();
+}
+
+// A columns x rows grid of junctions, spacing pixels apart, every neighbour linked
+void initGridNetwork(int columns, int rows, int spacing) {
+    numJunctions = 0;
+    numDetectorSpecs = 0;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < columns; c++) {
+            int j = addJunction(r * columns + c, WINDOW_WIDTH / 2 + c * spacing, WINDOW_HEIGHT / 2 + r * spacing);
+            if (c > 0) linkJunctions(j - 1, 'A', j);
+            if (r > 0) linkJunctions(j - columns, 'C', j);
+        }
+    }
+    updateWorldBounds();
+}
+
+// Load the road network. Each line is a junction, a road between two, a loop detector or
+// a junction's actuated timing:
+//   J:<id>:<x>:<y>           junction centre in world pixels
+//   R:<from>:<lane>:<to>     two-way road leaving <from> on lane A (east), B (west), C (south) or D (north)
+//   L:<id>:<lane><sublane>:<presence|count>:<setback>:<length>
+//                            loop on the approach to junction <id>, setback pixels before its stop line
+//   T:<id>:<min green>:<passage>:<max green>:<yellow>:<all red>
+//                            seconds, used when the junction runs the actuated controller
+// Junctions without an L line get the default loops, without a T line the default timing.
+// Lines starting with '#' are comments.
+// Falls back to the single default junction on any error.
+bool loadNetwork(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        initDefaultNetwork();
+        return false;
+    }
+
+    numJunctions = 0;
+    numDetectorSpecs = 0;
+    bool ok = true;
+    int lineNumber = 0;
+    char line[64];
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#' || line[0] == 0) continue;
+
+        char* kind = strtok(line, ":");
+        char* a = strtok(NULL, ":");
+        char* b = strtok(NULL, ":");
+        char* c = strtok(NULL, ":");
+        char* d = strtok(NULL, ":");
+        char* e = strtok(NULL, ":");
+        char* f = strtok(NULL, ":");
+        if (!kind || !a || !b || !c) {
+            ok = false;
+        } else if (kind[0] == 'J') {
+            ok = findJunction(atoi(a)) == -1 && addJunction(atoi(a), atoi(b), atoi(c)) != -1;
+        } else if (kind[0] == 'R') {
+            int from = findJunction(atoi(a));
+            int to = findJunction(atoi(c));
+            ok = from != -1 && to != -1 && b[0] >= 'A' && b[0] <= 'D' && linkJunctions(from, b[0], to);
+        } else if (kind[0] == 'L') {
+            int junction = findJunction(atoi(a));
+            bool presence = strcmp(c, "presence") == 0;
+            float setback = d ? atof(d) : -1;
+            float length = e ? atof(e) : 0;
+            int loops = 0;
+            for (int n = 0; n < numDetectorSpecs; n++) {
+                loops += detectorSpecs[n].group / LANE_GROUPS_PER_JUNCTION == junction;
+            }
+            ok = junction != -1 && b[0] >= 'A' && b[0] <= 'D' && b[1] >= '1' && b[1] <= '3' && b[2] == 0 &&
+                 (presence || strcmp(c, "count") == 0) && setback >= 0 && length > 0 && loops < MAX_DETECTORS_PER_JUNCTION;
+            if (ok) {
+                detectorSpecs[numDetectorSpecs++] = (Detector){
+                    .group = getLaneGroup(junction, b[0] - 'A', b[1] - '1'),
+                    .type = presence ? DETECTOR_PRESENCE : DETECTOR_COUNT,
+                    .setback = setback,
+                    .length = length,
+                };
+            }
+        } else if (kind[0] == 'T') {
+            int junction = findJunction(atoi(a));
+            SignalTiming timing = { atof(b), atof(c), d ? atof(d) : 0, e ? atof(e) : 0, f ? atof(f) : -1 };
+            ok = junction != -1 && timing.minGreen > 0 && timing.passage > 0 && timing.maxGreen >= timing.minGreen &&
+                 timing.yellow > 0 && timing.allRed >= 0;
+            if (ok) signalTimings[junction] = timing;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            printf("Error in %s line %d, using the default junction\n", path, lineNumber);
+        }
+    }
+    fclose(file);
 
-TrafficLight trafficLights[4]; // One for each lane
+    if (!ok || numJunctions == 0) {
+        initDefaultNetwork();
+        return false;
+    }
+    updateWorldBounds();
+    printf("Loaded network with %d junctions from %s\n", numJunctions, path);
+    return true;
+}
 
-// Count the number of vehicles in each lane
-void countVehiclesPerLane(int laneQueue[], int sublane) {
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (vehicles[i].active && vehicles[i].sublane == 2) {
-            switch (vehicles[i].lane) {
+// Count the number of vehicles in each lane of one junction
+void countVehiclesPerLane(int junction, int laneQueue[], int sublane) {
+    for (int i = 0; i < vehicleSpan; i++) {
+        Vehicle* v = getVehicle(i);
+        if (v->active && v->junction == junction && v->sublane == sublane) {
+            switch (v->lane) {
                 case 'A':
                     laneQueue[0]++;
                     break;
@@ -152,251 +1367,1041 @@ void countVehiclesPerLane(int laneQueue[], int sublane) {
     }
 }
 
-// Update traffic lights dynamically
-void* updateTrafficLights(void* arg) {
-    while (1) {
-        SDL_LockMutex(vehicleMutex);
-        
-        int laneCounts[4] = {0};
-        
-        // Count vehicles in sublane 2 at intersections A, B, C, and D
-        countVehiclesPerLane(laneCounts, 2);
-
-        // Default priority lane
-        int priorityLane = -1; 
-        for (int i = 0; i < 4; i++) {
-            if (laneCounts[i] >= 3) { 
-                priorityLane = i; // Prioritize lanes with 3+ vehicles in sublane 2
-                break;
+// Fold a junction's pending detector events into its controller state: which loops are
+// occupied and for how long, and when each controlled approach last saw a vehicle. Called by
+// a controller holding the junction's lock.
+void drainDetectorFeed(int j) {
+    ControllerState* controller = &junctions[j].controller;
+    DetectorFeed* feed = &detectorFeeds[j];
+    int first = detectorStart[j * LANE_GROUPS_PER_JUNCTION];
+    int numLoops = detectorStart[(j + 1) * LANE_GROUPS_PER_JUNCTION] - first;
+    Uint64 tail = atomic_load_explicit(&feed->tail, memory_order_relaxed);
+    Uint64 head = atomic_load_explicit(&feed->head, memory_order_acquire);
+    Uint64 now = atomic_load_explicit(&simTick, memory_order_relaxed); // No earlier than any event read
+    if (controller->detectorWindowStart > now) controller->detectorWindowStart = now; // Restored to an earlier tick
+
+    for (; tail < head; tail++) {
+        const DetectorEvent* event = &feed->ring[tail % DETECTOR_EVENT_RING];
+        int n = event->detector - first;
+        if (n < 0 || n >= numLoops) continue; // Posted before the loops were laid out again
+        Uint64 tick = event->tick < controller->detectorWindowStart ? controller->detectorWindowStart :
+                      event->tick > now ? now : event->tick;
+        const Detector* detector = &detectors[event->detector];
+        int lane = (detector->group % LANE_GROUPS_PER_JUNCTION) / 3;
+        if (event->occupied && !controller->detectorOccupied[n]) {
+            controller->detectorOccupied[n] = true;
+            controller->detectorOnSince[n] = tick;
+            if (detector->type == DETECTOR_COUNT && detector->group % 3 == 1) {
+                controller->called[lane] = true;
+                controller->windowCounts[lane]++;
             }
+        } else if (!event->occupied && controller->detectorOccupied[n]) {
+            controller->detectorOccupied[n] = false;
+            controller->detectorOnTicks[n] += (Uint32)(tick - controller->detectorOnSince[n]);
+        } else {
+            continue;
         }
+        if (detector->group % 3 == 1) controller->lastActuation[lane] = tick;
+    }
+    atomic_store_explicit(&feed->tail, tail, memory_order_release);
+}
 
-        // Set all traffic lights for sublane 2 to red
-        for (int i = 0; i < 4; i++) {
-            trafficLights[i].green = false;
+// Read a junction's detector feed and close the occupancy window there: how much of it each
+// approach's stop-bar loop was occupied, and how many vehicles drove onto its advance loops.
+// Called by a controller holding the junction's lock.
+void readDetectorFeed(int j) {
+    ControllerState* controller = &junctions[j].controller;
+    int first = detectorStart[j * LANE_GROUPS_PER_JUNCTION];
+    int numLoops = detectorStart[(j + 1) * LANE_GROUPS_PER_JUNCTION] - first;
+    drainDetectorFeed(j);
+    Uint64 now = atomic_load_explicit(&simTick, memory_order_relaxed); // No earlier than the drain's
+
+    Uint64 window = now - controller->detectorWindowStart;
+    memset(controller->occupancy, 0, sizeof(controller->occupancy));
+    for (int n = 0; n < numLoops; n++) {
+        const Detector* detector = &detectors[first + n];
+        if (controller->detectorOccupied[n]) {
+            controller->detectorOnTicks[n] += (Uint32)(now - controller->detectorOnSince[n]);
+            controller->detectorOnSince[n] = now;
         }
-        if (priorityLane != -1) {
-            trafficLights[priorityLane].green = true; // Enable priority lane for sublane 2
+        if (detector->type == DETECTOR_PRESENCE && detector->group % 3 == 1 && window > 0) {
+            float* occupancy = &controller->occupancy[(detector->group % LANE_GROUPS_PER_JUNCTION) / 3];
+            *occupancy = fmaxf(*occupancy, fminf((float)controller->detectorOnTicks[n] / window, 1));
         }
-
-        SDL_UnlockMutex(vehicleMutex);
-
-        sleep(5); // Give time for vehicles to clear
+        controller->detectorOnTicks[n] = 0;
     }
-    return NULL;
+    memcpy(controller->advanceCounts, controller->windowCounts, sizeof(controller->advanceCounts));
+    memset(controller->windowCounts, 0, sizeof(controller->windowCounts));
+    controller->detectorWindowStart = now;
 }
 
+// Update traffic lights dynamically
+void* updateTrafficLights(void* arg) {
+    traceThreadName("traffic lights");
+    while (!isStopRequested()) {
+        Uint64 acquired = lockMutex(networkMutex, LOCK_CONTROLLER_NETWORK);
+        int count = numJunctions;
+        unlockMutex(networkMutex, LOCK_CONTROLLER_NETWORK, acquired);
+
+        for (int j = 0; j < count; j++) {
+            acquired = lockMutex(junctionLocks[j], LOCK_CONTROLLER_JUNCTION);
+            readDetectorFeed(j);
+            int laneCounts[4] = {0};
+
+            // Count vehicles queued in sublane 2 at intersections A, B, C, and D
+            for (int i = 0; i < 4; i++) {
+                laneCounts[i] = junctions[j].laneQueues[i].size;
+            }
 
-void updateTrafficQueues() {
-    SDL_LockMutex(vehicleMutex);
-    
-    // Clear all queues first (we'll rebuild them every update)
-    for (int i = 0; i < NUM_LANES; i++) {
-        initQueue(&laneQueues[i]);
-    }
-    
-    // For each active vehicle, check if it's approaching an intersection
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (!vehicles[i].active) continue;
-        
-        // Only consider vehicles in sublane 2 (straight lane)
-        if (vehicles[i].sublane != 2) continue;
-        
-        bool isApproachingIntersection = false;
-        int laneIndex = -1;
-        
-        switch (vehicles[i].lane) {
-            case 'A':
-                // Vehicle approaching from left - increase detection range
-                if (vehicles[i].x >= (WINDOW_WIDTH / 2 - STOP_DISTANCE * 3) && 
-                    vehicles[i].x < (WINDOW_WIDTH / 2)) {
-                    isApproachingIntersection = true;
-                    laneIndex = 0;
-                }
-                break;
-                
-            case 'B':
-                // Vehicle approaching from right - increase detection range
-                if (vehicles[i].x <= (WINDOW_WIDTH / 2 + STOP_DISTANCE * 3) && 
-                    vehicles[i].x > (WINDOW_WIDTH / 2)) {
-                    isApproachingIntersection = true;
-                    laneIndex = 1;
-                }
-                break;
-                
-            case 'C':
-                // Vehicle approaching from top - increase detection range
-                if (vehicles[i].y >= (WINDOW_HEIGHT / 2 - STOP_DISTANCE * 3) && 
-                    vehicles[i].y < (WINDOW_HEIGHT / 2)) {
-                    isApproachingIntersection = true;
-                    laneIndex = 2;
-                }
-                break;
-                
-            case 'D':
-                // Vehicle approaching from bottom - increase detection range
-                if (vehicles[i].y <= (WINDOW_HEIGHT / 2 + STOP_DISTANCE * 3) && 
-                    vehicles[i].y > (WINDOW_HEIGHT / 2)) {
-                    isApproachingIntersection = true;
-                    laneIndex = 3;
+            // Default priority lane
+            int priorityLane = -1; 
+            for (int i = 0; i < 4; i++) {
+                if (laneCounts[i] >= 3) { 
+                    priorityLane = i; // Prioritize lanes with 3+ vehicles in sublane 2
+                    break;
                 }
-                break;
-        }
-        
-        if (isApproachingIntersection && laneIndex != -1) {
-            enqueue(&laneQueues[laneIndex], i);
+            }
+
+            // Set all traffic lights for sublane 2 to red, except the priority lane
+            Uint32 greenLanes = 0;
+            if (priorityLane != -1) {
+                greenLanes = 1u << priorityLane; // Enable priority lane for sublane 2
+            }
+            requestSignalPhase(&junctions[j], greenLanes, 0);
+            unlockMutex(junctionLocks[j], LOCK_CONTROLLER_JUNCTION, acquired);
         }
-    }
-    
-    SDL_UnlockMutex(vehicleMutex);
 
-    // Debug: Print queue sizes
-//     printf("Queue sizes after update: A:%d, B:%d, C:%d, D:%d\n", 
-//            laneQueues[0].size, laneQueues[1].size, 
-//            laneQueues[2].size, laneQueues[3].size);
-// 
+        waitForStop(5000); // Give time for vehicles to clear
+    }
+    return NULL;
 }
 
 
-// Helper function to calculate green light duration based on vehicle count
-int calculateGreenLightDuration(int vehicleCount) {
-    // Assume each vehicle takes approximately 2 seconds to clear the intersection
-    // Plus a base time of 3 seconds for the first vehicle
-    int baseTime = 3;
-    int timePerVehicle = 2;
-    
+// Per-tick telemetry for --telemetry. The simulation thread copies a sample into a ring
+// and moves on; a writer thread drains the ring into a columnar file. A sample that finds
+// the ring full is dropped and counted rather than stalling the tick.
+typedef struct {
+    Uint64 tick;
+    int numJunctions;
+    int numVehicles;
+    int queueLengths[MAX_JUNCTIONS][NUM_LANES];
+    Uint32 greenMasks[MAX_JUNCTIONS];
+    Uint32 phaseIds[MAX_JUNCTIONS];
+    Uint32 yellowMasks[MAX_JUNCTIONS];
+    int capacity;       // Vehicles the arrays below hold, grown with the active vehicles
+    Uint32* slots;
+    Uint8* junction;
+    Uint8* lane;
+    Uint8* sublane;
+    float* x;
+    float* y;
+    float* speed;
+} TelemetrySample;
+
+// One column of a chunk being built: integers as zigzag varints of the difference from
+// the previous row, floats as raw little-endian float32
+typedef struct {
+    const char* name;
+    bool isFloat;
+    Uint8* data;
+    size_t length;
+    size_t capacity;
+    Sint64 previous;
+} TelemetryColumn;
+
+typedef struct {
+    const char* name;
+    int numColumns;
+    TelemetryColumn columns[TELEMETRY_MAX_COLUMNS];
+    Uint32 rows;
+} TelemetryTable;
+
+enum { TELEMETRY_LANES, TELEMETRY_LIGHTS, TELEMETRY_VEHICLES, NUM_TELEMETRY_TABLES };
+
+TelemetryTable telemetryTables[NUM_TELEMETRY_TABLES] = {
+    {.name = "lanes", .numColumns = 4, .columns = {{.name = "tick"}, {.name = "junction"}, {.name = "lane"}, {.name = "queue"}}},
+    {.name = "lights", .numColumns = 5, .columns = {{.name = "tick"}, {.name = "junction"}, {.name = "green_mask"}, {.name = "phase_id"},
+                                                 {.name = "yellow_mask"}}},
+    {.name = "vehicles", .numColumns = 8, .columns = {{.name = "tick"}, {.name = "slot"}, {.name = "junction"}, {.name = "lane"},
+        {.name = "sublane"}, {.name = "x", .isFloat = true}, {.name = "y", .isFloat = true}, {.name = "speed", .isFloat = true}}},
+};
+
+typedef struct {
+    TelemetrySample ring[TELEMETRY_RING];
+    _Atomic Uint64 head;    // Samples published by the simulation thread
+    _Atomic Uint64 tail;    // Samples consumed by the writer
+    _Atomic Uint64 dropped; // Samples lost to a full ring
+    FILE* file;
+    bool failed;
+    int every;              // Sample one tick in this many
+    Uint64 written;
+    Uint64 bytes;
+} Telemetry;
+
+Telemetry telemetry;
+bool telemetryEnabled = false;
+
+// Size a ring slot's vehicle arrays for the vehicles of one sample, with a quarter more so
+// a growing run reallocates rarely. The writer never reads the slot the simulation is
+// filling, so it can be reallocated.
+bool reserveTelemetrySample(TelemetrySample* sample, int count) {
+    if (sample->capacity >= count) return true;
+    int capacity = count + count / 4 + 1;
+    bool ok = growArray((void**)&sample->slots, capacity, sizeof(Uint32)) &&
+              growArray((void**)&sample->junction, capacity, sizeof(Uint8)) &&
+              growArray((void**)&sample->lane, capacity, sizeof(Uint8)) &&
+              growArray((void**)&sample->sublane, capacity, sizeof(Uint8)) &&
+              growArray((void**)&sample->x, capacity, sizeof(float)) &&
+              growArray((void**)&sample->y, capacity, sizeof(float)) &&
+              growArray((void**)&sample->speed, capacity, sizeof(float));
+    if (ok) sample->capacity = capacity;
+    return ok;
+}
+
+// Copy the tick's state into the next free ring slot. Simulation thread only.
+void recordTelemetry(TrafficQueue queues[][NUM_LANES]) {
+    if (simTick % telemetry.every != 0) return;
+    Uint64 head = atomic_load_explicit(&telemetry.head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&telemetry.tail, memory_order_acquire) >= TELEMETRY_RING) {
+        atomic_fetch_add_explicit(&telemetry.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    int active = 0;
+    for (int i = 0; i < vehicleSpan; i++) {
+        active += getVehicle(i)->active;
+    }
+    TelemetrySample* sample = &telemetry.ring[head % TELEMETRY_RING];
+    if (!reserveTelemetrySample(sample, active)) {
+        atomic_fetch_add_explicit(&telemetry.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    sample->tick = simTick;
+    sample->numJunctions = numJunctions;
+    for (int j = 0; j < numJunctions; j++) {
+        SignalPhase phase;
+        readSignalPhase(&junctions[j], &phase);
+        sample->greenMasks[j] = phase.greenMask;
+        sample->phaseIds[j] = phase.phaseId;
+        sample->yellowMasks[j] = phase.yellowMask;
+        for (int l = 0; l < NUM_LANES; l++) {
+            sample->queueLengths[j][l] = queues[j][l].size;
+        }
+    }
+    int count = 0;
+    for (int i = 0; i < vehicleSpan; i++) {
+        Vehicle* v = getVehicle(i);
+        if (!v->active) continue;
+        sample->slots[count] = i;
+        sample->junction[count] = v->junction;
+        sample->lane[count] = v->lane;
+        sample->sublane[count] = v->sublane;
+        sample->x[count] = v->x;
+        sample->y[count] = v->y;
+        sample->speed[count] = v->speed;
+        count++;
+    }
+    sample->numVehicles = count;
+    atomic_store_explicit(&telemetry.head, head + 1, memory_order_release);
+}
+
+void appendColumnBytes(TelemetryColumn* column, const void* bytes, size_t length) {
+    if (column->length + length > column->capacity) {
+        size_t capacity = column->capacity ? column->capacity * 2 : 4096;
+        while (capacity < column->length + length) capacity *= 2;
+        Uint8* data = SDL_realloc(column->data, capacity);
+        if (!data) {
+            telemetry.failed = true;
+            return;
+        }
+        column->data = data;
+        column->capacity = capacity;
+    }
+    memcpy(column->data + column->length, bytes, length);
+    column->length += length;
+}
+
+void appendColumnInt(TelemetryColumn* column, Sint64 value) {
+    Sint64 delta = value - column->previous;
+    Uint64 zigzag = ((Uint64)delta << 1) ^ (Uint64)(delta >> 63);
+    column->previous = value;
+    Uint8 bytes[10];
+    int length = 0;
+    do {
+        bytes[length] = zigzag & 0x7F;
+        zigzag >>= 7;
+        if (zigzag) bytes[length] |= 0x80;
+        length++;
+    } while (zigzag);
+    appendColumnBytes(column, bytes, length);
+}
+
+void appendColumnFloat(TelemetryColumn* column, float value) {
+    Uint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    Uint8 bytes[4] = { bits, bits >> 8, bits >> 16, bits >> 24 };
+    appendColumnBytes(column, bytes, sizeof(bytes));
+}
+
+void writeTelemetryBytes(const void* bytes, size_t length) {
+    if (telemetry.failed) return;
+    if (fwrite(bytes, 1, length, telemetry.file) != length) {
+        perror("Error writing telemetry");
+        telemetry.failed = true;
+        return;
+    }
+    telemetry.bytes += length;
+}
+
+void writeTelemetryU32(Uint32 value) {
+    Uint8 bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    writeTelemetryBytes(bytes, sizeof(bytes));
+}
+
+void writeTelemetryName(const char* name) {
+    Uint8 length = strlen(name);
+    writeTelemetryBytes(&length, 1);
+    writeTelemetryBytes(name, length);
+}
+
+// Spread one sample over the rows of the three tables
+void appendTelemetrySample(const TelemetrySample* sample) {
+    TelemetryTable* lanes = &telemetryTables[TELEMETRY_LANES];
+    TelemetryTable* lights = &telemetryTables[TELEMETRY_LIGHTS];
+    TelemetryTable* cars = &telemetryTables[TELEMETRY_VEHICLES];
+    for (int j = 0; j < sample->numJunctions; j++) {
+        for (int l = 0; l < NUM_LANES; l++) {
+            appendColumnInt(&lanes->columns[0], sample->tick);
+            appendColumnInt(&lanes->columns[1], j);
+            appendColumnInt(&lanes->columns[2], l);
+            appendColumnInt(&lanes->columns[3], sample->queueLengths[j][l]);
+            lanes->rows++;
+        }
+        appendColumnInt(&lights->columns[0], sample->tick);
+        appendColumnInt(&lights->columns[1], j);
+        appendColumnInt(&lights->columns[2], sample->greenMasks[j]);
+        appendColumnInt(&lights->columns[3], sample->phaseIds[j]);
+        appendColumnInt(&lights->columns[4], sample->yellowMasks[j]);
+        lights->rows++;
+    }
+    for (int k = 0; k < sample->numVehicles; k++) {
+        appendColumnInt(&cars->columns[0], sample->tick);
+        appendColumnInt(&cars->columns[1], sample->slots[k]);
+        appendColumnInt(&cars->columns[2], sample->junction[k]);
+        appendColumnInt(&cars->columns[3], sample->lane[k] - 'A');
+        appendColumnInt(&cars->columns[4], sample->sublane[k]);
+        appendColumnFloat(&cars->columns[5], sample->x[k]);
+        appendColumnFloat(&cars->columns[6], sample->y[k]);
+        appendColumnFloat(&cars->columns[7], sample->speed[k]);
+        cars->rows++;
+    }
+    telemetry.written++;
+}
+
+// Write each table's pending rows as a chunk: table index, row count, then every column
+// as its byte length and bytes. Deltas restart in every chunk so chunks decode alone.
+void flushTelemetryChunk() {
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int t = 0; t < NUM_TELEMETRY_TABLES; t++) {
+        TelemetryTable* table = &telemetryTables[t];
+        if (table->rows > 0) {
+            Uint8 index = t;
+            writeTelemetryBytes(&index, 1);
+            writeTelemetryU32(table->rows);
+            for (int c = 0; c < table->numColumns; c++) {
+                writeTelemetryU32(table->columns[c].length);
+                writeTelemetryBytes(table->columns[c].data, table->columns[c].length);
+            }
+        }
+        table->rows = 0;
+        for (int c = 0; c < table->numColumns; c++) {
+            table->columns[c].length = 0;
+            table->columns[c].previous = 0;
+        }
+    }
+    if (!telemetry.failed) fflush(telemetry.file);
+    traceSpan("telemetry chunk", "telemetry", start);
+}
+
+// Header: magic, tick length in ms, sampling interval in ticks, then the schema of every
+// table, each name a length byte and the name, each column followed by its encoding
+bool openTelemetry(const char* path, int every) {
+    telemetry.file = fopen(path, "wb");
+    if (!telemetry.file) {
+        perror("Error opening telemetry file");
+        return false;
+    }
+    telemetry.every = every > 0 ? every : 1;
+    telemetry.failed = false;
+    writeTelemetryBytes(TELEMETRY_MAGIC, 8);
+    writeTelemetryU32(TICK_MS);
+    writeTelemetryU32(telemetry.every);
+    Uint8 numTables = NUM_TELEMETRY_TABLES;
+    writeTelemetryBytes(&numTables, 1);
+    for (int t = 0; t < NUM_TELEMETRY_TABLES; t++) {
+        writeTelemetryName(telemetryTables[t].name);
+        Uint8 numColumns = telemetryTables[t].numColumns;
+        writeTelemetryBytes(&numColumns, 1);
+        for (int c = 0; c < numColumns; c++) {
+            writeTelemetryName(telemetryTables[t].columns[c].name);
+            Uint8 encoding = telemetryTables[t].columns[c].isFloat;
+            writeTelemetryBytes(&encoding, 1);
+        }
+    }
+    return !telemetry.failed;
+}
+
+// Drains the ring until a stop is requested, then once more for what was left behind
+void* writeTelemetry(void* arg) {
+    traceThreadName("telemetry");
+    int pending = 0;
+    bool stopping = false;
+    while (!stopping) {
+        stopping = isStopRequested();
+        Uint64 head = atomic_load_explicit(&telemetry.head, memory_order_acquire);
+        Uint64 tail = atomic_load_explicit(&telemetry.tail, memory_order_relaxed);
+        if (tail == head) {
+            if (!stopping) waitForStop(TELEMETRY_POLL_MS);
+            continue;
+        }
+        for (; tail < head; tail++) {
+            appendTelemetrySample(&telemetry.ring[tail % TELEMETRY_RING]);
+            atomic_store_explicit(&telemetry.tail, tail + 1, memory_order_release);
+            if (++pending == TELEMETRY_CHUNK_SAMPLES) {
+                flushTelemetryChunk();
+                pending = 0;
+            }
+        }
+    }
+    if (pending > 0) flushTelemetryChunk();
+    return NULL;
+}
+
+void closeTelemetry(const char* path) {
+    if (!telemetry.file) return;
+    fclose(telemetry.file);
+    telemetry.file = NULL;
+    printf("Wrote %llu telemetry samples (%.1f MB) to %s, dropped %llu\n", (unsigned long long)telemetry.written,
+           telemetry.bytes / 1e6, path, (unsigned long long)atomic_load(&telemetry.dropped));
+    for (int t = 0; t < NUM_TELEMETRY_TABLES; t++) {
+        for (int c = 0; c < telemetryTables[t].numColumns; c++) {
+            TelemetryColumn* column = &telemetryTables[t].columns[c];
+            SDL_free(column->data);
+            column->data = NULL;
+            column->length = column->capacity = 0;
+        }
+    }
+    for (int k = 0; k < TELEMETRY_RING; k++) {
+        TelemetrySample* sample = &telemetry.ring[k];
+        SDL_free(sample->slots);
+        SDL_free(sample->junction);
+        SDL_free(sample->lane);
+        SDL_free(sample->sublane);
+        SDL_free(sample->x);
+        SDL_free(sample->y);
+        SDL_free(sample->speed);
+        *sample = (TelemetrySample){ .capacity = 0 };
+    }
+}
+
+// Copy what the metrics endpoint reports out of the simulation thread's own state
+void publishMetrics(TrafficQueue queues[][NUM_LANES]) {
+    int active = 0;
+    for (int i = 0; i < vehicleSpan; i++) {
+        active += getVehicle(i)->active;
+    }
+    atomic_store_explicit(&metrics.activeVehicles, active, memory_order_relaxed);
+    atomic_store_explicit(&metrics.simTick, simTick, memory_order_relaxed);
+    for (int j = 0; j < numJunctions; j++) {
+        SignalPhase phase;
+        readSignalPhase(&junctions[j], &phase);
+        atomic_store_explicit(&metrics.junctionIds[j], junctions[j].id, memory_order_relaxed);
+        atomic_store_explicit(&metrics.greenMasks[j], phase.greenMask, memory_order_relaxed);
+        atomic_store_explicit(&metrics.yellowMasks[j], phase.yellowMask, memory_order_relaxed);
+        atomic_store_explicit(&metrics.phaseIds[j], phase.phaseId, memory_order_relaxed);
+        atomic_store_explicit(&metrics.phaseStartTicks[j], phase.startTick, memory_order_relaxed);
+        const LostTime* lost = &junctions[j].lostTime;
+        atomic_store_explicit(&metrics.greenChanges[j], atomic_load_explicit(&lost->changes, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&metrics.clearanceLostTicks[j], atomic_load_explicit(&lost->totalClearanceTicks, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(&metrics.startupLostTicks[j], atomic_load_explicit(&lost->totalStartupTicks, memory_order_relaxed),
+                              memory_order_relaxed);
+        for (int l = 0; l < NUM_LANES; l++) {
+            atomic_store_explicit(&metrics.queueLengths[j][l], queues[j][l].size, memory_order_relaxed);
+        }
+    }
+    for (int d = 0; d < numDetectors; d++) {
+        atomic_store_explicit(&metrics.detectorKeys[d], detectors[d].group * NUM_DETECTOR_TYPES + detectors[d].type, memory_order_relaxed);
+        atomic_store_explicit(&metrics.detectorCounts[d], detectors[d].count, memory_order_relaxed);
+        atomic_store_explicit(&metrics.detectorOnTicks[d], detectors[d].onTicks, memory_order_relaxed);
+    }
+    atomic_store_explicit(&metrics.detectors, numDetectors, memory_order_relaxed);
+    atomic_store_explicit(&metrics.junctions, numJunctions, memory_order_release);
+}
+
+// Lane queues as the loop detectors keep them, before they are published
+TrafficQueue builtQueues[MAX_JUNCTIONS][NUM_LANES];
+
+// Publish the lane queues to each junction under its own lock. Runs on the simulation thread,
+// which owns the vehicle pool; the queues themselves follow the vehicles crossing each
+// approach's loops as they are stepped, see publishDetectors().
+void updateTrafficQueues() {
+    TrafficQueue (*queues)[NUM_LANES] = builtQueues;
+    for (int j = 0; j < numJunctions; j++) {
+        Uint64 acquired = lockMutex(junctionLocks[j], LOCK_QUEUES_JUNCTION);
+        for (int l = 0; l < NUM_LANES; l++) {
+            copyQueue(&junctions[j].laneQueues[l], &queues[j][l]);
+        }
+        unlockMutex(junctionLocks[j], LOCK_QUEUES_JUNCTION, acquired);
+    }
+    if (metricsEnabled) publishMetrics(queues);
+    if (telemetryEnabled) recordTelemetry(queues);
+}
+
+
+// Helper function to calculate green light duration based on vehicle count
+int calculateGreenLightDuration(int vehicleCount) {
+    // Assume each vehicle takes approximately 2 seconds to clear the intersection
+    // Plus a base time of 3 seconds for the first vehicle
+    int baseTime = 3;
+    int timePerVehicle = 2;
+    
     return baseTime + (vehicleCount * timePerVehicle);
 }
 
-void* updateTrafficLightsAdvanced(void* arg) {
-    int currentServingLane = -1;
-    time_t greenLightStartTime = 0;
-    int highestPriorityLane = -1;
+// A corridor is a maximal chain of linked junctions along one axis
+typedef struct {
+    int junction[MAX_JUNCTIONS]; // In travel order of lane A (east-west) or C (north-south)
+    int length;
+    int axis;                    // 0 east-west, 1 north-south
+} Corridor;
+
+// Common cycle shared by every coordinated junction, so offsets stay meaningful
+typedef struct {
+    bool enabled;
+    Uint64 cycleStart;        // Tick at which the current common cycle began
+    Uint32 cycleTicks;
+    Uint32 pendingCycleTicks; // Takes effect at the start of the next common cycle
+    Uint64 lastPlanTick;
+    float lostTime;           // Smoothed s lost to clearance and start-up at each change of green
+    Uint64 lostTicks;         // Lost time and changes of green summed over the junctions at the last plan
+    Uint64 lostChanges;
+} CoordinationState;
+
+Corridor corridors[MAX_JUNCTIONS * 2];
+int numCorridors = 0;
+CoordinationState coordination = { true, 0, 0, 0, 0, COORD_LOST_TIME, 0, 0 };
+
+// Find the corridors of the network: chains of at least two junctions
+void buildCorridors() {
+    numCorridors = 0;
+    for (int axis = 0; axis < 2; axis++) {
+        int forward = axis == 0 ? 0 : 2;  // Lane A runs east, lane C runs south
+        for (int j = 0; j < numJunctions; j++) {
+            if (junctions[j].neighbour[getOppositeLane(forward)] != -1 || junctions[j].neighbour[forward] == -1) continue;
+            Corridor* corridor = &corridors[numCorridors++];
+            corridor->axis = axis;
+            corridor->length = 0;
+            for (int k = j; k != -1; k = junctions[k].neighbour[forward]) {
+                corridor->junction[corridor->length++] = k;
+            }
+        }
+    }
+}
+
+// Smallest signed step from one offset to another on a cycle of the given length
+int getOffsetStep(Uint32 from, Uint32 to, Uint32 cycle) {
+    int step = (int)((to + cycle - from % cycle) % cycle);
+    return step > (int)cycle / 2 ? step - (int)cycle : step;
+}
+
+// Re-plan the corridors from the arrivals measured since the last plan: a common Webster
+// cycle for the busiest junction, splits in proportion to each junction's critical flow
+// ratios and offsets that let a platoon released by one junction meet green at the next in
+// the corridor's heavier direction. Busier corridors are planned first and keep their
+// junctions where corridors cross. Changes are phased in gradually by applyCoordinatedLights.
+void planCoordination() {
+    if (!coordination.enabled || numCorridors == 0) return;
+    if (coordination.cycleTicks != 0 && simTick >= coordination.lastPlanTick &&
+        simTick - coordination.lastPlanTick < COORD_PLAN_TICKS) return;
+
+    float window = coordination.cycleTicks != 0 && simTick > coordination.lastPlanTick ?
+                   (simTick - coordination.lastPlanTick) * TICK_MS / 1000.0f : 0;
+    coordination.lastPlanTick = simTick;
+
+    // Lost time per change of green as measured since the last plan
+    Uint64 lostTicks = 0, lostChanges = 0;
+    for (int j = 0; j < numJunctions; j++) {
+        const LostTime* lost = &junctions[j].lostTime;
+        lostTicks += atomic_load_explicit(&lost->totalClearanceTicks, memory_order_relaxed) +
+                     atomic_load_explicit(&lost->totalStartupTicks, memory_order_relaxed);
+        lostChanges += atomic_load_explicit(&lost->changes, memory_order_relaxed);
+    }
+    if (lostChanges > coordination.lostChanges && lostTicks >= coordination.lostTicks) {
+        float measured = (lostTicks - coordination.lostTicks) * TICK_MS / 1000.0f / (lostChanges - coordination.lostChanges);
+        coordination.lostTime += COORD_FLOW_SMOOTHING * (measured - coordination.lostTime);
+    }
+    coordination.lostTicks = lostTicks;
+    coordination.lostChanges = lostChanges;
+
+    // Smoothed flows and critical flow ratios per junction
+    float criticalEW[MAX_JUNCTIONS], criticalNS[MAX_JUNCTIONS];
+    float cycle = COORD_MIN_CYCLE;
+    float lostTime = 2 * coordination.lostTime;
+    for (int j = 0; j < numJunctions; j++) {
+        ControllerState* controller = &junctions[j].controller;
+        for (int l = 0; l < NUM_LANES; l++) {
+            int arrivals = atomic_exchange(&controller->arrivals[l], 0);
+            if (window > 0) {
+                controller->flow[l] += COORD_FLOW_SMOOTHING * (arrivals / window - controller->flow[l]);
+            }
+        }
+        criticalEW[j] = fmaxf(controller->flow[0], controller->flow[1]) / COORD_SATURATION_FLOW;
+        criticalNS[j] = fmaxf(controller->flow[2], controller->flow[3]) / COORD_SATURATION_FLOW;
+        float ratio = fminf(criticalEW[j] + criticalNS[j], 0.9f);
+        cycle = fmaxf(cycle, (1.5f * lostTime + 5) / (1 - ratio));
+    }
+    cycle = fminf(cycle, COORD_MAX_CYCLE);
+
+    Uint32 cycleTicks = (Uint32)(cycle * 1000 / TICK_MS);
+    if (coordination.cycleTicks == 0) {
+        coordination.cycleTicks = cycleTicks;
+        coordination.cycleStart = simTick;
+    } else {
+        Uint32 low = (Uint32)(coordination.cycleTicks * (1 - COORD_MAX_CYCLE_CHANGE));
+        Uint32 high = (Uint32)(coordination.cycleTicks * (1 + COORD_MAX_CYCLE_CHANGE));
+        cycleTicks = cycleTicks < low ? low : cycleTicks > high ? high : cycleTicks;
+    }
+    coordination.pendingCycleTicks = cycleTicks;
+    cycle = cycleTicks * TICK_MS / 1000.0f;
+
+    // Rank corridors by the flow along their axis
+    float corridorFlow[MAX_JUNCTIONS * 2];
+    int order[MAX_JUNCTIONS * 2];
+    for (int c = 0; c < numCorridors; c++) {
+        corridorFlow[c] = 0;
+        for (int k = 0; k < corridors[c].length; k++) {
+            int j = corridors[c].junction[k];
+            corridorFlow[c] += corridors[c].axis == 0 ? criticalEW[j] : criticalNS[j];
+        }
+        int m = c - 1;
+        while (m >= 0 && corridorFlow[order[m]] < corridorFlow[c]) {
+            order[m + 1] = order[m];
+            m--;
+        }
+        order[m + 1] = c;
+    }
+
+    bool planned[MAX_JUNCTIONS] = { false };
+    for (int n = 0; n < numCorridors; n++) {
+        Corridor* corridor = &corridors[order[n]];
+        int lane = corridor->axis == 0 ? 0 : 2;
+
+        // Progress in the heavier direction: lane A/C walks the chain forwards, B/D backwards
+        float forwardFlow = 0, backwardFlow = 0;
+        for (int k = 0; k < corridor->length; k++) {
+            forwardFlow += junctions[corridor->junction[k]].controller.flow[lane];
+            backwardFlow += junctions[corridor->junction[k]].controller.flow[lane + 1];
+        }
+        bool forward = forwardFlow >= backwardFlow;
+
+        float start = 0; // Start of the corridor-axis green at the previous junction, s into the cycle
+        for (int step = 0; step < corridor->length; step++) {
+            int k = forward ? step : corridor->length - 1 - step;
+            int j = corridor->junction[k];
+            ControllerState* controller = &junctions[j].controller;
+
+            if (step > 0) {
+                int prev = corridor->junction[forward ? k - 1 : k + 1];
+                float distance = abs(junctions[j].cx - junctions[prev].cx) + abs(junctions[j].cy - junctions[prev].cy);
+                start += distance / IDM_DESIRED_SPEED;
+            }
+
+            if (planned[j]) {
+                // Owned by a busier corridor: carry on from where its plan puts this axis' green
+                float offset = controller->targetOffsetTicks * TICK_MS / 1000.0f;
+                float green = controller->pendingGreenTicks * TICK_MS / 1000.0f;
+                start = corridor->axis == 0 ? offset : offset + green;
+                continue;
+            }
+            planned[j] = true;
+
+            // Split the effective green between the two axes by their critical flow ratios
+            float effective = cycle - lostTime;
+            float total = criticalEW[j] + criticalNS[j];
+            float greenEW = total > 0 ? effective * criticalEW[j] / total : effective / 2;
+            greenEW = fminf(fmaxf(greenEW, COORD_MIN_GREEN), effective - COORD_MIN_GREEN);
+            greenEW += coordination.lostTime;
+
+            if (step == 0 && controller->coordinated) {
+                // Keep the corridor anchored where it already is
+                float offset = controller->targetOffsetTicks * TICK_MS / 1000.0f;
+                start = corridor->axis == 0 ? offset : offset + controller->pendingGreenTicks * TICK_MS / 1000.0f;
+            }
+            float offset = fmodf(corridor->axis == 0 ? start : start - greenEW, cycle);
+            if (offset < 0) offset += cycle;
+
+            controller->pendingGreenTicks = (Uint32)(greenEW * 1000 / TICK_MS);
+            controller->targetOffsetTicks = (Uint32)(offset * 1000 / TICK_MS) % cycleTicks;
+            if (!controller->coordinated) {
+                controller->coordinated = true;
+                controller->greenTicks = controller->pendingGreenTicks;
+                controller->offsetTicks = controller->targetOffsetTicks;
+                controller->currentServingLane = -1;
+            }
+        }
+        if (logEvents) {
+            printf("Corridor %s from junction %d: cycle %.0fs, progression %s\n",
+                   corridor->axis == 0 ? "east-west" : "north-south", junctions[corridor->junction[0]].id, cycle,
+                   corridor->axis == 0 ? (forward ? "eastbound" : "westbound") : (forward ? "southbound" : "northbound"));
+        }
+    }
+}
+
+// Drive the lights of coordinated junctions from the common cycle, once per tick. New cycle
+// lengths start with the next common cycle, new splits and offset steps with each
+// junction's own next cycle, so a re-plan never cuts a green short abruptly.
+void applyCoordinatedLights() {
+    Uint64 acquired = lockMutex(networkMutex, LOCK_COORDINATED_LIGHTS);
+    if (coordination.cycleTicks == 0) {
+        unlockMutex(networkMutex, LOCK_COORDINATED_LIGHTS, acquired);
+        return;
+    }
+    if (simTick < coordination.cycleStart) coordination.cycleStart = simTick; // Restored to an earlier tick
+    if (simTick - coordination.cycleStart >= coordination.cycleTicks) {
+        coordination.cycleStart = simTick;
+        coordination.cycleTicks = coordination.pendingCycleTicks;
+    }
+    Uint32 cycle = coordination.cycleTicks;
+    Uint32 elapsed = (Uint32)(simTick - coordination.cycleStart);
+
+    for (int j = 0; j < numJunctions; j++) {
+        ControllerState* controller = &junctions[j].controller;
+        if (!controller->coordinated) continue;
+
+        Uint32 position = (elapsed + cycle - controller->offsetTicks % cycle) % cycle;
+        if (position == 0) {
+            controller->greenTicks = controller->pendingGreenTicks;
+            int step = getOffsetStep(controller->offsetTicks, controller->targetOffsetTicks, cycle);
+            int maxStep = (int)(cycle * COORD_MAX_OFFSET_STEP);
+            step = step > maxStep ? maxStep : step < -maxStep ? -maxStep : step;
+            controller->offsetTicks = (controller->offsetTicks + cycle + step) % cycle;
+            position = (elapsed + cycle - controller->offsetTicks) % cycle;
+        }
+
+        bool eastWest = position < controller->greenTicks;
+        Uint32 remaining = eastWest ? controller->greenTicks - position : cycle - position;
+        requestSignalPhase(&junctions[j], eastWest ? 0x3 : 0xC, simTick + remaining);
+    }
+    unlockMutex(networkMutex, LOCK_COORDINATED_LIGHTS, acquired);
+}
+
+// Lanes given green by each actuated phase: east-west, then north-south
+const Uint32 actuatedPhaseMasks[2] = { 0x3, 0xC };
+
+Uint64 getTimingTicks(float seconds) {
+    return (Uint64)(seconds * 1000 / TICK_MS + 0.5f);
+}
+
+// One tick of the actuated controller for a single junction. Once a phase's green is
+// showing it lasts at least the minimum green; when the other phase calls, it ends once no
+// vehicle has been over a loop of the green approaches for the passage time (gap-out), or
+// at max green timed from that call (max-out). The signal then clears through yellow and
+// all-red before the calling phase gets green. With no call elsewhere the green rests
+// where it is. Called holding the junction's lock.
+void stepActuatedJunction(int j) {
+    Junction* junction = &junctions[j];
+    ControllerState* controller = &junction->controller;
+    const SignalTiming* timing = &signalTimings[j];
+    Uint64 now = simTick;
+    int phase = controller->actuatedPhase;
+    SignalPhase signal;
+    readSignalPhase(junction, &signal);
+    Uint64 greenStart = signal.startTick > now ? now : signal.startTick; // Restored to an earlier tick
+
+    bool occupied[NUM_LANES] = { false };
+    int first = detectorStart[j * LANE_GROUPS_PER_JUNCTION];
+    int numLoops = detectorStart[(j + 1) * LANE_GROUPS_PER_JUNCTION] - first;
+    for (int n = 0; n < numLoops; n++) {
+        int group = detectors[first + n].group;
+        if (controller->detectorOccupied[n] && group % 3 == 1) occupied[(group % LANE_GROUPS_PER_JUNCTION) / 3] = true;
+    }
+
+    // A red approach calls while a vehicle is over one of its loops, or once one has driven
+    // onto an advance loop; vehicles on a green or yellow approach extend it instead
+    Uint32 lit = signal.greenMask | signal.yellowMask;
+    bool calls[2] = { false, false };
+    Uint64 lastActuation = greenStart;
+    for (int l = 0; l < NUM_LANES; l++) {
+        if (occupied[l]) controller->lastActuation[l] = now;
+        if ((lit >> l) & 1) {
+            controller->called[l] = false;
+            if (l / 2 == phase && controller->lastActuation[l] > lastActuation) lastActuation = controller->lastActuation[l];
+        } else {
+            calls[l / 2] |= controller->called[l] || occupied[l];
+        }
+    }
+
+    if (phase < 0) {
+        if (!calls[0] && !calls[1]) return; // Nothing has arrived yet
+        phase = controller->actuatedPhase = calls[0] ? 0 : 1;
+    } else if (signal.interval == INTERVAL_GREEN && signal.greenMask == actuatedPhaseMasks[phase]) {
+        Uint64 elapsed = now - greenStart;
+        if (!calls[1 - phase]) {
+            controller->maxTiming = false;
+        } else {
+            if (!controller->maxTiming) {
+                controller->maxTiming = true;
+                controller->maxStart = now;
+            }
+            bool gapOut = now - lastActuation >= getTimingTicks(timing->passage);
+            bool maxOut = now - controller->maxStart >= getTimingTicks(timing->maxGreen);
+            if (elapsed >= getTimingTicks(timing->minGreen) && (gapOut || maxOut)) {
+                atomic_fetch_add_explicit(gapOut ? &metrics.gapOuts[j] : &metrics.maxOuts[j], 1, memory_order_relaxed);
+                if (logEvents) {
+                    printf("Junction %d: %s green %s after %.1f s\n", junction->id, phase == 0 ? "east-west" : "north-south",
+                           gapOut ? "gaps out" : "maxes out", elapsed * TICK_MS / 1000.0f);
+                }
+                phase = controller->actuatedPhase = 1 - phase;
+                controller->maxTiming = false;
+            }
+        }
+    }
+    requestSignalPhase(junction, actuatedPhaseMasks[phase], 0);
+}
+
+// Move each junction's lights a tick towards what its controller asks for, on the
+// simulation thread. A lane losing its green shows yellow, then red through the all-red
+// interval before any lane gains one; a lane green before and after keeps it throughout.
+// Each change is charged the yellow and all-red left after the last vehicle through, and
+// each new green the time until the first vehicle waiting for it crosses the stop line.
+void stepSignals() {
+    Uint64 now = simTick;
+    for (int j = 0; j < numJunctions; j++) {
+        Junction* junction = &junctions[j];
+        LostTime* lost = &junction->lostTime;
+        const SignalTiming* timing = &signalTimings[j];
+        SignalPhase phase;
+        readSignalPhase(junction, &phase);
+        Uint64 elapsed = now > phase.startTick ? now - phase.startTick : 0;
+        Uint32 ending = phase.greenMask & ~phase.requestedMask;
+
+        for (int l = 0; l < NUM_LANES && lost->startingMask; l++) {
+            Uint64 crossed = lastDischargeTick[getLaneGroup(j, l, 1)];
+            if (!((lost->startingMask >> l) & 1) || crossed < lost->greenStart || crossed > now) continue;
+            atomic_fetch_add_explicit(&lost->totalStartupTicks, crossed - lost->greenStart, memory_order_relaxed);
+            if (logEvents) {
+                printf("Junction %d: change of green lost %.1f s to clearance and %.1f s to start-up\n", junction->id,
+                       lost->clearanceTicks * TICK_MS / 1000.0f, (crossed - lost->greenStart) * TICK_MS / 1000.0f);
+            }
+            lost->startingMask = 0;
+            lost->clearanceTicks = 0;
+        }
+
+        if (phase.interval == INTERVAL_YELLOW) {
+            if (elapsed >= getTimingTicks(timing->yellow)) showSignal(junction, INTERVAL_ALL_RED, phase.greenMask, 0);
+        } else if (ending) {
+            showSignal(junction, INTERVAL_YELLOW, phase.greenMask & ~ending, ending);
+            if (!lost->clearingMask) lost->yellowStart = now;
+            lost->clearingMask |= ending;
+            lost->startingMask = 0; // Its green ends without anyone crossing, nothing to charge
+        } else if (phase.interval == INTERVAL_ALL_RED && elapsed < getTimingTicks(timing->allRed)) {
+            continue; // Clearing
+        } else if (phase.interval == INTERVAL_ALL_RED || phase.requestedMask != phase.greenMask) {
+            showSignal(junction, INTERVAL_GREEN, phase.requestedMask, 0);
+            if (lost->clearingMask) {
+                Uint64 last = lost->yellowStart;
+                for (int l = 0; l < NUM_LANES; l++) {
+                    Uint64 crossed = lastDischargeTick[getLaneGroup(j, l, 1)];
+                    if (((lost->clearingMask >> l) & 1) && crossed > last && crossed <= now) last = crossed;
+                }
+                lost->clearanceTicks = now - last;
+                lost->clearingMask = 0;
+                atomic_fetch_add_explicit(&lost->totalClearanceTicks, lost->clearanceTicks, memory_order_relaxed);
+                atomic_fetch_add_explicit(&lost->changes, 1, memory_order_relaxed);
+            }
+            lost->greenStart = now;
+            lost->startingMask = 0;
+            for (int l = 0; l < NUM_LANES; l++) {
+                bool gaining = ((phase.requestedMask & ~phase.greenMask) >> l) & 1;
+                if (gaining && builtQueues[j][l].size > 0) lost->startingMask |= 1u << l;
+            }
+        }
+    }
+}
+
+// Step every junction off the corridor plans on the actuated controller, once per tick,
+// from the detector events of the tick before
+void applyActuatedLights() {
+    Uint64 acquired = lockMutex(networkMutex, LOCK_ACTUATED_NETWORK);
+    bool coordinated[MAX_JUNCTIONS];
+    for (int j = 0; j < numJunctions; j++) {
+        coordinated[j] = junctions[j].controller.coordinated;
+    }
+    unlockMutex(networkMutex, LOCK_ACTUATED_NETWORK, acquired);
+
+    for (int j = 0; j < numJunctions; j++) {
+        if (coordinated[j]) continue;
+        acquired = lockMutex(junctionLocks[j], LOCK_ACTUATED_JUNCTION);
+        drainDetectorFeed(j);
+        stepActuatedJunction(j);
+        unlockMutex(junctionLocks[j], LOCK_ACTUATED_JUNCTION, acquired);
+    }
+}
+
+// One decision of the advanced controller for a single junction
+void updateJunctionLightsAdvanced(Junction* junction) {
     int normalRotationDuration = 5; // 5 seconds per lane in normal rotation
-    time_t lastRotationTime = time(NULL);
+    TrafficQueue* laneQueues = junction->laneQueues;
+    ControllerState* controller = &junction->controller;
     
     // All lanes are in sublane 2
-    int allLanes[4] = {0, 1, 2, 3}; // A2, B2, C2, D2
     int numLanes = 4;
     int lane_C_index = 2; // Lane C2 has special priority
     
-    while (1) {
-        // Update our understanding of the traffic queues
-        updateTrafficQueues();
-        
-        // Log queue sizes for debugging
-        printf("Queue sizes: A2:%d, B2:%d, C2:%d, D2:%d\n", 
-               laneQueues[0].size, laneQueues[1].size, 
-               laneQueues[2].size, laneQueues[3].size);
-        
-        // Lock mutex before modifying traffic light states
-        SDL_LockMutex(vehicleMutex);
-        
-        // Check for priority conditions
-        bool anyHighPriority = false;
-        highestPriorityLane = -1;
+    // Log queue sizes and stop-bar occupancy for debugging
+    if (logEvents) {
+        printf("Junction %d queue sizes: A2:%d, B2:%d, C2:%d, D2:%d; occupancy A2:%.0f%%, B2:%.0f%%, C2:%.0f%%, D2:%.0f%%\n",
+               junction->id, laneQueues[0].size, laneQueues[1].size, laneQueues[2].size, laneQueues[3].size,
+               controller->occupancy[0] * 100, controller->occupancy[1] * 100,
+               controller->occupancy[2] * 100, controller->occupancy[3] * 100);
+    }
+
+    // Check for priority conditions
+    bool anyHighPriority = false;
+    int highestPriorityLane = -1;
+    
+    // First check if C2 has more than 5 vehicles - it gets absolute priority
+    if (laneQueues[lane_C_index].size > 5) {
+        highestPriorityLane = lane_C_index;
+        anyHighPriority = true;
+        if (logEvents) printf("Junction %d: lane C2 has highest priority with %d vehicles\n", junction->id, laneQueues[lane_C_index].size);
+    }
+    // If C2 doesn't have priority, check other lanes
+    else {
+        int maxVehicles = 5; // Threshold for high priority
         
-        // First check if C2 has more than 5 vehicles - it gets absolute priority
-        if (laneQueues[lane_C_index].size > 5) {
-            highestPriorityLane = lane_C_index;
-            anyHighPriority = true;
-            printf("Lane C2 has highest priority with %d vehicles\n", laneQueues[lane_C_index].size);
-        }
-        // If C2 doesn't have priority, check other lanes
-        else {
-            int maxVehicles = 5; // Threshold for high priority
+        // Find lane with most vehicles (above threshold)
+        for (int i = 0; i < numLanes; i++) {
+            // Skip C2 as we already checked it
+            if (i == lane_C_index) continue;
             
-            // Find lane with most vehicles (above threshold)
-            for (int i = 0; i < numLanes; i++) {
-                // Skip C2 as we already checked it
-                if (i == lane_C_index) continue;
-                
-                if (laneQueues[i].size > maxVehicles) {
-                    maxVehicles = laneQueues[i].size;
-                    highestPriorityLane = i;
-                    anyHighPriority = true;
-                }
-            }
-            
-            if (anyHighPriority) {
-                printf("Lane %c2 has priority with %d vehicles\n", 
-                       'A' + highestPriorityLane, laneQueues[highestPriorityLane].size);
+            if (laneQueues[i].size > maxVehicles) {
+                maxVehicles = laneQueues[i].size;
+                highestPriorityLane = i;
+                anyHighPriority = true;
             }
         }
         
-        // Handle high priority mode
-        if (anyHighPriority) {
-            // Set all lights to red
-            for (int i = 0; i < numLanes; i++) {
-                trafficLights[i].green = false;
-            }
-            
-            // Give green light to priority lane
-            trafficLights[highestPriorityLane].green = true;
-            currentServingLane = highestPriorityLane;
+        if (anyHighPriority && logEvents) {
+            printf("Junction %d: lane %c2 has priority with %d vehicles\n", junction->id,
+                   'A' + highestPriorityLane, laneQueues[highestPriorityLane].size);
+        }
+    }
+    
+    controller->highestPriorityLane = highestPriorityLane;
+
+    // Handle high priority mode
+    if (anyHighPriority) {
+        // Give green light to priority lane, all others red
+        // Held for as long as the lane stays over the threshold, so no planned end
+        requestSignalPhase(junction, 1u << highestPriorityLane, 0);
+        controller->currentServingLane = highestPriorityLane;
+        
+        // Reset normal rotation timing
+        controller->lastRotationTick = simTick;
+        
+        if (logEvents) printf("Junction %d HIGH PRIORITY MODE: Lane %c2 gets green light\n", junction->id, 'A' + highestPriorityLane);
+    }
+    // Handle normal mode (no high priority lanes)
+    else {
+        Uint64 elapsedMs = (simTick - controller->lastRotationTick) * TICK_MS;
+        
+        // Check if current lane's green light duration is over or if we need to select a lane
+        if (controller->currentServingLane == -1 || 
+            elapsedMs >= (Uint64)normalRotationDuration * 1000 ||
+            laneQueues[controller->currentServingLane].size == 0) {
             
-            // Reset normal rotation timing
-            lastRotationTime = time(NULL);
+            // Set all lights to red first
+            Uint32 greenLanes = 0;
             
-            printf("HIGH PRIORITY MODE: Lane %c2 gets green light\n", 'A' + highestPriorityLane);
-        }
-        // Handle normal mode (no high priority lanes)
-        else {
-            time_t currentTime = time(NULL);
+            // Find lanes with vehicles waiting
+            int lanesWithVehicles[numLanes];
+            int numLanesWithVehicles = 0;
             
-            // Check if current lane's green light duration is over or if we need to select a lane
-            if (currentServingLane == -1 || 
-                currentTime - lastRotationTime >= normalRotationDuration ||
-                laneQueues[currentServingLane].size == 0) {
-                
-                // Set all lights to red first
-                for (int i = 0; i < numLanes; i++) {
-                    trafficLights[i].green = false;
+            for (int i = 0; i < numLanes; i++) {
+                if (laneQueues[i].size > 0) {
+                    lanesWithVehicles[numLanesWithVehicles++] = i;
                 }
+            }
+            
+            // If there are lanes with vehicles
+            if (numLanesWithVehicles > 0) {
+                // Find lane with most waiting vehicles
+                int maxWaitingLane = lanesWithVehicles[0];
+                int maxWaitingCount = laneQueues[maxWaitingLane].size;
                 
-                // Find lanes with vehicles waiting
-                int lanesWithVehicles[numLanes];
-                int numLanesWithVehicles = 0;
-                
-                for (int i = 0; i < numLanes; i++) {
-                    if (laneQueues[i].size > 0) {
-                        lanesWithVehicles[numLanesWithVehicles++] = i;
+                for (int i = 1; i < numLanesWithVehicles; i++) {
+                    int laneIndex = lanesWithVehicles[i];
+                    if (laneQueues[laneIndex].size > maxWaitingCount) {
+                        maxWaitingCount = laneQueues[laneIndex].size;
+                        maxWaitingLane = laneIndex;
                     }
                 }
                 
-                // If there are lanes with vehicles
-                if (numLanesWithVehicles > 0) {
-                    // Find lane with most waiting vehicles
-                    int maxWaitingLane = lanesWithVehicles[0];
-                    int maxWaitingCount = laneQueues[maxWaitingLane].size;
-                    
-                    for (int i = 1; i < numLanesWithVehicles; i++) {
-                        int laneIndex = lanesWithVehicles[i];
-                        if (laneQueues[laneIndex].size > maxWaitingCount) {
-                            maxWaitingCount = laneQueues[laneIndex].size;
-                            maxWaitingLane = laneIndex;
-                        }
-                    }
-                    
-                    // Set the selected lane to green
-                    trafficLights[maxWaitingLane].green = true;
-                    currentServingLane = maxWaitingLane;
-                    lastRotationTime = currentTime;
-                    
-                    printf("NORMAL MODE: Serving lane %c2 with %d vehicles (highest count)\n", 
+                // Set the selected lane to green
+                greenLanes = 1u << maxWaitingLane;
+                controller->currentServingLane = maxWaitingLane;
+                controller->lastRotationTick = simTick;
+                
+                if (logEvents) {
+                    printf("Junction %d NORMAL MODE: Serving lane %c2 with %d vehicles (highest count)\n", junction->id,
                            'A' + maxWaitingLane, laneQueues[maxWaitingLane].size);
-                } else {
-                    // No vehicles waiting in any lane
-                    currentServingLane = -1;
-                    printf("No vehicles waiting in any lane\n");
                 }
+            } else {
+                // No vehicles waiting in any lane
+                controller->currentServingLane = -1;
+                if (logEvents) printf("Junction %d: no vehicles waiting in any lane\n", junction->id);
             }
+            Uint64 plannedEnd = greenLanes ? controller->lastRotationTick + normalRotationDuration * 1000 / TICK_MS : 0;
+            requestSignalPhase(junction, greenLanes, plannedEnd);
         }
-        
-        SDL_UnlockMutex(vehicleMutex);
-        
+    }
+}
+
+// One round of the advanced controller over the whole network
+void stepTrafficLightsAdvanced() {
+    Uint64 profileStart = profileBegin();
+
+    // The simulation thread keeps the traffic queues up to date; re-plan the corridors first
+    Uint64 acquired = lockMutex(networkMutex, LOCK_CONTROLLER_NETWORK);
+    planCoordination();
+    int count = numJunctions;
+    bool coordinated[MAX_JUNCTIONS];
+    for (int j = 0; j < count; j++) {
+        coordinated[j] = junctions[j].controller.coordinated;
+    }
+    unlockMutex(networkMutex, LOCK_CONTROLLER_NETWORK, acquired);
+
+    // Then each junction reads its detectors and, unless the corridor plan drives it,
+    // decides on its own, holding only its own lock. Actuated junctions are stepped with
+    // the simulation clock instead.
+    for (int j = 0; j < count; j++) {
+        if (actuatedControl && !coordinated[j]) continue;
+        acquired = lockMutex(junctionLocks[j], LOCK_CONTROLLER_JUNCTION);
+        readDetectorFeed(j);
+        if (!coordinated[j]) updateJunctionLightsAdvanced(&junctions[j]);
+        unlockMutex(junctionLocks[j], LOCK_CONTROLLER_JUNCTION, acquired);
+    }
+    profileEnd(PROF_CONTROLLER, profileStart);
+}
+
+void* updateTrafficLightsAdvanced(void* arg) {
+    traceThreadName("traffic lights");
+    while (!isStopRequested()) {
+        stepTrafficLightsAdvanced();
+
         // Check every second
-        sleep(1);
+        waitForStop(1000);
     }
     
     return NULL;
@@ -432,327 +2437,1800 @@ int getRouteType(char source_lane, int source_sublane, char target_lane, int tar
 }
 
 
-// Convert lane letter and number to screen coordinates
-void getLanePosition(char lane, int sublane, int* x, int* y) {
-    int center_x = WINDOW_WIDTH / 2;
-    int center_y = WINDOW_HEIGHT / 2;
+// Convert lane letter and number to the world coordinates where the lane enters the network
+void getLanePosition(int junction, char lane, int sublane, float* x, float* y) {
+    int center_x = junctions[junction].cx;
+    int center_y = junctions[junction].cy;
 
     switch (lane) {
         case 'A': // Left side lanes (moving right)
-            *x = 0;  // Start from the left
+            *x = worldMinX;  // Start from the left
             *y = center_y - ROAD_WIDTH / 2 + (sublane - 1) * LANE_WIDTH + LANE_WIDTH / 2; // Centered
             break;
 
         case 'B': // Right side lanes (moving left)
-            *x = WINDOW_WIDTH; // Start from the right
+            *x = worldMaxX; // Start from the right
             *y = center_y + ROAD_WIDTH / 2 - (sublane - 1) * LANE_WIDTH - LANE_WIDTH / 2; // Centered
             break;
 
         case 'C': // Top side lanes (moving down)
             *x = center_x - ROAD_WIDTH / 2 + (sublane - 1) * LANE_WIDTH + LANE_WIDTH / 2; // Centered
-            *y = 0; // Start from the top
+            *y = worldMinY; // Start from the top
             break;
 
         case 'D': // Bottom side lanes (moving up)
             *x = center_x + ROAD_WIDTH / 2 - (sublane - 1) * LANE_WIDTH - LANE_WIDTH / 2; // Centered
-            *y = WINDOW_HEIGHT; // Start from the bottom
+            *y = worldMaxY; // Start from the bottom
             break;
     }
 }
 
-void initVehicles() {
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        vehicles[i].active = false;
+// One sample of a turn path, spaced VEHICLE_SPEED pixels of arc length apart.
+// Positions are relative to the junction centre so every junction shares the tables.
+typedef struct {
+    short x, y;
+    float heading; // Radians, 0 = moving right, PI/2 = moving down (screen coordinates)
+} PathPoint;
+
+// A movement through the junction, from the entry point on the source lane to the exit lane
+typedef struct {
+    char fromLane;
+    int fromSublane;
+    int choice;         // Required vehicle choice, -1 for any
+    char toLane;
+    int toSublane;
+    int routeType;
+    int length;
+    PathPoint points[MAX_PATH_POINTS];
+    Uint64 cells[MAX_PATH_POINTS]; // Conflict cells a vehicle at each sample still covers, its own length included
+} TurnPath;
+
+// Geometry of a movement: entry and exit points plus the lane headings there
+typedef struct {
+    char fromLane;
+    int fromSublane;
+    int choice;
+    int x0, y0;
+    char toLane;
+    int toSublane;
+    int x1, y1;
+} TurnMovement;
+
+#define NUM_TURN_PATHS 12
+
+TurnPath turnPaths[NUM_TURN_PATHS];
+
+// The junction box is divided into CONFLICT_GRID x CONFLICT_GRID cells, a square around
+// the junction centre just large enough for every path and the vehicles on it
+float conflictExtent;   // Half the side of the square, px
+float conflictCellSize; // px
+
+// Lane heading as a unit vector
+void getLaneHeading(char lane, float* dx, float* dy) {
+    *dx = 0;
+    *dy = 0;
+    switch (lane) {
+        case 'A': *dx = 1;  break;
+        case 'B': *dx = -1; break;
+        case 'C': *dy = 1;  break;
+        case 'D': *dy = -1; break;
     }
 }
 
-int getDirection(char lane) {
-    return (lane == 'A' || lane == 'C') ? 1 : -1;
+// Position along the lane's direction of travel, growing as the vehicle moves forward
+float getLaneProgress(char lane, float x, float y) {
+    switch (lane) {
+        case 'A': return x;
+        case 'B': return -x;
+        case 'C': return y;
+        case 'D': return -y;
+    }
+    return 0;
 }
 
-void spawnVehicle(const char* id, char lane, int sublane) {
-    // Prevent spawning in Lane A, Sublane 3
-    if (lane == 'A' && sublane == 3) {
-        return; // Skip this vehicle
+// Conflict cells under a vehicle centred at (x, y) relative to the junction centre. The
+// footprint is a square as wide as the vehicle, whatever its heading.
+Uint64 getConflictCells(float x, float y) {
+    float half = VEHICLE_SIZE / 2;
+    int x0 = (int)floorf((x - half + conflictExtent) / conflictCellSize);
+    int x1 = (int)floorf((x + half + conflictExtent) / conflictCellSize);
+    int y0 = (int)floorf((y - half + conflictExtent) / conflictCellSize);
+    int y1 = (int)floorf((y + half + conflictExtent) / conflictCellSize);
+    Uint64 cells = 0;
+    for (int cy = y0 < 0 ? 0 : y0; cy <= y1 && cy < CONFLICT_GRID; cy++) {
+        for (int cx = x0 < 0 ? 0 : x0; cx <= x1 && cx < CONFLICT_GRID; cx++) {
+            cells |= (Uint64)1 << (cy * CONFLICT_GRID + cx);
+        }
     }
+    return cells;
+}
 
-    SDL_LockMutex(vehicleMutex);
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (!vehicles[i].active) {
-            vehicles[i].active = true;
-            snprintf(vehicles[i].id, 9, "%s", id);
-            vehicles[i].lane = lane;
-            vehicles[i].sublane = sublane;
-            vehicles[i].direction = (lane == 'A' || lane == 'C') ? 1 : -1;
-            getLanePosition(lane, sublane, &vehicles[i].x, &vehicles[i].y);
-
-            // Initialize the color attribute
-            vehicles[i].color = (SDL_Color){rand() % 256, rand() % 256, rand() % 256, 255};
-            vehicles[i].choice = rand() % 2;
-
+// Cubic Bezier point, used only while building the path tables
+void calculateBezierCurve(float x0, float y0, float x1, float y1, float x2, float y2, float x3, float y3, float t, float* x, float* y) {
+    float u = 1 - t;
+    *x = u * u * u * x0 + 3 * u * u * t * x1 + 3 * u * t * t * x2 + t * t * t * x3;
+    *y = u * u * u * y0 + 3 * u * u * t * y1 + 3 * u * t * t * y2 + t * t * t * y3;
+}
 
-            printf("Spawned Vehicle: %s at lane %c, sublane %d\n", vehicles[i].id, lane, sublane);
-            break;
+// Sample the curve for a movement and resample it at equal arc length steps
+void buildTurnPath(TurnPath* path, const TurnMovement* move) {
+    enum { FINE_STEPS = 1024 };
+    static float fineX[FINE_STEPS + 1], fineY[FINE_STEPS + 1], fineLength[FINE_STEPS + 1];
+
+    float hx0, hy0, hx1, hy1;
+    getLaneHeading(move->fromLane, &hx0, &hy0);
+    getLaneHeading(move->toLane, &hx1, &hy1);
+
+    // Control points pushed along the entry and exit headings give a tangent-continuous curve
+    float chord = sqrtf((float)((move->x1 - move->x0) * (move->x1 - move->x0) + (move->y1 - move->y0) * (move->y1 - move->y0)));
+    float reach = chord * 0.5f;
+    float cx0 = move->x0 + hx0 * reach, cy0 = move->y0 + hy0 * reach;
+    float cx1 = move->x1 - hx1 * reach, cy1 = move->y1 - hy1 * reach;
+
+    fineLength[0] = 0;
+    for (int k = 0; k <= FINE_STEPS; k++) {
+        calculateBezierCurve(move->x0, move->y0, cx0, cy0, cx1, cy1, move->x1, move->y1,
+                             (float)k / FINE_STEPS, &fineX[k], &fineY[k]);
+        if (k > 0) {
+            float dx = fineX[k] - fineX[k - 1];
+            float dy = fineY[k] - fineY[k - 1];
+            fineLength[k] = fineLength[k - 1] + sqrtf(dx * dx + dy * dy);
         }
     }
-    SDL_UnlockMutex(vehicleMutex);
+
+    path->fromLane = move->fromLane;
+    path->fromSublane = move->fromSublane;
+    path->choice = move->choice;
+    path->toLane = move->toLane;
+    path->toSublane = move->toSublane;
+
+    // Turning direction from the cross product of entry and exit headings (y grows downwards)
+    float cross = hx0 * hy1 - hy0 * hx1;
+    path->routeType = cross > 0.5f ? RIGHT_TURN : (cross < -0.5f ? LEFT_TURN : STRAIGHT);
+
+    int k = 0;
+    int n = 0;
+    for (float distance = 0; distance <= fineLength[FINE_STEPS] && n < MAX_PATH_POINTS; distance += VEHICLE_SPEED) {
+        while (k < FINE_STEPS - 1 && fineLength[k + 1] < distance) k++;
+        float segment = fineLength[k + 1] - fineLength[k];
+        float f = segment > 0 ? (distance - fineLength[k]) / segment : 0;
+        path->points[n].x = (short)lroundf(fineX[k] + (fineX[k + 1] - fineX[k]) * f);
+        path->points[n].y = (short)lroundf(fineY[k] + (fineY[k + 1] - fineY[k]) * f);
+        path->points[n].heading = atan2f(fineY[k + 1] - fineY[k], fineX[k + 1] - fineX[k]);
+        n++;
+    }
+    // A curve too long for the table would leave its vehicles short of the exit lane: say
+    // so, and end the path on the exit point so they still get there
+    if (fineLength[FINE_STEPS] > (float)(MAX_PATH_POINTS - 1) * VEHICLE_SPEED) {
+        printf("Turn path %c%d to %c%d is %.0f px long, more than the %d px MAX_PATH_POINTS holds\n",
+               move->fromLane, move->fromSublane, move->toLane, move->toSublane, fineLength[FINE_STEPS],
+               (MAX_PATH_POINTS - 1) * VEHICLE_SPEED);
+        path->points[n - 1].x = (short)move->x1;
+        path->points[n - 1].y = (short)move->y1;
+        path->points[n - 1].heading = atan2f(fineY[FINE_STEPS] - fineY[FINE_STEPS - 1], fineX[FINE_STEPS] - fineX[FINE_STEPS - 1]);
+    }
+    path->length = n;
 }
 
-void* generateVehicles(void* arg) {
-    srand(time(NULL));
-    char lanes[] = {'A', 'B', 'C', 'D'};
+// Build every junction movement once at startup, around a junction centred on the origin
+void initTurnPaths() {
+    int cx = 0;
+    int cy = 0;
+    int edge = ROAD_WIDTH / 2;
+
+    const TurnMovement movements[NUM_TURN_PATHS] = {
+        { 'A', 2, 0, cx - 75, cy,          'A', 1, cx + 75, cy - 70 },     // A2 drifts into A1
+        { 'A', 2, 1, cx - 75, cy,          'C', 3, cx + 70, cy + 150 },    // A2 turns down into C3
+        { 'A', 1, -1, cx - edge, cy - 70,  'D', 1, cx - 70, cy - edge },   // A1 turns up into D1
+        { 'B', 2, 0, cx, cy,               'B', 3, cx - 75, cy + 75 },     // B2 drifts into B3
+        { 'B', 2, 1, cx, cy,               'D', 1, cx - 75, cy - 75 },     // B2 turns up into D1
+        { 'B', 1, -1, cx + edge, cy + 70,  'C', 1, cx + 70, cy + edge },   // B1 turns down into C1
+        { 'C', 2, 0, cx, cy,               'B', 3, cx - 75, cy + 75 },     // C2 turns left into B3
+        { 'C', 2, 1, cx, cy,               'C', 3, cx + 70, cy + 75 },     // C2 drifts into C3
+        { 'C', 3, -1, cx + 70, cy - edge,  'A', 1, cx + edge, cy - 70 },   // C3 turns right into A1
+        { 'D', 2, 0, cx, cy,               'D', 1, cx - 70, cy - 75 },     // D2 drifts into D1
+        { 'D', 2, 1, cx, cy,               'A', 1, cx + 75, cy - 75 },     // D2 turns right into A1
+        { 'D', 3, -1, cx - 70, cy + edge,  'B', 3, cx - edge, cy + 70 },   // D3 turns left into B3
+    };
 
-    while (1) {
-        int laneIndex = rand() % 4;
-        int sublane = (rand() % 3) + 1;
+    for (int i = 0; i < NUM_TURN_PATHS; i++) {
+        buildTurnPath(&turnPaths[i], &movements[i]);
+    }
 
+    conflictExtent = 0;
+    for (int i = 0; i < NUM_TURN_PATHS; i++) {
+        for (int k = 0; k < turnPaths[i].length; k++) {
+            conflictExtent = fmaxf(conflictExtent, fmaxf((float)abs(turnPaths[i].points[k].x), (float)abs(turnPaths[i].points[k].y)));
+        }
+    }
+    conflictExtent += VEHICLE_SIZE / 2 + 1;
+    conflictCellSize = 2 * conflictExtent / CONFLICT_GRID;
+
+    // A vehicle covers the cells around the samples from its rear to its centre and still
+    // needs every cell from there to the end of the path
+    int back = (VEHICLE_LENGTH / 2 + VEHICLE_SPEED - 1) / VEHICLE_SPEED;
+    for (int i = 0; i < NUM_TURN_PATHS; i++) {
+        TurnPath* path = &turnPaths[i];
+        Uint64 ahead = 0;
+        for (int k = path->length - 1; k >= 0; k--) {
+            ahead |= getConflictCells(path->points[k].x, path->points[k].y);
+            path->cells[k] = ahead;
+        }
+        for (int k = path->length - 1; k >= 0; k--) {
+            path->cells[k] = path->cells[k > back ? k - back : 0];
+        }
+    }
+}
 
-        // Prevent spawning in `A3` and `D1`
-        if ((lanes[laneIndex] == 'A' && sublane == 3) ||(lanes[laneIndex] == 'B' && sublane == 3) || (lanes[laneIndex] == 'D' && sublane == 1) || (lanes[laneIndex] == 'C' && sublane == 1)) {
-            continue; // Skip this iteration
+// Find the movement a vehicle takes from its current lane, or -1 if it goes straight on
+int findTurnPath(char lane, int sublane, int choice) {
+    for (int i = 0; i < NUM_TURN_PATHS; i++) {
+        if (turnPaths[i].fromLane == lane && turnPaths[i].fromSublane == sublane &&
+            (turnPaths[i].choice == -1 || turnPaths[i].choice == choice)) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        char vehicleID[9];
-        snprintf(vehicleID, 9, "V%03d", rand() % 1000);
+int getDirection(char lane) {
+    return (lane == 'A' || lane == 'C') ? 1 : -1;
+}
 
-        spawnVehicle(vehicleID, lanes[laneIndex], sublane);
-        sleep(1);
+// First junction whose approach on this lane comes in from the edge of the network
+int findEntryJunction(char lane) {
+    if (lane < 'A' || lane > 'D') return -1;
+    for (int j = 0; j < numJunctions; j++) {
+        if (junctions[j].neighbour[getOppositeLane(lane - 'A')] == -1) return j;
     }
-    return NULL;
+    return -1;
 }
 
-//for curve turn from A2 to C3
-void calculateBezierCurve(int x0, int y0, int x1, int y1, int x2, int y2, float t, int* x, int* y) {
-    float u = 1 - t;
-    float tt = t * t;
-    float uu = u * u;
+// Pick the movement a vehicle will make at its current junction
+void chooseRoute(int i) {
+    Vehicle* v = getVehicle(i);
+    v->choice = simRandom() % 2;
 
-    *x = uu * x0 + 2 * u * t * x1 + tt * x2;
-    *y = uu * y0 + 2 * u * t * y1 + tt * y2;
+    // Record where the vehicle is headed through the junction
+    int turn = findTurnPath(v->lane, v->sublane, v->choice);
+    v->target_lane = turn >= 0 ? turnPaths[turn].toLane : v->lane;
+    v->target_sublane = turn >= 0 ? turnPaths[turn].toSublane : v->sublane;
+    v->route_type = turn >= 0 ? turnPaths[turn].routeType : STRAIGHT;
 }
 
-void updateVehicles() {
-    SDL_LockMutex(vehicleMutex);
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (!vehicles[i].active) continue;
+// Vehicles waiting to enter through one lane group
+typedef struct {
+    int count;
+    char ids[MAX_PENDING_SPAWNS][9];
+} SpawnQueue;
+
+SpawnQueue spawnQueues[MAX_LANE_GROUPS]; // Each guarded by its spawnLocks entry
+
+// Fill in a fresh vehicle entering on the given approach at the edge of the world
+void initVehicle(int i, const char* id, int junction, char lane, int sublane) {
+    if (i >= vehicleSpan) vehicleSpan = i + 1;
+    Vehicle* v = getVehicle(i);
+    v->active = true;
+    snprintf(v->id, 9, "%s", id);
+    v->lane = lane;
+    v->sublane = sublane;
+    v->direction = (lane == 'A' || lane == 'C') ? 1 : -1;
+    v->junction = junction;
+    getLanePosition(junction, lane, sublane, &v->x, &v->y);
+    v->merging = false;
+    v->pathId = -1;
+    v->pathIndex = 0;
+    v->pathDistance = 0;
+    v->cleared = false;
+    v->goOnYellow = false;
+    v->queuedTick = simTick;
+    v->askingTick = 0;
+
+    // Each driver gets slightly different car-following parameters
+    v->desiredSpeed = IDM_DESIRED_SPEED * (0.9f + (simRandom() % 21) / 100.0f);
+    v->maxAccel = IDM_MAX_ACCEL * (0.8f + (simRandom() % 41) / 100.0f);
+    v->comfortDecel = IDM_COMFORT_DECEL;
+    v->minGap = IDM_MIN_GAP;
+    v->timeHeadway = IDM_TIME_HEADWAY * (0.85f + (simRandom() % 31) / 100.0f);
+    v->reactionTime = IDM_REACTION_TIME * (0.75f + (simRandom() % 51) / 100.0f);
+    v->speed = v->desiredSpeed;
+    v->accel = 0;
+    v->waitTime = 0;
+
+    // Initialize the color attribute
+    v->color = (SDL_Color){simRandom() % 256, simRandom() % 256, simRandom() % 256, 255};
+    chooseRoute(i);
+    if (sublane == 2) atomic_fetch_add(&junctions[junction].controller.arrivals[lane - 'A'], 1);
+}
 
-        bool canMove = true;
+// Where the search for a free slot resumes. Vehicles take the lowest free slot, and
+// admitSpawns() restarts the search from 0 every tick, after the last tick freed slots.
+int nextFreeVehicle = 0;
 
-        // Check if there is a vehicle ahead in the same lane and sublane
-        for (int j = 0; j < MAX_VEHICLES; j++) {
-            if (i != j && vehicles[j].active && vehicles[j].lane == vehicles[i].lane && vehicles[j].sublane == vehicles[i].sublane) {
-                if (vehicles[i].lane == 'A' && vehicles[i].x < vehicles[j].x && vehicles[j].x - vehicles[i].x < VEHICLE_LENGTH + 10) {
-                    canMove = false;
-                    break;
-                }
-                if (vehicles[i].lane == 'B' && vehicles[i].x > vehicles[j].x && vehicles[i].x - vehicles[j].x < VEHICLE_LENGTH + 10) {
-                    canMove = false;
-                    break;
-                }
-                if (vehicles[i].lane == 'C' && vehicles[i].y < vehicles[j].y && vehicles[j].y - vehicles[i].y < VEHICLE_LENGTH + 10) {
-                    canMove = false;
-                    break;
-                }
-                if (vehicles[i].lane == 'D' && vehicles[i].y > vehicles[j].y && vehicles[i].y - vehicles[j].y < VEHICLE_LENGTH + 10) {
-                    canMove = false;
-                    break;
-                }
-            }
-        }
+// Lowest free slot, growing the pool by a chunk when all are taken; -1 at vehicleLimit
+int findFreeVehicle() {
+    int usable = vehicleCapacity < vehicleLimit ? vehicleCapacity : vehicleLimit;
+    for (; nextFreeVehicle < usable; nextFreeVehicle++) {
+        if (!getVehicle(nextFreeVehicle)->active) return nextFreeVehicle;
+    }
+    if (vehicleCapacity < vehicleLimit && reserveVehicles(vehicleCapacity + VEHICLE_CHUNK)) return nextFreeVehicle;
+    return -1;
+}
 
-        if (!canMove) continue;
+// Put a vehicle on the road: runs on the simulation thread, which owns the vehicle pool
+void admitVehicle(const char* id, int junction, char lane, int sublane) {
+    if (junction >= numJunctions || junctions[junction].neighbour[getOppositeLane(lane - 'A')] != -1) {
+        return; // Only lanes that enter from the edge of the network can spawn
+    }
 
-        switch (vehicles[i].lane) {
-            case 'A': 
-                if (vehicles[i].sublane == 2 && !trafficLights[0].green && vehicles[i].x >= (WINDOW_WIDTH / 2 - STOP_DISTANCE) && vehicles[i].x < (WINDOW_WIDTH / 2) - 150) {
-                    continue; // Stop if light is red and vehicle is close enough
-                }
-                vehicles[i].x += VEHICLE_SPEED; // Move right
-
-                if (vehicles[i].sublane == 2 && vehicles[i].x >= WINDOW_WIDTH / 2 - 75) {
-                    if (vehicles[i].choice == 0){
-                        vehicles[i].y -=  VEHICLE_SPEED;  // Move smoothly up or down
-                        if (vehicles[i].y <= WINDOW_HEIGHT / 2 - 72 ) {
-                            vehicles[i].lane = 'A'; // Change the lane to either C3 or A1
-                            vehicles[i].sublane =  1;
-                        }
-                    }
-                    else{
-                        // Calculate the Bezier curve points for the turn
-                        int x, y;
-                        float t = (float)(vehicles[i].x - (WINDOW_WIDTH / 2 - 75)) / 150.0f;
-                        // Adjust control points to be slightly above the turn
-                        calculateBezierCurve(WINDOW_WIDTH / 2 - 75, vehicles[i].y, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 20, WINDOW_WIDTH / 2 + 75, WINDOW_HEIGHT / 2 + 150, t, &x, &y);
-                        vehicles[i].x = x;
-                        vehicles[i].y = y;
-
-                        if (t >= 1.0f) {
-                            vehicles[i].lane = 'C'; // Change the lane to C3
-                            vehicles[i].sublane = 3;
-                        }
-                    }
-                }
-                // **A1 should turn left into D1 smoothly**
-                if (vehicles[i].sublane == 1 && vehicles[i].x <= WINDOW_WIDTH / 2 - 50 && vehicles[i].x >= WINDOW_WIDTH / 2 - 75) {
-                    printf("Turning left: Vehicle %s from A1 to D1\n", vehicles[i].id);
-                    
-                    // Start moving upward instead of continuing right
-                    vehicles[i].y -= VEHICLE_SPEED; 
-                    
-                    // If vehicle has reached the middle, switch lanes
-                    if (vehicles[i].y <= WINDOW_HEIGHT / 2 - 75 ) {
-                        vehicles[i].lane = 'D';
-                        vehicles[i].sublane = 1;
-                        vehicles[i].direction = 1; // Move down in D1
-                    }
-                }
-                break;
+    int i = findFreeVehicle();
+    if (i < 0) {
+        atomic_fetch_add_explicit(&droppedSpawns, 1, memory_order_relaxed);
+        return;
+    }
+    initVehicle(i, id, junction, lane, sublane);
+    nextFreeVehicle = i + 1;
+    atomic_fetch_add_explicit(&metrics.spawns, 1, memory_order_relaxed);
+    if (logEvents) {
+        printf("Spawned Vehicle: %s at junction %d lane %c, sublane %d\n", getVehicle(i)->id, junctions[junction].id, lane, sublane);
+    }
+}
 
-            case 'B': 
-                if (vehicles[i].sublane == 2 && !trafficLights[1].green && vehicles[i].x <= (WINDOW_WIDTH / 2 + STOP_DISTANCE) && vehicles[i].x > (WINDOW_WIDTH / 2) + 150) {
-                    continue; // Stop if light is red and vehicle is close enough
-                }
-                vehicles[i].x -= VEHICLE_SPEED; // Move left
-                
-                if (vehicles[i].sublane == 2 && vehicles[i].x <= WINDOW_WIDTH / 2 ) {
-                    if (vehicles[i].choice == 0){
-                        vehicles[i].y += VEHICLE_SPEED; // Move smoothly up or down
-                        if (vehicles[i].y <= WINDOW_HEIGHT / 2 - 75 || vehicles[i].y >= WINDOW_HEIGHT / 2 + 75) {
-                            vehicles[i].lane = 'B'; // Change the lane to either B3 or D1
-                            vehicles[i].sublane = 3;
-                        }
-                 }
-                    else{
-                        vehicles[i].y -=  VEHICLE_SPEED;  // Move smoothly up or down
-                        if (vehicles[i].y <= WINDOW_HEIGHT / 2 - 75 ) {
-                            vehicles[i].lane = 'D'; // Change the lane to either C3 or A1
-                            vehicles[i].sublane =  1;
-                        }
-                    }
-                }
-                // **B1 should turn left into C1 smoothly**
-                if (vehicles[i].sublane == 1 && vehicles[i].x <= WINDOW_WIDTH / 2 + 75) {
-                    printf("Turning left: Vehicle %s from B1 to C1\n", vehicles[i].id);
-                    
-                    // Start moving downward instead of continuing left
-                    vehicles[i].y += VEHICLE_SPEED;                     
-
-                    // If vehicle has reached the middle, switch lanes
-                    if (vehicles[i].y >= WINDOW_HEIGHT / 2) {
-                        vehicles[i].lane = 'C';
-                        vehicles[i].sublane = 1;
-                        vehicles[i].direction = 1; // Move down in C1
-                    }
-                }
-                break;
+// Spawn at the network edge on the given junction's approach. Safe from any thread: the
+// request waits in the lane group's queue, under that group's lock only, and the vehicle
+// appears at the start of the next tick.
+void spawnVehicleAt(const char* id, int junction, char lane, int sublane) {
+    // Prevent spawning in Lane A, Sublane 3
+    if (lane == 'A' && sublane == 3) {
+        return; // Skip this vehicle
+    }
+    if (junction < 0 || junction >= MAX_JUNCTIONS || lane < 'A' || lane > 'D' || sublane < 1 || sublane > 3) {
+        return;
+    }
 
-            case 'C': 
-                if (vehicles[i].sublane == 2 && !trafficLights[2].green && vehicles[i].y >= (WINDOW_HEIGHT / 2 - STOP_DISTANCE) && vehicles[i].y < (WINDOW_HEIGHT / 2) - 150) {
-                    continue; // Stop if light is red and vehicle is close enough
-                }
-                vehicles[i].y += VEHICLE_SPEED; // Move down
-
-                if (vehicles[i].sublane == 2 && vehicles[i].y >= WINDOW_HEIGHT / 2  ) {
-                        if(vehicles[i].choice == 0){
-                            vehicles[i].x -=  VEHICLE_SPEED; // Move smoothly left 
-                            if (vehicles[i].x <= WINDOW_WIDTH / 2 - 75) {
-                                vehicles[i].lane = 'B'; // Change the lane to either C3 or B3
-                                vehicles[i].sublane = 3;
-                            }
-                    }
-                    else{
-                    vehicles[i].x +=  VEHICLE_SPEED; // Move smoothly left 
-                    if (vehicles[i].x >= WINDOW_WIDTH / 2 + 75) {
-                        vehicles[i].lane = 'C'; // Change the lane to either C3 or B3
-                        vehicles[i].sublane = 3;
-                    }
-                 }
-                }
-                // **C3 should turn left into A3 smoothly**
-                if (vehicles[i].sublane == 3 && vehicles[i].y >= WINDOW_HEIGHT / 2 - 75 && vehicles[i].y <= WINDOW_HEIGHT / 2 ) {
-                    printf("Turning left: Vehicle %s from C3 to A3\n", vehicles[i].id);
-                    
-                    // Start moving right instead of continuing down
-                    vehicles[i].x += VEHICLE_SPEED; 
-
-                    // If vehicle has reached the middle, switch lanes
-                    if (vehicles[i].x >= WINDOW_WIDTH / 2) {
-                        vehicles[i].lane = 'A';
-                        vehicles[i].sublane = 1;
-                        vehicles[i].direction = 1; // Move right in A3
-                    }
-                }
+    int g = getLaneGroup(junction, lane - 'A', sublane - 1);
+    Uint64 acquired = lockMutex(spawnLocks[g], LOCK_POST_SPAWN);
+    SpawnQueue* queue = &spawnQueues[g];
+    if (queue->count < MAX_PENDING_SPAWNS) {
+        snprintf(queue->ids[queue->count++], 9, "%s", id);
+    } else {
+        atomic_fetch_add_explicit(&droppedSpawns, 1, memory_order_relaxed);
+    }
+    unlockMutex(spawnLocks[g], LOCK_POST_SPAWN, acquired);
+}
+
+// Admit every pending spawn, lane group by lane group so the order is reproducible
+void admitSpawns() {
+    nextFreeVehicle = 0;
+    while (vehicleSpan > 0 && !getVehicle(vehicleSpan - 1)->active) {
+        vehicleSpan--; // Vehicles at the end of the pool left last tick
+    }
+    for (int g = 0; g < numJunctions * LANE_GROUPS_PER_JUNCTION; g++) {
+        SpawnQueue pending;
+        Uint64 acquired = lockMutex(spawnLocks[g], LOCK_ADMIT_SPAWNS);
+        pending.count = spawnQueues[g].count;
+        memcpy(pending.ids, spawnQueues[g].ids, sizeof(pending.ids[0]) * pending.count);
+        spawnQueues[g].count = 0;
+        unlockMutex(spawnLocks[g], LOCK_ADMIT_SPAWNS, acquired);
+
+        for (int k = 0; k < pending.count; k++) {
+            admitVehicle(pending.ids[k], g / LANE_GROUPS_PER_JUNCTION, 'A' + (g % LANE_GROUPS_PER_JUNCTION) / 3, g % 3 + 1);
+        }
+    }
+}
+
+// Spawn on the first junction where this lane enters the network
+void spawnVehicle(const char* id, char lane, int sublane) {
+    Uint64 acquired = lockMutex(networkMutex, LOCK_SPAWN_ENTRY);
+    int junction = findEntryJunction(lane);
+    unlockMutex(networkMutex, LOCK_SPAWN_ENTRY, acquired);
+    spawnVehicleAt(id, junction, lane, sublane);
+}
+
+// The generators leave the outer sublanes of A, B (3) and C, D (1) empty
+bool canSpawnIn(char lane, int sublane) {
+    return !((lane == 'A' && sublane == 3) || (lane == 'B' && sublane == 3) || (lane == 'D' && sublane == 1) || (lane == 'C' && sublane == 1));
+}
+
+void* generateVehicles(void* arg) {
+    char lanes[] = {'A', 'B', 'C', 'D'};
+    traceThreadName("vehicle generator");
+
+    while (!isStopRequested()) {
+        Uint64 profileStart = profileBegin();
+        Uint64 acquired = lockMutex(networkMutex, LOCK_GENERATOR_NETWORK);
+        int count = numJunctions;
+        unlockMutex(networkMutex, LOCK_GENERATOR_NETWORK, acquired);
+
+        // Roughly one new vehicle per junction per second
+        for (int attempt = 0; attempt < count; attempt++) {
+            int junction = simRandom() % count;
+            int laneIndex = simRandom() % 4;
+            int sublane = (simRandom() % 3) + 1;
+            int idNumber = simRandom() % 1000;
+
+
+            // Prevent spawning in `A3` and `D1`
+            if (!canSpawnIn(lanes[laneIndex], sublane)) {
+                continue; // Skip this iteration
+            }
+
+            char vehicleID[9];
+            snprintf(vehicleID, 9, "V%03d", idNumber);
+
+            spawnVehicleAt(vehicleID, junction, lanes[laneIndex], sublane);
+        }
+        profileEnd(PROF_GENERATE, profileStart);
+        waitForStop(1000);
+    }
+    return NULL;
+}
+
+// Vehicles of every lane group stored contiguously, each group leader first and
+// preceded by a sentinel slot holding its leader across the junction boundary. The arrays
+// grow with the vehicle pool.
+typedef struct {
+    int* vehicle;
+    bool* onPath;     // Turning vehicles only act as leaders
+    float* progress;
+    float* speed;
+    float* invDesiredSpeed;
+    float* maxAccel;
+    float* brakeTerm; // 1 / (2 * sqrt(maxAccel * comfortDecel))
+    float* minGap;
+    float* timeHeadway;
+    float* reactionTime;
+    float* waitTime;
+    float* next;
+    float* nextSpeed;
+    float* nextWait;
+    float* accel;
+    int* handoff;     // Vehicles crossing into the next junction this tick
+} LaneStore;
+
+// One lane group inside the store: its sentinel sits at start - 1. The group's handoff
+// queue to the downstream junction reuses its own slots, so it can never overflow.
+typedef struct {
+    int start;
+    int count;
+    int handoffCount;
+    int waiting; // From here on vehicles wait at the path entry for conflict cells
+    int going;   // From here on vehicles stop at the stop line for the signal
+    int joinFirst, joinCount;   // Slots that joined the lane queue on the last tick
+    int leaveFirst, leaveCount; // Slots that left it over the stop line
+} LaneView;
+
+LaneStore laneStore;
+LaneView laneViews[MAX_LANE_GROUPS];
+static int* laneOrder;  // Store order of the previous tick
+static int laneOrderCount = 0;
+static Uint64* laneViewStamp;
+static Uint64 laneViewGeneration = 0; // Not simTick, which jumps back on checkpoint restore
+static int* laneGroupOf;     // Scratch for buildLaneViews()
+static int* laneCandidates;
+static int* turningVehicles; // Turning vehicles bucketed by junction, in vehicle index order
+static int turningStart[MAX_JUNCTIONS + 1];
+
+// Uniform grid of SPATIAL_CELL squares over world coordinates, hashed into a power-of-two
+// number of buckets and rebuilt by counting sort at the end of every tick. Bucket b holds
+// entries spatialStart[b] .. spatialStart[b + 1] - 1, with a copy of each vehicle's position
+// so queries stay in these arrays. Valid between ticks, on the simulation thread.
+static int* spatialStart;
+static int* spatialVehicle;
+static float* spatialX;
+static float* spatialY;
+static int* spatialBucketOf; // Scratch for buildSpatialHash()
+static int spatialBuckets = 0;
+static int spatialCount = 0;
+
+static int laneStoreCapacity = 0; // Vehicles the arrays above have room for
+
+// Grow the vehicle pool to at least capacity slots, a chunk at a time, along with every
+// array indexed by vehicle or by lane store slot. New slots start inactive. Runs on the
+// simulation thread between parallel runs, when no worker holds a pointer into them.
+bool reserveVehicles(int capacity) {
+    if (capacity > MAX_VEHICLE_CHUNKS * VEHICLE_CHUNK) return false;
+    capacity = (capacity + VEHICLE_CHUNK - 1) / VEHICLE_CHUNK * VEHICLE_CHUNK;
+    if (capacity <= vehicleCapacity) return true;
+
+    // The arrays move on growth and leave their old space in the arena, so they at least double
+    bool ok = true;
+    if (capacity > laneStoreCapacity) {
+        int grown = laneStoreCapacity * 2 > capacity ? laneStoreCapacity * 2 : capacity;
+        if (grown > MAX_VEHICLE_CHUNKS * VEHICLE_CHUNK) grown = MAX_VEHICLE_CHUNKS * VEHICLE_CHUNK;
+        int old = laneStoreCapacity;
+        int slots = grown + MAX_LANE_GROUPS;
+        int oldSlots = old > 0 ? old + MAX_LANE_GROUPS : 0;
+        ok = growRunArray((void**)&laneOrder, old, grown, sizeof(int)) &&
+             growRunArray((void**)&laneViewStamp, old, grown, sizeof(Uint64)) &&
+             growRunArray((void**)&laneGroupOf, old, grown, sizeof(int)) &&
+             growRunArray((void**)&laneCandidates, old, grown, sizeof(int)) &&
+             growRunArray((void**)&turningVehicles, old, grown, sizeof(int)) &&
+             growRunArray((void**)&laneStore.vehicle, oldSlots, slots, sizeof(int)) &&
+             growRunArray((void**)&laneStore.onPath, oldSlots, slots, sizeof(bool)) &&
+             growRunArray((void**)&laneStore.progress, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.speed, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.invDesiredSpeed, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.maxAccel, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.brakeTerm, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.minGap, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.timeHeadway, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.reactionTime, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.waitTime, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.next, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.nextSpeed, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.nextWait, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.accel, oldSlots, slots, sizeof(float)) &&
+             growRunArray((void**)&laneStore.handoff, oldSlots, slots, sizeof(int));
+        // About one bucket per vehicle; the index keeps its old bucket count until rebuilt
+        int buckets = spatialBuckets > 0 ? spatialBuckets : 1;
+        while (buckets < grown) buckets *= 2;
+        int oldBuckets = spatialBuckets > 0 ? spatialBuckets + 1 : 0;
+        ok = ok &&
+             growRunArray((void**)&spatialStart, oldBuckets, buckets + 1, sizeof(int)) &&
+             growRunArray((void**)&spatialVehicle, old, grown, sizeof(int)) &&
+             growRunArray((void**)&spatialX, old, grown, sizeof(float)) &&
+             growRunArray((void**)&spatialY, old, grown, sizeof(float)) &&
+             growRunArray((void**)&spatialBucketOf, old, grown, sizeof(int));
+        if (ok) {
+            memset(laneViewStamp + old, 0, sizeof(Uint64) * (grown - old));
+            laneStoreCapacity = grown;
+        }
+    }
+    for (int c = vehicleCapacity / VEHICLE_CHUNK; ok && c < capacity / VEHICLE_CHUNK; c++) {
+        vehicleChunks[c] = arenaAlloc(&runArena, sizeof(Vehicle) * VEHICLE_CHUNK);
+        ok = vehicleChunks[c] != NULL;
+        if (ok) {
+            memset(vehicleChunks[c], 0, sizeof(Vehicle) * VEHICLE_CHUNK); // Inactive
+            vehicleCapacity = (c + 1) * VEHICLE_CHUNK;
+        }
+    }
+    if (!ok) printf("Out of memory growing the vehicle pool past %d vehicles\n", vehicleCapacity);
+    return ok;
+}
+
+// Arena bytes a run with this many vehicles allocates: the pool, the arrays reserveVehicles()
+// sizes with it and a first ring for every lane queue. An underestimate costs one more block.
+size_t getRunBytes(int vehicles) {
+    size_t perVehicle = sizeof(Vehicle) + sizeof(Uint64) + 4 * sizeof(int) + // Pool and scratch arrays
+                        4 * sizeof(int) + 2 * sizeof(float);                 // Spatial hash, buckets included
+    size_t slot = 2 * sizeof(int) + sizeof(bool) + 13 * sizeof(float);     // One lane store slot
+    size_t queue = (QUEUE_INITIAL_CAPACITY * sizeof(int) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    return (size_t)vehicles * (perVehicle + slot) + (size_t)MAX_LANE_GROUPS * slot +
+           26 * ARENA_ALIGN + (size_t)2 * MAX_JUNCTIONS * NUM_LANES * queue;
+}
+
+// Start a run from an empty world: release the last run's vehicles, lane store and queues
+// in one go and reserve room for expectedVehicles
+bool resetRun(int expectedVehicles) {
+    if (expectedVehicles > vehicleLimit) expectedVehicles = vehicleLimit;
+    expectedVehicles = (expectedVehicles + VEHICLE_CHUNK - 1) / VEHICLE_CHUNK * VEHICLE_CHUNK;
+    bool ok = resetArena(&runArena, getRunBytes(expectedVehicles));
+
+    memset(vehicleChunks, 0, sizeof(vehicleChunks));
+    vehicleCapacity = 0;
+    vehicleSpan = 0;
+    nextFreeVehicle = 0;
+    memset(&laneStore, 0, sizeof(laneStore));
+    laneOrder = NULL;
+    laneOrderCount = 0;
+    laneViewStamp = NULL;
+    laneGroupOf = NULL;
+    laneCandidates = NULL;
+    turningVehicles = NULL;
+    laneStoreCapacity = 0;
+    spatialStart = NULL;
+    spatialVehicle = NULL;
+    spatialX = NULL;
+    spatialY = NULL;
+    spatialBucketOf = NULL;
+    spatialBuckets = 0;
+    spatialCount = 0;
+    for (int j = 0; j < MAX_JUNCTIONS; j++) {
+        for (int l = 0; l < NUM_LANES; l++) {
+            junctions[j].laneQueues[l] = (TrafficQueue){ .rear = -1 };
+            builtQueues[j][l] = (TrafficQueue){ .rear = -1 };
+        }
+    }
+    return reserveVehicles(expectedVehicles > 0 ? expectedVehicles : VEHICLE_CHUNK) && ok;
+}
+
+int getSpatialCell(float coordinate) {
+    return (int)floorf(coordinate / SPATIAL_CELL);
+}
 
-                break;
+int getSpatialBucket(int cx, int cy) {
+    return (int)(((Uint32)cx * 73856093u ^ (Uint32)cy * 19349663u) & (Uint32)(spatialBuckets - 1));
+}
 
-            case 'D': 
-                if (vehicles[i].sublane == 2 && !trafficLights[3].green && vehicles[i].y <= (WINDOW_HEIGHT / 2 + STOP_DISTANCE) && vehicles[i].y > (WINDOW_HEIGHT / 2) + 150) {
-                    continue; // Stop if light is red and vehicle is close enough
+// Index every active vehicle by the cell under its centre: count per bucket, turn the
+// counts into offsets, then place the vehicles in index order
+void buildSpatialHash() {
+    Uint64 start = tracing ? SDL_GetPerformanceCounter() : 0;
+    int buckets = 1;
+    while (buckets < laneStoreCapacity) buckets *= 2;
+    spatialBuckets = buckets;
+    memset(spatialStart, 0, sizeof(int) * (buckets + 1));
+    for (int i = 0; i < vehicleSpan; i++) {
+        const Vehicle* v = getVehicle(i);
+        spatialBucketOf[i] = v->active ? getSpatialBucket(getSpatialCell(v->x), getSpatialCell(v->y)) : -1;
+        if (v->active) spatialStart[spatialBucketOf[i] + 1]++;
+    }
+    for (int b = 0; b < buckets; b++) {
+        spatialStart[b + 1] += spatialStart[b];
+    }
+    for (int i = 0; i < vehicleSpan; i++) {
+        int b = spatialBucketOf[i];
+        if (b < 0) continue;
+        int k = spatialStart[b]++; // Leaves each start at the next bucket's, shifted back below
+        spatialVehicle[k] = i;
+        spatialX[k] = getVehicle(i)->x;
+        spatialY[k] = getVehicle(i)->y;
+    }
+    memmove(spatialStart + 1, spatialStart, sizeof(int) * buckets);
+    spatialStart[0] = 0;
+    spatialCount = spatialStart[buckets];
+    traceSpan("build spatial hash", "phase", start);
+}
+
+// Vehicles with their centre in the rectangle, up to max of them written to found; returns
+// how many were written. Cells sharing a bucket are told apart by the entries' own cells.
+int querySpatialRange(float x0, float y0, float x1, float y1, int* found, int max) {
+    int n = 0;
+    int cx0 = getSpatialCell(x0), cx1 = getSpatialCell(x1);
+    int cy0 = getSpatialCell(y0), cy1 = getSpatialCell(y1);
+    if ((Sint64)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) >= spatialBuckets) {
+        // Covers more cells than there are buckets: a single pass over the entries is cheaper
+        for (int k = 0; k < spatialCount && n < max; k++) {
+            if (spatialX[k] >= x0 && spatialX[k] <= x1 && spatialY[k] >= y0 && spatialY[k] <= y1) {
+                found[n++] = spatialVehicle[k];
+            }
+        }
+        return n;
+    }
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            int b = getSpatialBucket(cx, cy);
+            for (int k = spatialStart[b]; k < spatialStart[b + 1] && n < max; k++) {
+                if (spatialX[k] >= x0 && spatialX[k] <= x1 && spatialY[k] >= y0 && spatialY[k] <= y1 &&
+                    getSpatialCell(spatialX[k]) == cx && getSpatialCell(spatialY[k]) == cy) {
+                    found[n++] = spatialVehicle[k];
                 }
-                vehicles[i].y -= VEHICLE_SPEED; // Move up
-
-                if (vehicles[i].sublane == 2 && vehicles[i].y <= WINDOW_HEIGHT / 2 ) {
-                    if(vehicles[i].choice == 0){
-                        vehicles[i].x += -VEHICLE_SPEED; // Move smoothly left  
-                        if (vehicles[i].x >= WINDOW_WIDTH / 2 + 75 || vehicles[i].x <= WINDOW_WIDTH / 2 - 75) {
-                            vehicles[i].lane = 'D'; // Change the lane either D1 or A1
-                            vehicles[i].sublane =  1;
-                        }
-                    }
-                    else{
-                        vehicles[i].x +=  VEHICLE_SPEED; // Move smoothly left 
-                        if (vehicles[i].x >= WINDOW_WIDTH / 2 + 75) {
-                            vehicles[i].lane = 'A'; // Change the lane to either D1 or A1
-                            vehicles[i].sublane =  1;
-                        }
+            }
+        }
+    }
+    return n;
+}
+
+// Vehicles with their centre within radius of (x, y), as querySpatialRange()
+int querySpatialRadius(float x, float y, float radius, int* found, int max) {
+    int n = querySpatialRange(x - radius, y - radius, x + radius, y + radius, found, max);
+    int kept = 0;
+    for (int k = 0; k < n; k++) {
+        const Vehicle* v = getVehicle(found[k]);
+        float dx = v->x - x, dy = v->y - y;
+        if (dx * dx + dy * dy <= radius * radius) found[kept++] = found[k];
+    }
+    return kept;
+}
+
+// Vehicle whose centre is closest to (x, y) and no further than maxDistance, or -1. Rings
+// of cells are searched outward until none left can hold anything closer.
+int findNearestVehicle(float x, float y, float maxDistance) {
+    if (spatialCount == 0) return -1;
+    int cx = getSpatialCell(x), cy = getSpatialCell(y);
+    int best = -1;
+    float bestSq = maxDistance * maxDistance;
+    int reach = (int)fminf(maxDistance / SPATIAL_CELL + 1, (float)(worldMaxX - worldMinX + worldMaxY - worldMinY) / SPATIAL_CELL + 2);
+    for (int r = 0; r <= reach; r++) {
+        float ringDistance = (r - 1) * (float)SPATIAL_CELL; // No point of ring r is closer
+        if (r > 0 && ringDistance * ringDistance > bestSq) break;
+        for (int ry = cy - r; ry <= cy + r; ry++) {
+            bool edge = ry == cy - r || ry == cy + r;
+            for (int rx = cx - r; rx <= cx + r; rx += edge || r == 0 ? 1 : 2 * r) {
+                int b = getSpatialBucket(rx, ry);
+                for (int k = spatialStart[b]; k < spatialStart[b + 1]; k++) {
+                    float dx = spatialX[k] - x, dy = spatialY[k] - y;
+                    float distanceSq = dx * dx + dy * dy;
+                    if (distanceSq > bestSq || getSpatialCell(spatialX[k]) != rx || getSpatialCell(spatialY[k]) != ry) continue;
+                    if (distanceSq < bestSq || best < 0 || spatialVehicle[k] < best) {
+                        best = spatialVehicle[k];
+                        bestSq = distanceSq;
                     }
                 }
+            }
+        }
+    }
+    return best;
+}
 
-                // **D3 should turn left into B3 smoothly**
-                if (vehicles[i].sublane == 3 && vehicles[i].y <= WINDOW_HEIGHT / 2 + 75) {
-                    printf("Turning left: Vehicle %s from D3 to B3\n", vehicles[i].id);
-                    
-                    // Start moving left instead of continuing up
-                    vehicles[i].x -= VEHICLE_SPEED; 
-
-                    // If vehicle has reached the middle, switch lanes
-                    if (vehicles[i].x <= WINDOW_WIDTH / 2 - 75) {
-                        vehicles[i].lane = 'B';
-                        vehicles[i].sublane = 3;
-                        vehicles[i].direction = -1; // Move left in B3
-                    }
+#define LANE_FAR_AHEAD 1.0e9f
+#define STOPPED_SPEED 0.5f // px/s below which a vehicle counts as standing
+
+// Position of a junction centre on a lane's progress axis
+float getJunctionProgress(int junction, char lane) {
+    return getLaneProgress(lane, junctions[junction].cx, junctions[junction].cy);
+}
+
+// Stop line on the lane's progress axis, from the red-light zone used for sublane 2
+float getStopLineProgress(int junction, char lane) {
+    return getJunctionProgress(junction, lane) - 151;
+}
+
+// Progress past which a vehicle has left the world and its slot can be reused
+float getLaneEndProgress(char lane) {
+    switch (lane) {
+        case 'A': return worldMaxX + VEHICLE_LENGTH;
+        case 'B': return -worldMinX + VEHICLE_LENGTH;
+        case 'C': return worldMaxY + VEHICLE_LENGTH;
+        case 'D': return -worldMinY + VEHICLE_LENGTH;
+    }
+    return LANE_FAR_AHEAD;
+}
+
+// Progress by which vehicles have joined a junction's approach: the network edge where they
+// spawn, or past the junction before, where turn paths end no further from the centre than
+// the stop line is on the way in
+float getApproachStartProgress(int junction, char lane) {
+    int upstream = junctions[junction].neighbour[getOppositeLane(lane - 'A')];
+    if (upstream >= 0) return 2 * getJunctionProgress(upstream, lane) - getStopLineProgress(upstream, lane);
+    float x, y;
+    getLanePosition(junction, lane, 2, &x, &y);
+    return getLaneProgress(lane, x, y);
+}
+
+// Where a controlled lane group's queue starts: a vehicle joins it when its front reaches
+// the first loop of the approach, an advance loop if there is one. LANE_FAR_AHEAD without loops.
+float laneQueueEntry[MAX_LANE_GROUPS];
+
+// Lay out the loops: those from the network file, or on a junction without any a stop-bar
+// loop and an advance loop on every controlled approach. Loops are pulled back inside their
+// approach so that every vehicle drives onto them after joining it.
+void buildDetectors() {
+    bool configured[MAX_JUNCTIONS] = { false };
+    for (int n = 0; n < numDetectorSpecs; n++) {
+        configured[detectorSpecs[n].group / LANE_GROUPS_PER_JUNCTION] = true;
+    }
+
+    numDetectors = 0;
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    for (int g = 0; g < numGroups; g++) {
+        int j = g / LANE_GROUPS_PER_JUNCTION;
+        char lane = 'A' + (g % LANE_GROUPS_PER_JUNCTION) / 3;
+        detectorStart[g] = numDetectors;
+        if (configured[j]) {
+            for (int n = 0; n < numDetectorSpecs; n++) {
+                if (detectorSpecs[n].group == g) detectors[numDetectors++] = detectorSpecs[n];
+            }
+        } else if (g % 3 == 1) {
+            detectors[numDetectors++] = (Detector){ .group = g, .type = DETECTOR_PRESENCE, .setback = 0, .length = STOP_BAR_LENGTH };
+            detectors[numDetectors++] = (Detector){ .group = g, .type = DETECTOR_COUNT, .setback = ADVANCE_LOOP_SETBACK,
+                                                    .length = ADVANCE_LOOP_LENGTH };
+        }
+
+        float stopLine = getStopLineProgress(j, lane);
+        float reach = stopLine - getApproachStartProgress(j, lane) - VEHICLE_LENGTH / 2 - 1; // Fronts as they join
+        float presenceEntry = LANE_FAR_AHEAD, countEntry = LANE_FAR_AHEAD;
+        for (int d = detectorStart[g]; d < numDetectors; d++) {
+            Detector* detector = &detectors[d];
+            detector->setback = fmaxf(fminf(detector->setback, reach - detector->length), 0);
+            detector->length = fmaxf(fminf(detector->length, reach - detector->setback), 1);
+            float start = stopLine - detector->setback - detector->length;
+            if (detector->type == DETECTOR_COUNT) countEntry = fminf(countEntry, start);
+            else presenceEntry = fminf(presenceEntry, start);
+        }
+        laneQueueEntry[g] = g % 3 != 1 ? LANE_FAR_AHEAD : countEntry < LANE_FAR_AHEAD ? countEntry : presenceEntry;
+    }
+    detectorStart[numGroups] = numDetectors;
+}
+
+// The lane group a vehicle counts towards: its own lane, or the one it is turning out of
+int getVehicleLaneGroup(int i) {
+    Vehicle* v = getVehicle(i);
+    char lane = v->lane;
+    int sublane = v->sublane;
+    if (v->pathId >= 0) {
+        lane = turnPaths[v->pathId].fromLane;
+        sublane = turnPaths[v->pathId].fromSublane;
+    }
+    if (lane < 'A' || lane > 'D' || sublane < 1 || sublane > 3) return -1;
+    return getLaneGroup(v->junction, lane - 'A', sublane - 1);
+}
+
+// Copy a vehicle's kinematic state and parameters into a store slot
+void loadLaneSlot(int k, char lane, int i) {
+    Vehicle* v = getVehicle(i);
+    laneStore.vehicle[k] = i;
+    laneStore.onPath[k] = v->pathId >= 0;
+    laneStore.progress[k] = getLaneProgress(lane, v->x, v->y);
+    laneStore.speed[k] = v->speed;
+    laneStore.invDesiredSpeed[k] = 1.0f / v->desiredSpeed;
+    laneStore.maxAccel[k] = v->maxAccel;
+    laneStore.brakeTerm[k] = 0.5f / sqrtf(v->maxAccel * v->comfortDecel);
+    laneStore.minGap[k] = v->minGap;
+    laneStore.timeHeadway[k] = v->timeHeadway;
+    laneStore.reactionTime[k] = v->reactionTime;
+    laneStore.waitTime[k] = v->waitTime;
+}
+
+// Refresh the lane store. Vehicles are bucketed by lane group with a stable counting
+// sort over last tick's order, so the insertion sort inside each group only has to
+// place newcomers (spawns, vehicles leaving a turn or arriving from the previous junction).
+void buildLaneViews() {
+    int* groupOf = laneGroupOf;
+    int* candidates = laneCandidates;
+    int groupCount[MAX_LANE_GROUPS];
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    Uint64 stamp = ++laneViewGeneration;
+    int numCandidates = 0;
+
+    for (int k = 0; k < laneOrderCount; k++) {
+        int i = laneOrder[k];
+        if (!getVehicle(i)->active || laneViewStamp[i] == stamp) continue;
+        laneViewStamp[i] = stamp;
+        candidates[numCandidates++] = i;
+    }
+    for (int i = 0; i < vehicleSpan; i++) {
+        if (!getVehicle(i)->active || laneViewStamp[i] == stamp) continue;
+        laneViewStamp[i] = stamp;
+        candidates[numCandidates++] = i;
+    }
+
+    memset(groupCount, 0, sizeof(int) * numGroups);
+    for (int k = 0; k < numCandidates; k++) {
+        int i = candidates[k];
+        groupOf[i] = getVehicleLaneGroup(i);
+        if (groupOf[i] >= 0) groupCount[groupOf[i]]++;
+    }
+
+    int start = 1;
+    for (int g = 0; g < numGroups; g++) {
+        laneViews[g].start = start;
+        laneViews[g].count = 0;
+        laneViews[g].handoffCount = 0;
+        start += groupCount[g] + 1; // One sentinel slot before every group
+    }
+
+    laneOrderCount = 0;
+    for (int k = 0; k < numCandidates; k++) {
+        int i = candidates[k];
+        if (groupOf[i] < 0) continue;
+        LaneView* view = &laneViews[groupOf[i]];
+        laneStore.vehicle[view->start + view->count++] = i;
+    }
+
+    for (int g = 0; g < numGroups; g++) {
+        LaneView* view = &laneViews[g];
+        char lane = 'A' + (g % LANE_GROUPS_PER_JUNCTION) / 3;
+        int* slots = laneStore.vehicle + view->start;
+        float* progress = laneStore.progress + view->start;
+
+        // Insertion sort of vehicle indices by progress, furthest ahead first
+        for (int k = 0; k < view->count; k++) {
+            int i = slots[k];
+            Vehicle* v = getVehicle(i);
+            float p = getLaneProgress(lane, v->x, v->y);
+            int m = k - 1;
+            while (m >= 0 && progress[m] < p) {
+                progress[m + 1] = progress[m];
+                slots[m + 1] = slots[m];
+                m--;
+            }
+            progress[m + 1] = p;
+            slots[m + 1] = i;
+        }
+        for (int k = 0; k < view->count; k++) {
+            loadLaneSlot(view->start + k, lane, slots[k]);
+            laneOrder[laneOrderCount++] = slots[k];
+        }
+    }
+
+    // Each sentinel is the last vehicle of the same lane at the next junction, or far
+    // ahead and standing at the edge of the network
+    for (int g = 0; g < numGroups; g++) {
+        LaneView* view = &laneViews[g];
+        int junction = g / LANE_GROUPS_PER_JUNCTION;
+        int laneIndex = (g % LANE_GROUPS_PER_JUNCTION) / 3;
+        int next = junctions[junction].neighbour[laneIndex];
+        int sentinel = view->start - 1;
+        laneStore.progress[sentinel] = LANE_FAR_AHEAD;
+        laneStore.speed[sentinel] = 0;
+        if (next >= 0) {
+            LaneView* ahead = &laneViews[getLaneGroup(next, laneIndex, g % 3)];
+            if (ahead->count > 0) {
+                int last = ahead->start + ahead->count - 1;
+                laneStore.progress[sentinel] = laneStore.progress[last];
+                laneStore.speed[sentinel] = laneStore.speed[last];
+            }
+        }
+    }
+}
+
+// Intelligent Driver Model acceleration for one vehicle, gap measured bumper to bumper
+float idmAcceleration(float speed, float invDesiredSpeed, float maxAccel, float brakeTerm,
+                      float minGap, float timeHeadway, float gap, float approachRate) {
+    float ratio = speed * invDesiredSpeed;
+    float ratio2 = ratio * ratio;
+    float desiredGap = minGap + fmaxf(0, speed * timeHeadway + speed * approachRate * brakeTerm);
+    float gapRatio = desiredGap / fmaxf(gap, 0.01f);
+    return maxAccel * (1 - ratio2 * ratio2 - gapRatio * gapRatio);
+}
+
+// Advance every vehicle in a lane by one IDM step of dt seconds. The leader and, while
+// before it, the stop line are obstacles; positions are also clamped so vehicles never
+// overlap their leader, pass a red stop line or move backwards. A standing vehicle
+// waits its reaction time before pulling away.
+void advanceLaneKernel(const LaneView* view, float dt, float stopLine) {
+    // Shift the store so the group's vehicles are 1..count and its sentinel is 0
+    LaneStore* store = &laneStore;
+    int base = view->start - 1;
+    const float* progress = store->progress + base;
+    const float* speed = store->speed + base;
+    int count = view->count;
+    float length = VEHICLE_LENGTH;
+    int k = 1;
+#if defined(__AVX2__)
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256 vOne = _mm256_set1_ps(1.0f);
+    const __m256 vHalf = _mm256_set1_ps(0.5f);
+    const __m256 vTiny = _mm256_set1_ps(0.01f);
+    const __m256 vDt = _mm256_set1_ps(dt);
+    const __m256 vLength = _mm256_set1_ps(length);
+    const __m256 vStop = _mm256_set1_ps(stopLine);
+    const __m256 vFar = _mm256_set1_ps(LANE_FAR_AHEAD);
+    const __m256 vStopped = _mm256_set1_ps(STOPPED_SPEED);
+    for (; k + 8 <= count + 1; k += 8) {
+        __m256 p = _mm256_loadu_ps(progress + k);
+        __m256 v = _mm256_loadu_ps(speed + k);
+        __m256 leaderP = _mm256_loadu_ps(progress + k - 1);
+        __m256 leaderV = _mm256_loadu_ps(speed + k - 1);
+        __m256 invV0 = _mm256_loadu_ps(store->invDesiredSpeed + base + k);
+        __m256 a = _mm256_loadu_ps(store->maxAccel + base + k);
+        __m256 brake = _mm256_loadu_ps(store->brakeTerm + base + k);
+        __m256 s0 = _mm256_loadu_ps(store->minGap + base + k);
+        __m256 T = _mm256_loadu_ps(store->timeHeadway + base + k);
+        __m256 reaction = _mm256_loadu_ps(store->reactionTime + base + k);
+        __m256 wait = _mm256_loadu_ps(store->waitTime + base + k);
+
+        // Free-road term and the two interaction terms (leader, stop line)
+        __m256 ratio = _mm256_mul_ps(v, invV0);
+        ratio = _mm256_mul_ps(ratio, ratio);
+        __m256 freeTerm = _mm256_mul_ps(ratio, ratio);
+        __m256 beforeStop = _mm256_cmp_ps(p, vStop, _CMP_LE_OQ);
+        __m256 leaderGap = _mm256_max_ps(_mm256_sub_ps(_mm256_sub_ps(leaderP, p), vLength), vTiny);
+        __m256 stopGap = _mm256_blendv_ps(vFar, _mm256_max_ps(_mm256_sub_ps(vStop, p), vTiny), beforeStop);
+        __m256 baseGap = _mm256_add_ps(s0, _mm256_mul_ps(v, T));
+        __m256 leaderWant = _mm256_add_ps(baseGap, _mm256_mul_ps(_mm256_mul_ps(v, _mm256_sub_ps(v, leaderV)), brake));
+        __m256 stopWant = _mm256_add_ps(baseGap, _mm256_mul_ps(_mm256_mul_ps(v, v), brake));
+        leaderWant = _mm256_max_ps(leaderWant, s0);
+        __m256 leaderRatio = _mm256_div_ps(leaderWant, leaderGap);
+        __m256 stopRatio = _mm256_div_ps(stopWant, stopGap);
+        __m256 interaction = _mm256_max_ps(_mm256_mul_ps(leaderRatio, leaderRatio), _mm256_mul_ps(stopRatio, stopRatio));
+        __m256 acc = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_sub_ps(vOne, freeTerm), interaction));
+
+        // Reaction delay: a standing vehicle holds until it has waited long enough
+        __m256 standing = _mm256_and_ps(_mm256_cmp_ps(v, vStopped, _CMP_LT_OQ), _mm256_cmp_ps(acc, vZero, _CMP_GT_OQ));
+        __m256 holding = _mm256_and_ps(standing, _mm256_cmp_ps(wait, reaction, _CMP_LT_OQ));
+        acc = _mm256_blendv_ps(acc, vZero, holding);
+        __m256 nextWait = _mm256_and_ps(standing, _mm256_add_ps(wait, vDt));
+
+        // Integrate and clamp behind the leader, at the stop line, and never backwards
+        __m256 nextV = _mm256_max_ps(_mm256_add_ps(v, _mm256_mul_ps(acc, vDt)), vZero);
+        __m256 free = _mm256_add_ps(p, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(v, nextV), vHalf), vDt));
+        __m256 limit = _mm256_min_ps(free, _mm256_sub_ps(leaderP, vLength));
+        limit = _mm256_min_ps(limit, _mm256_blendv_ps(vFar, vStop, beforeStop));
+        __m256 next = _mm256_max_ps(limit, p);
+        __m256 clamped = _mm256_cmp_ps(next, free, _CMP_LT_OQ);
+        nextV = _mm256_blendv_ps(nextV, _mm256_min_ps(nextV, _mm256_div_ps(_mm256_sub_ps(next, p), vDt)), clamped);
+
+        _mm256_storeu_ps(store->next + base + k, next);
+        _mm256_storeu_ps(store->nextSpeed + base + k, nextV);
+        _mm256_storeu_ps(store->nextWait + base + k, nextWait);
+        _mm256_storeu_ps(store->accel + base + k, acc);
+    }
+#elif defined(__SSE2__)
+    const __m128 vZero = _mm_setzero_ps();
+    const __m128 vOne = _mm_set1_ps(1.0f);
+    const __m128 vHalf = _mm_set1_ps(0.5f);
+    const __m128 vTiny = _mm_set1_ps(0.01f);
+    const __m128 vDt = _mm_set1_ps(dt);
+    const __m128 vLength = _mm_set1_ps(length);
+    const __m128 vStop = _mm_set1_ps(stopLine);
+    const __m128 vFar = _mm_set1_ps(LANE_FAR_AHEAD);
+    const __m128 vStopped = _mm_set1_ps(STOPPED_SPEED);
+    for (; k + 4 <= count + 1; k += 4) {
+        __m128 p = _mm_loadu_ps(progress + k);
+        __m128 v = _mm_loadu_ps(speed + k);
+        __m128 leaderP = _mm_loadu_ps(progress + k - 1);
+        __m128 leaderV = _mm_loadu_ps(speed + k - 1);
+        __m128 invV0 = _mm_loadu_ps(store->invDesiredSpeed + base + k);
+        __m128 a = _mm_loadu_ps(store->maxAccel + base + k);
+        __m128 brake = _mm_loadu_ps(store->brakeTerm + base + k);
+        __m128 s0 = _mm_loadu_ps(store->minGap + base + k);
+        __m128 T = _mm_loadu_ps(store->timeHeadway + base + k);
+        __m128 reaction = _mm_loadu_ps(store->reactionTime + base + k);
+        __m128 wait = _mm_loadu_ps(store->waitTime + base + k);
+
+        // Free-road term and the two interaction terms (leader, stop line)
+        __m128 ratio = _mm_mul_ps(v, invV0);
+        ratio = _mm_mul_ps(ratio, ratio);
+        __m128 freeTerm = _mm_mul_ps(ratio, ratio);
+        __m128 beforeStop = _mm_cmple_ps(p, vStop);
+        __m128 leaderGap = _mm_max_ps(_mm_sub_ps(_mm_sub_ps(leaderP, p), vLength), vTiny);
+        __m128 stopGap = _mm_or_ps(_mm_and_ps(beforeStop, _mm_max_ps(_mm_sub_ps(vStop, p), vTiny)), _mm_andnot_ps(beforeStop, vFar));
+        __m128 baseGap = _mm_add_ps(s0, _mm_mul_ps(v, T));
+        __m128 leaderWant = _mm_add_ps(baseGap, _mm_mul_ps(_mm_mul_ps(v, _mm_sub_ps(v, leaderV)), brake));
+        __m128 stopWant = _mm_add_ps(baseGap, _mm_mul_ps(_mm_mul_ps(v, v), brake));
+        leaderWant = _mm_max_ps(leaderWant, s0);
+        __m128 leaderRatio = _mm_div_ps(leaderWant, leaderGap);
+        __m128 stopRatio = _mm_div_ps(stopWant, stopGap);
+        __m128 interaction = _mm_max_ps(_mm_mul_ps(leaderRatio, leaderRatio), _mm_mul_ps(stopRatio, stopRatio));
+        __m128 acc = _mm_mul_ps(a, _mm_sub_ps(_mm_sub_ps(vOne, freeTerm), interaction));
+
+        // Reaction delay: a standing vehicle holds until it has waited long enough
+        __m128 standing = _mm_and_ps(_mm_cmplt_ps(v, vStopped), _mm_cmpgt_ps(acc, vZero));
+        __m128 holding = _mm_and_ps(standing, _mm_cmplt_ps(wait, reaction));
+        acc = _mm_andnot_ps(holding, acc);
+        __m128 nextWait = _mm_and_ps(standing, _mm_add_ps(wait, vDt));
+
+        // Integrate and clamp behind the leader, at the stop line, and never backwards
+        __m128 nextV = _mm_max_ps(_mm_add_ps(v, _mm_mul_ps(acc, vDt)), vZero);
+        __m128 free = _mm_add_ps(p, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(v, nextV), vHalf), vDt));
+        __m128 limit = _mm_min_ps(free, _mm_sub_ps(leaderP, vLength));
+        __m128 stopLimit = _mm_or_ps(_mm_and_ps(beforeStop, vStop), _mm_andnot_ps(beforeStop, vFar));
+        limit = _mm_min_ps(limit, stopLimit);
+        __m128 next = _mm_max_ps(limit, p);
+        __m128 clamped = _mm_cmplt_ps(next, free);
+        __m128 clampedV = _mm_min_ps(nextV, _mm_div_ps(_mm_sub_ps(next, p), vDt));
+        nextV = _mm_or_ps(_mm_and_ps(clamped, clampedV), _mm_andnot_ps(clamped, nextV));
+
+        _mm_storeu_ps(store->next + base + k, next);
+        _mm_storeu_ps(store->nextSpeed + base + k, nextV);
+        _mm_storeu_ps(store->nextWait + base + k, nextWait);
+        _mm_storeu_ps(store->accel + base + k, acc);
+    }
+#endif
+    // Scalar fallback and remainder
+    for (; k <= count; k++) {
+        float p = progress[k];
+        float v = speed[k];
+        bool beforeStop = p <= stopLine;
+        float acc = idmAcceleration(v, store->invDesiredSpeed[base + k], store->maxAccel[base + k], store->brakeTerm[base + k],
+                                    store->minGap[base + k], store->timeHeadway[base + k],
+                                    progress[k - 1] - p - length, v - speed[k - 1]);
+        if (beforeStop) {
+            float stopAcc = idmAcceleration(v, store->invDesiredSpeed[base + k], store->maxAccel[base + k], store->brakeTerm[base + k],
+                                            store->minGap[base + k], store->timeHeadway[base + k], stopLine - p, v);
+            acc = fminf(acc, stopAcc);
+        }
+
+        bool standing = v < STOPPED_SPEED && acc > 0;
+        if (standing && store->waitTime[base + k] < store->reactionTime[base + k]) acc = 0;
+        store->nextWait[base + k] = standing ? store->waitTime[base + k] + dt : 0;
+
+        float nextV = fmaxf(v + acc * dt, 0);
+        float free = p + (v + nextV) * 0.5f * dt;
+        float limit = fminf(free, progress[k - 1] - length);
+        if (beforeStop) limit = fminf(limit, stopLine);
+        float next = fmaxf(limit, p);
+        if (next < free) nextV = fminf(nextV, (next - p) / dt);
+
+        store->next[base + k] = next;
+        store->nextSpeed[base + k] = nextV;
+        store->accel[base + k] = acc;
+    }
+}
+
+// Advance a vehicle along its turn path by its own speed, handing it to the exit lane at the end.
+// Leaders are looked up among the other turning vehicles of the same junction.
+void advanceOnPath(int i, float dt, const int* turning, int numTurning) {
+    Vehicle* v = getVehicle(i);
+    const TurnPath* path = &turnPaths[v->pathId];
+    const Junction* junction = &junctions[v->junction];
+
+    // Follow the closest vehicle ahead on the same path of the same junction, if any
+    float gap = LANE_FAR_AHEAD;
+    float leaderSpeed = 0;
+    for (int n = 0; n < numTurning; n++) {
+        const Vehicle* other = getVehicle(turning[n]);
+        if (other != v && other->pathId == v->pathId &&
+            other->pathDistance > v->pathDistance &&
+            other->pathDistance - v->pathDistance - VEHICLE_LENGTH < gap) {
+            gap = other->pathDistance - v->pathDistance - VEHICLE_LENGTH;
+            leaderSpeed = other->speed;
+        }
+    }
+
+    float acc = idmAcceleration(v->speed, 1.0f / v->desiredSpeed, v->maxAccel,
+                                0.5f / sqrtf(v->maxAccel * v->comfortDecel),
+                                v->minGap, v->timeHeadway, gap, v->speed - leaderSpeed);
+    float nextSpeed = fmaxf(v->speed + acc * dt, 0);
+    float step = (v->speed + nextSpeed) * 0.5f * dt;
+    if (gap < LANE_FAR_AHEAD) step = fminf(step, fmaxf(gap, 0));
+    v->accel = acc;
+    v->speed = nextSpeed;
+    v->pathDistance += step;
+
+    v->pathIndex = (int)(v->pathDistance / VEHICLE_SPEED);
+    if (v->pathIndex >= path->length) {
+        // Left the junction: continue on the exit lane from the last sample
+        v->x = junction->cx + path->points[path->length - 1].x;
+        v->y = junction->cy + path->points[path->length - 1].y;
+        v->lane = path->toLane;
+        v->sublane = path->toSublane;
+        v->direction = getDirection(path->toLane);
+        v->pathId = -1;
+        v->pathIndex = 0;
+        v->pathDistance = 0;
+        return;
+    }
+    v->x = junction->cx + path->points[v->pathIndex].x;
+    v->y = junction->cy + path->points[v->pathIndex].y;
+}
+
+// Worker pool for the parallel parts of a tick. Each worker owns a contiguous block of
+// tasks and takes them from the back; once its block is done it steals from the front
+// of the others'. Tasks are only dealt out before a run starts, so a block is a packed
+// [head, tail) pair updated with a single compare-and-swap.
+typedef struct {
+    _Atomic Uint64 range; // head in the high word, tail in the low word
+    pthread_t thread;
+} Worker;
+
+Worker workers[MAX_WORKERS];
+int numWorkers = 1; // Including the thread calling runParallel()
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static void (*poolTask)(int task);
+static const char* poolTaskName;
+static Uint64 poolGeneration = 0;
+static int poolPending = 0;
+static bool poolStopping = false;
+
+// Take a task from a worker's block, from the back as its owner or the front as a thief
+int takeTask(Worker* worker, bool steal) {
+    Uint64 range = atomic_load(&worker->range);
+    for (;;) {
+        Uint32 head = (Uint32)(range >> 32);
+        Uint32 tail = (Uint32)range;
+        if (head >= tail) return -1;
+        Uint64 rest = steal ? ((Uint64)(head + 1) << 32) | tail : ((Uint64)head << 32) | (tail - 1);
+        if (atomic_compare_exchange_weak(&worker->range, &range, rest)) {
+            return steal ? (int)head : (int)(tail - 1);
+        }
+    }
+}
+
+void drainTasks(int self) {
+    int task;
+    while ((task = takeTask(&workers[self], false)) >= 0) {
+        poolTask(task);
+    }
+    for (int k = 1; k < numWorkers; k++) {
+        Worker* victim = &workers[(self + k) % numWorkers];
+        while ((task = takeTask(victim, true)) >= 0) {
+            poolTask(task);
+        }
+    }
+}
+
+void* workerMain(void* arg) {
+    int self = (int)(intptr_t)arg;
+    Uint64 seen = 0;
+    char name[24];
+    snprintf(name, sizeof(name), "step worker %d", self);
+    traceThreadName(name);
+    for (;;) {
+        pthread_mutex_lock(&poolMutex);
+        while (poolGeneration == seen && !poolStopping) {
+            pthread_cond_wait(&poolWake, &poolMutex);
+        }
+        if (poolStopping) {
+            pthread_mutex_unlock(&poolMutex);
+            break;
+        }
+        seen = poolGeneration;
+        pthread_mutex_unlock(&poolMutex);
+
+        Uint64 start = tracing ? SDL_GetPerformanceCounter() : 0;
+        drainTasks(self);
+        traceSpan(poolTaskName, "phase", start);
+
+        pthread_mutex_lock(&poolMutex);
+        if (--poolPending == 0) {
+            pthread_cond_signal(&poolDone);
+        }
+        pthread_mutex_unlock(&poolMutex);
+    }
+    return NULL;
+}
+
+// Start count - 1 helper threads; 0 uses one per CPU
+void initWorkerPool(int count) {
+    if (count <= 0) count = SDL_GetCPUCount();
+    if (count > MAX_WORKERS) count = MAX_WORKERS;
+    numWorkers = 1;
+    while (numWorkers < count) {
+        if (pthread_create(&workers[numWorkers].thread, NULL, workerMain, (void*)(intptr_t)numWorkers) != 0) {
+            SDL_Log("Failed to create worker thread %d", numWorkers);
+            break;
+        }
+        numWorkers++;
+    }
+    if (logEvents) printf("Stepping with %d worker thread%s\n", numWorkers, numWorkers == 1 ? "" : "s");
+}
+
+// Wake the idle helpers to exit and join them; called between ticks, never during runParallel()
+void shutdownWorkerPool() {
+    pthread_mutex_lock(&poolMutex);
+    poolStopping = true;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolMutex);
+
+    for (int w = 1; w < numWorkers; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    numWorkers = 1;
+    poolStopping = false;
+    poolGeneration = 0; // New helpers start waiting for generation 1
+}
+
+// Run task(0 .. numTasks - 1) across the pool and wait for all of them; name labels the
+// trace span of each thread taking part
+void runParallel(const char* name, void (*task)(int), int numTasks) {
+    Uint64 start = tracing ? SDL_GetPerformanceCounter() : 0;
+    if (numWorkers <= 1 || numTasks <= 1) {
+        for (int t = 0; t < numTasks; t++) {
+            task(t);
+        }
+        traceSpan(name, "phase", start);
+        return;
+    }
+
+    // Contiguous blocks keep neighbouring regions on the same worker
+    for (int w = 0; w < numWorkers; w++) {
+        Uint32 head = (Uint32)((Uint64)numTasks * w / numWorkers);
+        Uint32 tail = (Uint32)((Uint64)numTasks * (w + 1) / numWorkers);
+        atomic_store(&workers[w].range, ((Uint64)head << 32) | tail);
+    }
+
+    pthread_mutex_lock(&poolMutex);
+    poolTask = task;
+    poolTaskName = name;
+    poolPending = numWorkers - 1;
+    poolGeneration++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolMutex);
+
+    drainTasks(0);
+    traceSpan(name, "phase", start);
+
+    pthread_mutex_lock(&poolMutex);
+    while (poolPending > 0) {
+        pthread_cond_wait(&poolDone, &poolMutex);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
+
+// Region task: move the turning vehicles of one junction along their paths
+void stepJunctionPaths(int j) {
+    const float dt = TICK_MS / 1000.0f;
+    const int* turning = turningVehicles + turningStart[j];
+    int numTurning = turningStart[j + 1] - turningStart[j];
+    for (int n = 0; n < numTurning; n++) {
+        advanceOnPath(turning[n], dt, turning, numTurning);
+    }
+}
+
+// Number of vehicles at the front of a lane group expected to pass the stop line within the
+// remaining yellow. Each vehicle needs its own time to accelerate over the distance, and
+// no less than its leader plus a time headway; a vehicle that cannot make it but is far
+// enough back to stop within SIGNAL_STOP_DECEL ends the count.
+int getVehiclesClearingYellow(const LaneView* view, float stopLine, float remaining) {
+    float leaderTime = -LANE_FAR_AHEAD;
+    for (int k = 0; k < view->count; k++) {
+        int slot = view->start + k;
+        float distance = stopLine - laneStore.progress[slot];
+        if (distance <= 0) continue; // Already past the line
+        const Vehicle* v = getVehicle(laneStore.vehicle[slot]);
+        float speed = laneStore.speed[slot];
+
+        float time = (sqrtf(speed * speed + 2 * v->maxAccel * distance) - speed) / v->maxAccel;
+        if (speed < STOPPED_SPEED) time += fmaxf(v->reactionTime - laneStore.waitTime[slot], 0);
+        time = fmaxf(time, leaderTime + v->timeHeadway);
+        leaderTime = time;
+
+        bool canStop = distance >= speed * speed / (2 * SIGNAL_STOP_DECEL);
+        if (time > remaining && canStop) return k;
+    }
+    return view->count;
+}
+
+// First slot of a lane group whose progress after the step is below the given one. The
+// group stays sorted furthest ahead first, as vehicles never pass their leader.
+int findLaneSlotBehind(const LaneView* view, float progress) {
+    int low = view->start, high = view->start + view->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (laneStore.next[mid] < progress) high = mid;
+        else low = mid + 1;
+    }
+    return low;
+}
+
+// Move a lane group's loops on by one tick, from each vehicle's progress before and after
+// its step: who is over each loop and who drove onto it, and who joined the lane queue or
+// left it over the stop line. Both crossings are a contiguous run of slots. Only vehicles
+// at a loop or crossing are visited, found by binary search.
+void updateLaneDetectors(int g, float stopLine) {
+    LaneView* view = &laneViews[g];
+    const float half = VEHICLE_LENGTH / 2.0f;
+    int end = view->start + view->count;
+    for (int d = detectorStart[g]; d < detectorStart[g + 1]; d++) {
+        Detector* detector = &detectors[d];
+        float far = stopLine - detector->setback;
+        float near = far - detector->length;
+        bool wasOccupied = detector->occupants > 0;
+        detector->occupants = 0;
+        for (int k = findLaneSlotBehind(view, far + half); k < end && laneStore.next[k] + half >= near; k++) {
+            if (laneStore.onPath[k]) continue;
+            detector->occupants++;
+            detector->count += laneStore.progress[k] + half < near;
+        }
+        detector->changed = (detector->occupants > 0) != wasOccupied;
+        detector->onTicks += detector->occupants > 0;
+    }
+
+    view->joinCount = 0;
+    view->leaveCount = 0;
+    if (laneQueueEntry[g] >= LANE_FAR_AHEAD) return;
+    int behind = findLaneSlotBehind(view, laneQueueEntry[g] - half);
+    view->joinFirst = behind;
+    while (view->joinFirst > view->start && laneStore.progress[view->joinFirst - 1] + half < laneQueueEntry[g]) view->joinFirst--;
+    view->joinCount = behind - view->joinFirst;
+    behind = findLaneSlotBehind(view, stopLine);
+    view->leaveFirst = behind;
+    while (view->leaveFirst > view->start && laneStore.progress[view->leaveFirst - 1] < stopLine) view->leaveFirst--;
+    view->leaveCount = behind - view->leaveFirst;
+}
+
+// Lane progress at which a vehicle joins a path at the given junction
+float getPathEntryProgress(int junction, int path) {
+    const PathPoint* entry = &turnPaths[path].points[0];
+    return getLaneProgress(turnPaths[path].fromLane, junctions[junction].cx + entry->x, junctions[junction].cy + entry->y);
+}
+
+// Decide how far the vehicles of junction j's lane groups may go this tick. Only sublane 2
+// is controlled by the traffic light. As it turns yellow, the first vehicle that would not
+// reach the stop line before the red but can still stop comfortably stops, and everyone
+// behind it with it; the rest carry on through the yellow.
+//
+// Crossing the junction box takes a reservation. The first vehicle of a lane group short
+// of its path entry asks for every conflict cell of its path once it is about to need to
+// brake for the entry, and gets them when no vehicle on another path holds any; vehicles on
+// the same path follow each other instead. It holds them until it enters the path, where
+// they go with its place on the path and free up behind it. A vehicle that is refused stops
+// at the entry, as does everyone behind it. Requests are granted oldest first, and a newer
+// one yields to the cells of an older one that was refused, so a steady stream on one path
+// cannot keep a crossing path waiting.
+void reserveConflictCells(int j) {
+    const float dt = TICK_MS / 1000.0f;
+    Junction* junction = &junctions[j];
+    Uint64 held[NUM_TURN_PATHS] = {0};
+    const int* turning = turningVehicles + turningStart[j];
+    int numTurning = turningStart[j + 1] - turningStart[j];
+    for (int n = 0; n < numTurning; n++) {
+        const Vehicle* v = getVehicle(turning[n]);
+        if (v->pathId >= 0) held[v->pathId] |= turnPaths[v->pathId].cells[v->pathIndex];
+    }
+
+    SignalPhase phase;
+    readSignalPhase(junction, &phase);
+    int candidate[LANE_GROUPS_PER_JUNCTION];
+    for (int s = 0; s < LANE_GROUPS_PER_JUNCTION; s++) {
+        LaneView* view = &laneViews[j * LANE_GROUPS_PER_JUNCTION + s];
+        char lane = 'A' + s / 3;
+        float stopLine = getStopLineProgress(j, lane);
+        view->waiting = view->count;
+        view->going = view->count;
+        candidate[s] = -1;
+        if (view->count == 0) continue;
+        if (s % 3 == 1 && ((phase.yellowMask >> (s / 3)) & 1)) {
+            // Each vehicle decides once, as the light turns yellow, whether to stop or go on
+            if (phase.startTick == simTick) {
+                int going = getVehiclesClearingYellow(view, stopLine, getTimingTicks(signalTimings[j].yellow) * dt);
+                for (int k = 0; k < view->count; k++) {
+                    getVehicle(laneStore.vehicle[view->start + k])->goOnYellow = k < going;
                 }
-                break;
+            }
+            view->going = 0;
+            while (view->going < view->count && (laneStore.progress[view->start + view->going] > stopLine ||
+                                                 getVehicle(laneStore.vehicle[view->start + view->going])->goOnYellow)) {
+                view->going++;
+            }
+        } else if (s % 3 == 1 && !((phase.greenMask >> (s / 3)) & 1)) {
+            view->going = 0;
+            while (view->going < view->count && laneStore.progress[view->start + view->going] > stopLine) view->going++;
+        }
+
+        for (int k = 0; k < view->count; k++) {
+            int slot = view->start + k;
+            if (laneStore.onPath[slot]) continue;
+            Vehicle* v = getVehicle(laneStore.vehicle[slot]);
+            int path = findTurnPath(lane, s % 3 + 1, v->choice);
+            if (path < 0) break;
+            if (laneStore.progress[slot] >= getPathEntryProgress(j, path)) continue; // On its way out
+            if (k >= view->going) {
+                v->cleared = false; // Stopping for the signal, so it has no use for them yet
+                v->askingTick = 0;
+            } else if (v->cleared) {
+                held[path] |= turnPaths[path].cells[0];
+            } else {
+                candidate[s] = k;
+            }
+            break;
+        }
+    }
+
+    // Lane groups asking this tick, in the order they first asked
+    int asking[LANE_GROUPS_PER_JUNCTION];
+    Uint64 askingTicks[LANE_GROUPS_PER_JUNCTION];
+    int numAsking = 0;
+    for (int s = 0; s < LANE_GROUPS_PER_JUNCTION; s++) {
+        if (candidate[s] < 0) continue;
+        int slot = laneViews[j * LANE_GROUPS_PER_JUNCTION + s].start + candidate[s];
+        Vehicle* v = getVehicle(laneStore.vehicle[slot]);
+        int path = findTurnPath('A' + s / 3, s % 3 + 1, v->choice);
+        float speed = laneStore.speed[slot];
+        float distance = getPathEntryProgress(j, path) - laneStore.progress[slot];
+        float braking = speed * speed / (2 * SIGNAL_STOP_DECEL);
+        if (distance > braking + 2 * speed * dt + 1) continue; // Not asking yet
+        if (v->askingTick == 0) v->askingTick = simTick + 1;
+        int n = numAsking++;
+        while (n > 0 && askingTicks[n - 1] > v->askingTick) {
+            asking[n] = asking[n - 1];
+            askingTicks[n] = askingTicks[n - 1];
+            n--;
+        }
+        asking[n] = s;
+        askingTicks[n] = v->askingTick;
+    }
+
+    int waits = 0;
+    Uint64 refused = 0; // Cells of older requests that were turned down
+    for (int n = 0; n < numAsking; n++) {
+        int s = asking[n];
+        LaneView* view = &laneViews[j * LANE_GROUPS_PER_JUNCTION + s];
+        Vehicle* v = getVehicle(laneStore.vehicle[view->start + candidate[s]]);
+        int path = findTurnPath('A' + s / 3, s % 3 + 1, v->choice);
+
+        Uint64 others = refused;
+        for (int p = 0; p < NUM_TURN_PATHS; p++) {
+            if (p != path) others |= held[p];
+        }
+        if (!(turnPaths[path].cells[0] & others)) {
+            v->cleared = true;
+            v->askingTick = 0;
+            held[path] |= turnPaths[path].cells[0];
+        } else {
+            refused |= turnPaths[path].cells[0];
+            view->waiting = candidate[s];
+            waits++;
+        }
+    }
+    if (waits > 0) atomic_fetch_add_explicit(&metrics.conflictWaits, waits, memory_order_relaxed);
+}
+
+// Region task: move one lane group. Only its own vehicles are written; vehicles reaching
+// the next junction are queued on the group's boundary and moved over after the run.
+void stepLaneGroup(int g) {
+    const float dt = TICK_MS / 1000.0f;
+    LaneView* view = &laneViews[g];
+    int j = g / LANE_GROUPS_PER_JUNCTION;
+    int l = (g % LANE_GROUPS_PER_JUNCTION) / 3;
+    int s = g % 3;
+    char lane = 'A' + l;
+    float stopLine = getStopLineProgress(j, lane);
+    view->handoffCount = 0;
+    if (view->count == 0) {
+        updateLaneDetectors(g, stopLine);
+        return;
+    }
+    Junction* junction = &junctions[j];
+
+    // Vehicles ahead of the first one waiting for conflict cells go on, those up to the
+    // first one held by the signal stop at the path entry, and the rest at the stop line
+    int going = view->going;
+    int waiting = view->waiting < going ? view->waiting : going;
+    LaneView freeView = { .start = view->start, .count = waiting };
+    LaneView waitingView = { .start = view->start + waiting, .count = going - waiting };
+    LaneView stoppingView = { .start = view->start + going, .count = view->count - going };
+    if (freeView.count > 0) advanceLaneKernel(&freeView, dt, -LANE_FAR_AHEAD);
+    if (waitingView.count > 0) {
+        const Vehicle* first = getVehicle(laneStore.vehicle[waitingView.start]);
+        int path = findTurnPath(lane, s + 1, first->choice);
+        advanceLaneKernel(&waitingView, dt, getPathEntryProgress(j, path) - 1);
+    }
+    if (stoppingView.count > 0) advanceLaneKernel(&stoppingView, dt, stopLine);
+
+    float centre = getJunctionProgress(j, lane);
+    float x, y;
+    getLanePosition(j, lane, s + 1, &x, &y);
+    float lateral = (lane == 'A' || lane == 'B') ? y : x;
+    int turn = findTurnPath(lane, s + 1, 0);
+    int turnAlt = findTurnPath(lane, s + 1, 1);
+    int discharged = 0;
+    for (int k = view->start; k < view->start + view->count; k++) {
+        if (laneStore.onPath[k]) continue;
+        Vehicle* v = getVehicle(laneStore.vehicle[k]);
+        float next = laneStore.next[k];
+        switch (lane) {
+            case 'A': v->x = next;  break; // Move right
+            case 'B': v->x = -next; break; // Move left
+            case 'C': v->y = next;  break; // Move down
+            case 'D': v->y = -next; break; // Move up
+        }
+        v->speed = laneStore.nextSpeed[k];
+        v->accel = laneStore.accel[k];
+        v->waitTime = laneStore.nextWait[k];
+        if (v->merging) {
+            float* side = (lane == 'A' || lane == 'B') ? &v->y : &v->x;
+            *side += fmaxf(-MERGE_STEP, fminf(MERGE_STEP, lateral - *side));
+            v->merging = *side != lateral;
+        }
+        discharged += laneStore.progress[k] < stopLine && next >= stopLine;
+
+        if (next > getLaneEndProgress(lane)) {
+            v->active = false; // Left the world, free the slot
+            continue;
+        }
+
+        // Past the centre the vehicle is on its way to the next junction, if there is one
+        if (next > centre) {
+            if (junction->neighbour[l] >= 0) {
+                laneStore.handoff[view->start + view->handoffCount++] = laneStore.vehicle[k];
+            }
+            continue;
+        }
+
+        // Crossing the entry point of a movement hands the vehicle to its precomputed path
+        int path = v->choice == 0 ? turn : turnAlt;
+        if (path >= 0) {
+            const PathPoint* entry = &turnPaths[path].points[0];
+            float entryProgress = getPathEntryProgress(j, path);
+            if (laneStore.progress[k] < entryProgress && next >= entryProgress) {
+                v->pathId = path;
+                v->pathIndex = 0;
+                v->pathDistance = next - entryProgress;
+                v->x = junction->cx + entry->x;
+                v->y = junction->cy + entry->y;
+                v->cleared = false; // Its cells now go with its place on the path
+                v->goOnYellow = false;
+            }
+        }
+    }
+    if (discharged > 0) {
+        atomic_fetch_add_explicit(&metrics.discharges, discharged, memory_order_relaxed);
+        lastDischargeTick[g] = simTick;
+    }
+    updateLaneDetectors(g, stopLine);
+}
+
+// After the lane groups have stepped, serially in lane group order: move each lane queue on
+// by the vehicles that crossed its entry or its stop line, and post every loop that went
+// occupied or clear to its junction's feed
+void publishDetectors() {
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    for (int g = 1; g < numGroups; g += 3) { // The controlled sublane of every approach
+        const LaneView* view = &laneViews[g];
+        TrafficQueue* queue = &builtQueues[g / LANE_GROUPS_PER_JUNCTION][(g % LANE_GROUPS_PER_JUNCTION) / 3];
+        for (int k = view->joinFirst; k < view->joinFirst + view->joinCount; k++) {
+            if (laneStore.onPath[k]) continue;
+            enqueue(queue, laneStore.vehicle[k]);
+            getVehicle(laneStore.vehicle[k])->queuedTick = simTick;
+        }
+        for (int k = view->leaveFirst; k < view->leaveFirst + view->leaveCount; k++) {
+            dequeueThrough(queue, laneStore.vehicle[k]);
+        }
+    }
+
+    for (int d = 0; d < numDetectors; d++) {
+        const Detector* detector = &detectors[d];
+        if (!detector->changed) continue;
+        DetectorFeed* feed = &detectorFeeds[detector->group / LANE_GROUPS_PER_JUNCTION];
+        Uint64 head = atomic_load_explicit(&feed->head, memory_order_relaxed);
+        if (head - atomic_load_explicit(&feed->tail, memory_order_acquire) >= DETECTOR_EVENT_RING) {
+            atomic_fetch_add_explicit(&droppedDetectorEvents, 1, memory_order_relaxed);
+            continue;
+        }
+        feed->ring[head % DETECTOR_EVENT_RING] = (DetectorEvent){ simTick, d, detector->occupants > 0 };
+        atomic_store_explicit(&feed->head, head + 1, memory_order_release);
+    }
+}
+
+// Work out the loops and the lane queues afresh from where the vehicles stand, after they
+// were put there other than by driving: a restored checkpoint or a benchmark's setup
+void resyncDetectors() {
+    const float half = VEHICLE_LENGTH / 2.0f;
+    buildLaneViews();
+    for (int j = 0; j < numJunctions; j++) {
+        for (int l = 0; l < NUM_LANES; l++) {
+            initQueue(&builtQueues[j][l]);
+        }
+    }
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    for (int g = 0; g < numGroups; g++) {
+        const LaneView* view = &laneViews[g];
+        int j = g / LANE_GROUPS_PER_JUNCTION;
+        int l = (g % LANE_GROUPS_PER_JUNCTION) / 3;
+        float stopLine = getStopLineProgress(j, 'A' + l);
+        for (int d = detectorStart[g]; d < detectorStart[g + 1]; d++) {
+            Detector* detector = &detectors[d];
+            float far = stopLine - detector->setback;
+            float near = far - detector->length;
+            detector->occupants = 0;
+            detector->changed = false;
+            for (int k = view->start; k < view->start + view->count; k++) {
+                float progress = laneStore.progress[k];
+                detector->occupants += !laneStore.onPath[k] && progress + half >= near && progress - half < far;
+            }
+        }
+        for (int k = view->start; k < view->start + view->count; k++) {
+            float progress = laneStore.progress[k];
+            if (!laneStore.onPath[k] && progress + half >= laneQueueEntry[g] && progress < stopLine) {
+                enqueue(&builtQueues[j][l], laneStore.vehicle[k]);
+            }
         }
     }
-    SDL_UnlockMutex(vehicleMutex);
-    SDL_Delay(16); // Approximately 60 updates per second
+}
+
+// One tick, with each junction and each lane group stepped as an independent region.
+// Everything that crosses regions or draws random numbers happens serially between the
+// parallel runs in a fixed order, so the result does not depend on the number of workers.
+// Called only from the simulation thread; other threads reach vehicles through spawn requests.
+void updateVehicles() {
+    simTick++;
+    Uint64 tickStart = metricsEnabled ? SDL_GetPerformanceCounter() : 0;
+    Uint64 profileStart = profileBegin();
+    admitSpawns();
+    profileEnd(PROF_INGEST, profileStart);
+    profileStart = profileBegin();
+
+    // Vehicles inside the junction follow their precomputed paths
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    memset(turningStart, 0, sizeof(int) * (numJunctions + 1));
+    for (int i = 0; i < vehicleSpan; i++) {
+        Vehicle* v = getVehicle(i);
+        if (v->active && v->pathId >= 0) turningStart[v->junction + 1]++;
+    }
+    for (int j = 0; j < numJunctions; j++) {
+        turningStart[j + 1] += turningStart[j];
+    }
+    int fill[MAX_JUNCTIONS];
+    memcpy(fill, turningStart, sizeof(int) * numJunctions);
+    for (int i = 0; i < vehicleSpan; i++) {
+        Vehicle* v = getVehicle(i);
+        if (v->active && v->pathId >= 0) turningVehicles[fill[v->junction]++] = i;
+    }
+    runParallel("step junction paths", stepJunctionPaths, numJunctions);
+
+    // Everything else moves along its lane in contiguous batches, once the signals and the
+    // conflict cells have said how far each vehicle may go
+    applyCoordinatedLights();
+    if (actuatedControl) applyActuatedLights();
+    stepSignals();
+    buildLaneViews();
+    runParallel("reserve conflict cells", reserveConflictCells, numJunctions);
+    runParallel("step lane groups", stepLaneGroup, numGroups);
+    publishDetectors();
+
+    // Drain the boundary queues: vehicles join the next junction, merging into the sublane
+    // its signal controls, and pick a new route there
+    for (int g = 0; g < numGroups; g++) {
+        const LaneView* view = &laneViews[g];
+        int next = junctions[g / LANE_GROUPS_PER_JUNCTION].neighbour[(g % LANE_GROUPS_PER_JUNCTION) / 3];
+        for (int k = 0; k < view->handoffCount; k++) {
+            int i = laneStore.handoff[view->start + k];
+            Vehicle* v = getVehicle(i);
+            v->junction = next;
+            v->merging = v->sublane != 2;
+            v->sublane = 2;
+            chooseRoute(i);
+            if (v->sublane == 2) atomic_fetch_add(&junctions[next].controller.arrivals[v->lane - 'A'], 1);
+        }
+    }
+    buildSpatialHash();
+    profileEnd(PROF_VEHICLES, profileStart);
+    if (metricsEnabled) recordTickMetrics(getElapsedMicros(tickStart, SDL_GetPerformanceCounter()));
+    if (pacedTicks) {
+        profileStart = profileBegin();
+        SDL_Delay(16); // Approximately 60 updates per second
+        profileEnd(PROF_PACING, profileStart);
+    }
+}
+
+// Top-left corner of the window in world coordinates, moved with the arrow keys
+int cameraX = 0;
+int cameraY = 0;
+
+// Junction closest to the middle of the window, whose queues are shown
+int getFocusJunction() {
+    int focus = 0;
+    long best = -1;
+    for (int j = 0; j < numJunctions; j++) {
+        long dx = junctions[j].cx - (cameraX + WINDOW_WIDTH / 2);
+        long dy = junctions[j].cy - (cameraY + WINDOW_HEIGHT / 2);
+        if (best < 0 || dx * dx + dy * dy < best) {
+            best = dx * dx + dy * dy;
+            focus = j;
+        }
+    }
+    return focus;
+}
+
+// Pan the camera, keeping the window inside the world
+void moveCamera(int dx, int dy) {
+    cameraX += dx;
+    cameraY += dy;
+    if (cameraX > worldMaxX - WINDOW_WIDTH) cameraX = worldMaxX - WINDOW_WIDTH;
+    if (cameraY > worldMaxY - WINDOW_HEIGHT) cameraY = worldMaxY - WINDOW_HEIGHT;
+    if (cameraX < worldMinX) cameraX = worldMinX;
+    if (cameraY < worldMinY) cameraY = worldMinY;
 }
 
 void drawTrafficLights(SDL_Renderer* renderer) {
-    int center_x = WINDOW_WIDTH / 2;
-    int center_y = WINDOW_HEIGHT / 2;
-    
-    SDL_Rect lights[4] = {
-        { center_x - ROAD_WIDTH / 2 - 30, center_y - 20, 20, 40 }, // A ->
-        { center_x + ROAD_WIDTH / 2 , center_y - 15 , 20, 40 }, // B |
-        { center_x - 15, center_y -ROAD_WIDTH / 2 - 5, 40, 20 }, // C ^
-        { center_x - 15, center_y + ROAD_WIDTH / 2 + 10, 40, 20 }  // D <-
-    };
-    
-    for (int i = 0; i < 4; i++) {
-        if (trafficLights[i].green)
-            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255); // Green
-        else
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255); // Red
+    for (int j = 0; j < numJunctions; j++) {
+        int center_x = junctions[j].cx - cameraX;
+        int center_y = junctions[j].cy - cameraY;
+        
+        SDL_Rect lights[4] = {
+            { center_x - ROAD_WIDTH / 2 - 30, center_y - 20, 20, 40 }, // A ->
+            { center_x + ROAD_WIDTH / 2 , center_y - 15 , 20, 40 }, // B |
+            { center_x - 15, center_y -ROAD_WIDTH / 2 - 5, 40, 20 }, // C ^
+            { center_x - 15, center_y + ROAD_WIDTH / 2 + 10, 40, 20 }  // D <-
+        };
+        
+        SignalPhase phase;
+        readSignalPhase(&junctions[j], &phase);
+        for (int i = 0; i < 4; i++) {
+            if ((phase.greenMask >> i) & 1)
+                SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255); // Green
+            else if ((phase.yellowMask >> i) & 1)
+                SDL_SetRenderDrawColor(renderer, 255, 200, 0, 255); // Yellow
+            else
+                SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255); // Red
+
+            SDL_RenderFillRect(renderer, &lights[i]);
+        }
+    }
 
-        SDL_RenderFillRect(renderer, &lights[i]);
+    // Loop detectors, filled while a vehicle is over them
+    for (int d = 0; d < numDetectors; d++) {
+        const Detector* detector = &detectors[d];
+        int j = detector->group / LANE_GROUPS_PER_JUNCTION;
+        char lane = 'A' + (detector->group % LANE_GROUPS_PER_JUNCTION) / 3;
+        float far = getStopLineProgress(j, lane) - detector->setback;
+        float x, y;
+        getLanePosition(j, lane, detector->group % 3 + 1, &x, &y);
+        float sign = (lane == 'A' || lane == 'C') ? 1 : -1; // Progress back to world coordinates
+        int along = (int)fminf(sign * far, sign * (far - detector->length));
+        int size = (int)detector->length;
+        int width = LANE_WIDTH - 20;
+        SDL_Rect loop = (lane == 'A' || lane == 'B') ?
+            (SDL_Rect){ along - cameraX, (int)y - width / 2 - cameraY, size, width } :
+            (SDL_Rect){ (int)x - width / 2 - cameraX, along - cameraY, width, size };
+        SDL_SetRenderDrawColor(renderer, 230, 200, 40, 255);
+        if (detector->occupants > 0) SDL_RenderFillRect(renderer, &loop);
+        else SDL_RenderDrawRect(renderer, &loop);
     }
 }
 
 
 // Draw queue visualization
 void drawQueueVisualization(SDL_Renderer* renderer) {
+    TrafficQueue* laneQueues = junctions[getFocusJunction()].laneQueues;
+
     // Display queue sizes as text
     char queueText[4][20];
     for (int i = 0; i < 4; i++) {
@@ -798,184 +4276,1370 @@ void drawQueueVisualization(SDL_Renderer* renderer) {
         SDL_Rect vBox = { 55 + i * 12, 85, 10, 15 };
         SDL_RenderFillRect(renderer, &vBox);
     }
-    
-    // Bottom for Lane D
-    SDL_SetRenderDrawColor(renderer, 255, 255, 100, 255);
-    for (int i = 0; i < laneQueues[3].size && i < 10; i++) {
-        SDL_Rect vBox = { WINDOW_WIDTH - 165 + i * 12, 85, 10, 15 };
-        SDL_RenderFillRect(renderer, &vBox);
+    
+    // Bottom for Lane D
+    SDL_SetRenderDrawColor(renderer, 255, 255, 100, 255);
+    for (int i = 0; i < laneQueues[3].size && i < 10; i++) {
+        SDL_Rect vBox = { WINDOW_WIDTH - 165 + i * 12, 85, 10, 15 };
+        SDL_RenderFillRect(renderer, &vBox);
+    }
+}
+
+void drawRoundedRect(SDL_Renderer* renderer, SDL_Rect* rect, int radius) {
+    // Draw the central rectangle
+    SDL_Rect centralRect = {rect->x + radius, rect->y, rect->w - 2 * radius, rect->h};
+    SDL_RenderFillRect(renderer, &centralRect);
+
+    // Draw the left and right rectangles
+    SDL_Rect leftRect = {rect->x, rect->y + radius, radius, rect->h - 2 * radius};
+    SDL_RenderFillRect(renderer, &leftRect);
+    SDL_Rect rightRect = {rect->x + rect->w - radius, rect->y + radius, radius, rect->h - 2 * radius};
+    SDL_RenderFillRect(renderer, &rightRect);
+
+    // Draw the four corner circles
+    for (int w = 0; w < radius * 2; w++) {
+        for (int h = 0; h < radius * 2; h++) {
+            int dx = radius - w; // horizontal offset
+            int dy = radius - h; // vertical offset
+            if ((dx*dx + dy*dy) <= (radius * radius)) {
+                SDL_RenderDrawPoint(renderer, rect->x + radius + dx, rect->y + radius + dy); // top-left
+                SDL_RenderDrawPoint(renderer, rect->x + rect->w - radius + dx, rect->y + radius + dy); // top-right
+                SDL_RenderDrawPoint(renderer, rect->x + radius + dx, rect->y + rect->h - radius + dy); // bottom-left
+                SDL_RenderDrawPoint(renderer, rect->x + rect->w - radius + dx, rect->y + rect->h - radius + dy); // bottom-right
+            }
+        }
+    }
+}
+// Runs on the simulation thread between ticks, so the vehicle pool is read without locking
+void drawVehicles(SDL_Renderer* renderer) {
+    for (int i = 0; i < vehicleSpan; i++) {
+        Vehicle* v = getVehicle(i);
+        if (!v->active) continue;
+
+        // Screen position of the vehicle centre
+        int x = (int)v->x - cameraX;
+        int y = (int)v->y - cameraY;
+
+        // Use the color attribute
+        SDL_SetRenderDrawColor(renderer, v->color.r, v->color.g, v->color.b, v->color.a);
+
+        SDL_Rect carBody;
+        SDL_Rect carWindow;
+        SDL_Rect carWheel1, carWheel2, carWheel3, carWheel4;
+
+        // Inside the junction the path heading decides the orientation, otherwise the lane does
+        bool horizontal = v->lane == 'A' || v->lane == 'B';
+        if (v->pathId >= 0) {
+            float heading = turnPaths[v->pathId].points[v->pathIndex].heading;
+            horizontal = fabsf(cosf(heading)) >= fabsf(sinf(heading));
+        }
+
+        if (horizontal) { 
+            // Vehicles moving horizontally (left/right)
+            carBody = (SDL_Rect){
+                x - VEHICLE_LENGTH / 2, 
+                y - VEHICLE_SIZE / 2, 
+                VEHICLE_LENGTH,
+                VEHICLE_SIZE
+            };
+
+            carWindow = (SDL_Rect){
+                x - VEHICLE_LENGTH / 4, 
+                y - VEHICLE_SIZE / 4, 
+                VEHICLE_LENGTH / 2,
+                VEHICLE_SIZE / 2
+            };
+
+            carWheel1 = (SDL_Rect){
+                x - VEHICLE_LENGTH / 2 + 5, 
+                y - VEHICLE_SIZE / 2 - 5, 
+                10, 
+                10
+            };
+
+            carWheel2 = (SDL_Rect){
+                x + VEHICLE_LENGTH / 2 - 15, 
+                y - VEHICLE_SIZE / 2 - 5, 
+                10, 
+                10
+            };
+
+            carWheel3 = (SDL_Rect){
+                x - VEHICLE_LENGTH / 2 + 5, 
+                y + VEHICLE_SIZE / 2 - 5, 
+                10, 
+                10
+            };
+
+            carWheel4 = (SDL_Rect){
+                x + VEHICLE_LENGTH / 2 - 15, 
+                y + VEHICLE_SIZE / 2 - 5, 
+                10, 
+                10
+            };
+        } else {  
+            // Vehicles moving vertically (up/down)
+            carBody = (SDL_Rect){
+                x - VEHICLE_SIZE / 2 + 5, 
+                y - VEHICLE_LENGTH / 2, 
+                VEHICLE_SIZE,
+                VEHICLE_LENGTH
+            };
+
+            carWindow = (SDL_Rect){
+                x - VEHICLE_SIZE / 4 + 5, 
+                y - VEHICLE_LENGTH / 4, 
+                VEHICLE_SIZE / 2,
+                VEHICLE_LENGTH / 2
+            };
+
+            carWheel1 = (SDL_Rect){
+                x - VEHICLE_SIZE / 2 , 
+                y - VEHICLE_LENGTH / 2 + 5, 
+                10, 
+                10
+            };
+
+            carWheel2 = (SDL_Rect){
+                x + VEHICLE_SIZE / 2 , 
+                y - VEHICLE_LENGTH / 2 + 5, 
+                10, 
+                10
+            };
+
+            carWheel3 = (SDL_Rect){
+                x - VEHICLE_SIZE / 2 , 
+                y + VEHICLE_LENGTH / 2 - 15, 
+                10, 
+                10
+            };
+
+            carWheel4 = (SDL_Rect){
+                x + VEHICLE_SIZE / 2 , 
+                y + VEHICLE_LENGTH / 2 - 15, 
+                10, 
+                10
+            };
+        }
+
+        // Draw car body with rounded corners
+        drawRoundedRect(renderer, &carBody, 10);
+
+        // Draw car window with rounded corners
+        SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255); // Light gray for windows
+        drawRoundedRect(renderer, &carWindow, 5);
+
+        // Draw car wheels
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Black for wheels
+        SDL_RenderFillRect(renderer, &carWheel1);
+        SDL_RenderFillRect(renderer, &carWheel2);
+        SDL_RenderFillRect(renderer, &carWheel3);
+        SDL_RenderFillRect(renderer, &carWheel4);
+    }
+}
+
+// Parse one "id:lane:sublane" line of the vehicle file and spawn it; the line is modified
+bool parseVehicleLine(char* line) {
+    line[strcspn(line, "\n")] = 0;
+    char* vehicleNumber = strtok(line, ":");
+    char* lane = strtok(NULL, ":");
+    char* sublane = strtok(NULL, ":");
+
+    if (vehicleNumber && lane && sublane) {
+        if (logEvents) {
+            printf("Read vehicle: %s, Lane: %s, Sublane: %s\n", vehicleNumber, lane, sublane);
+        }
+        spawnVehicle(vehicleNumber, lane[0], atoi(sublane));
+        return true;
+    }
+    return false;
+}
+
+void* readAndParseFile(void* arg) {
+    printf("Reading vehicle data...\n");
+    traceThreadName("file parser");
+    while (!isStopRequested()) {
+        Uint64 profileStart = profileBegin();
+        FILE* file = fopen("vehicles.data", "r");
+        if (!file) {
+            perror("Error opening file");
+            waitForStop(1000);
+            continue;
+        }
+
+        char line[20];
+        while (!isStopRequested() && fgets(line, sizeof(line), file)) {
+            parseVehicleLine(line);
+        }
+        fclose(file);
+        profileEnd(PROF_PARSE_FILE, profileStart);
+        waitForStop(1000);
+    }
+    return NULL;
+}
+
+// Binary image of the whole world: this header, then numVehicles vehicle slots. Lane
+// queues are not saved; they follow from vehicle positions and are rebuilt on restore.
+typedef struct {
+    Uint32 magic;
+    Uint32 version;
+    Uint32 vehicleSize;     // sizeof(Vehicle) of the build that wrote the file
+    Uint32 numLanes;
+    Uint64 simTick;
+    Uint64 rngState;
+    Sint32 numVehicles;     // Slots up to the last active vehicle
+    Sint32 numJunctions;
+    Junction junctions[MAX_JUNCTIONS];  // Topology, lights and controller state
+    CoordinationState coordination;
+    SignalTiming signalTimings[MAX_JUNCTIONS];
+    Sint32 numDetectorSpecs;
+    Detector detectorSpecs[MAX_DETECTORS]; // The loops are rebuilt from these, not from the network loaded now
+} WorldCheckpoint;
+
+// Kept static because the snapshot is too large for a thread stack
+static WorldCheckpoint checkpointBuffer;
+
+// Save vehicles, the network with its queues, lights and controllers, clock and RNG state to a file
+// Checkpoints run on the simulation thread; they also hold the network lock and the locks
+// of the first count junctions, so the controller thread never sees a half-copied network
+static Uint64 networkLockTimes[MAX_JUNCTIONS + 1]; // When each lock was acquired, network lock last
+
+void lockNetwork(int count) {
+    networkLockTimes[MAX_JUNCTIONS] = lockMutex(networkMutex, LOCK_CHECKPOINT_NETWORK);
+    for (int j = 0; j < count; j++) {
+        networkLockTimes[j] = lockMutex(junctionLocks[j], LOCK_CHECKPOINT_JUNCTION);
+    }
+}
+
+void unlockNetwork(int count) {
+    for (int j = count - 1; j >= 0; j--) {
+        unlockMutex(junctionLocks[j], LOCK_CHECKPOINT_JUNCTION, networkLockTimes[j]);
+    }
+    unlockMutex(networkMutex, LOCK_CHECKPOINT_NETWORK, networkLockTimes[MAX_JUNCTIONS]);
+}
+
+bool saveCheckpoint(const char* path) {
+    int count = numJunctions;
+    lockNetwork(count);
+    checkpointBuffer.magic = CHECKPOINT_MAGIC;
+    checkpointBuffer.version = CHECKPOINT_VERSION;
+    checkpointBuffer.vehicleSize = sizeof(Vehicle);
+    checkpointBuffer.numLanes = NUM_LANES;
+    checkpointBuffer.simTick = simTick;
+    checkpointBuffer.rngState = atomic_load(&rngState);
+    checkpointBuffer.numJunctions = numJunctions;
+    memcpy(checkpointBuffer.junctions, junctions, sizeof(junctions));
+    checkpointBuffer.coordination = coordination;
+    memcpy(checkpointBuffer.signalTimings, signalTimings, sizeof(signalTimings));
+    checkpointBuffer.numDetectorSpecs = numDetectorSpecs;
+    memcpy(checkpointBuffer.detectorSpecs, detectorSpecs, sizeof(detectorSpecs));
+    unlockNetwork(count);
+    for (int j = 0; j < MAX_JUNCTIONS; j++) {
+        memset(checkpointBuffer.junctions[j].laneQueues, 0, sizeof(checkpointBuffer.junctions[j].laneQueues));
+    }
+    int numVehicles = 0;
+    for (int i = 0; i < vehicleSpan; i++) {
+        if (getVehicle(i)->active) numVehicles = i + 1;
+    }
+    checkpointBuffer.numVehicles = numVehicles;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror("Error opening checkpoint for writing");
+        return false;
+    }
+    bool ok = fwrite(&checkpointBuffer, sizeof(checkpointBuffer), 1, file) == 1;
+    for (int c = 0; ok && c * VEHICLE_CHUNK < numVehicles; c++) {
+        size_t slots = numVehicles - c * VEHICLE_CHUNK < VEHICLE_CHUNK ? numVehicles - c * VEHICLE_CHUNK : VEHICLE_CHUNK;
+        ok = fwrite(vehicleChunks[c], sizeof(Vehicle), slots, file) == slots;
+    }
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        printf("Failed to write checkpoint %s\n", path);
+        return false;
+    }
+
+    printf("Checkpoint saved to %s at tick %llu\n", path, (unsigned long long)checkpointBuffer.simTick);
+    return true;
+}
+
+// Restore the world from a file written by saveCheckpoint; the running world is untouched on failure
+bool loadCheckpoint(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Error opening checkpoint");
+        return false;
+    }
+    size_t read = fread(&checkpointBuffer, sizeof(checkpointBuffer), 1, file);
+    if (read != 1 ||
+        checkpointBuffer.magic != CHECKPOINT_MAGIC ||
+        checkpointBuffer.version != CHECKPOINT_VERSION ||
+        checkpointBuffer.vehicleSize != sizeof(Vehicle) ||
+        checkpointBuffer.numLanes != NUM_LANES ||
+        checkpointBuffer.numVehicles < 0 ||
+        checkpointBuffer.numJunctions < 1 || checkpointBuffer.numJunctions > MAX_JUNCTIONS ||
+        checkpointBuffer.numDetectorSpecs < 0 || checkpointBuffer.numDetectorSpecs > MAX_DETECTORS) {
+        fclose(file);
+        printf("Checkpoint %s is truncated or was written by an incompatible build\n", path);
+        return false;
+    }
+    int numVehicles = checkpointBuffer.numVehicles;
+    if (numVehicles > vehicleLimit) {
+        fclose(file);
+        printf("Checkpoint %s holds %d vehicle slots, more than the limit of %d\n", path, numVehicles, vehicleLimit);
+        return false;
+    }
+    Vehicle* saved = SDL_malloc(sizeof(Vehicle) * (numVehicles > 0 ? numVehicles : 1));
+    bool ok = saved && fread(saved, sizeof(Vehicle), numVehicles, file) == (size_t)numVehicles;
+    fclose(file);
+    if (!ok || !reserveVehicles(numVehicles)) {
+        SDL_free(saved);
+        printf("Checkpoint %s is truncated or too large to restore\n", path);
+        return false;
+    }
+
+    // Lock every junction that exists before or after the restore
+    int count = numJunctions > checkpointBuffer.numJunctions ? numJunctions : checkpointBuffer.numJunctions;
+    lockNetwork(count);
+    simTick = checkpointBuffer.simTick;
+    atomic_store(&rngState, checkpointBuffer.rngState);
+    for (int i = 0; i < vehicleCapacity; i++) {
+        if (i < numVehicles) {
+            *getVehicle(i) = saved[i];
+        } else {
+            getVehicle(i)->active = false;
+        }
+    }
+    vehicleSpan = numVehicles;
+    numJunctions = checkpointBuffer.numJunctions;
+    for (int j = 0; j < MAX_JUNCTIONS; j++) {
+        TrafficQueue queues[NUM_LANES];
+        memcpy(queues, junctions[j].laneQueues, sizeof(queues)); // Keep the live buffers
+        junctions[j] = checkpointBuffer.junctions[j];
+        memcpy(junctions[j].laneQueues, queues, sizeof(queues));
+    }
+    coordination = checkpointBuffer.coordination;
+    memcpy(signalTimings, checkpointBuffer.signalTimings, sizeof(signalTimings));
+    numDetectorSpecs = checkpointBuffer.numDetectorSpecs;
+    memcpy(detectorSpecs, checkpointBuffer.detectorSpecs, sizeof(detectorSpecs));
+    updateWorldBounds();
+    buildCorridors();
+    buildDetectors();
+    for (int j = 0; j < count; j++) {
+        atomic_store(&detectorFeeds[j].tail, atomic_load(&detectorFeeds[j].head)); // Events of the world replaced
+    }
+    unlockNetwork(count);
+    SDL_free(saved);
+    resyncDetectors();
+    updateTrafficQueues();
+    buildSpatialHash();
+
+    printf("Checkpoint restored from %s at tick %llu\n", path, (unsigned long long)simTick);
+    return true;
+}
+
+// Microbenchmarks of the simulation kernels, run headless with --bench [name]. Each one
+// is timed over batches that grow until they last BENCH_MIN_MS, from a state rebuilt by
+// its setup outside the timed region, and swept over vehicle count and lane occupancy.
+typedef struct {
+    const char* name;
+    void (*setup)(void);  // Builds the state the operation starts from
+    void (*op)(void);     // One operation
+    int resetEvery;       // Operations between setups, 0 to set up once
+    bool byVehicles;      // Sweep the vehicle counts, otherwise use the first
+    bool byOccupancy;     // Sweep the occupancies, otherwise use the first
+} Benchmark;
+
+int benchVehicles;
+float benchOccupancy;
+int benchNextSlot;            // Slot the next spawned vehicle lands in
+int benchLine;
+volatile int benchSink;       // Results of pure kernels land here so they are not optimised away
+TrafficQueue benchQueue;
+SDL_Renderer* benchRenderer;
+
+// Every allocation made during a timed batch: all of the simulator's go through SDL's memory
+// functions, which runBenchmarks() swaps for these counting ones. A kernel should make none;
+// the run arena only takes a new block when the pool or a queue outgrows what the setup reserved.
+static _Atomic Uint64 benchAllocations = 0;
+static SDL_malloc_func sdlMalloc;
+static SDL_calloc_func sdlCalloc;
+static SDL_realloc_func sdlRealloc;
+static SDL_free_func sdlFree;
+
+static void* SDLCALL countingMalloc(size_t size) {
+    atomic_fetch_add_explicit(&benchAllocations, 1, memory_order_relaxed);
+    return sdlMalloc(size);
+}
+
+static void* SDLCALL countingCalloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&benchAllocations, 1, memory_order_relaxed);
+    return sdlCalloc(count, size);
+}
+
+static void* SDLCALL countingRealloc(void* memory, size_t size) {
+    atomic_fetch_add_explicit(&benchAllocations, 1, memory_order_relaxed);
+    return sdlRealloc(memory, size);
+}
+
+// Fill the network with benchVehicles vehicles, dealt round-robin over every approach lane
+// and queued back from the stop line. At full occupancy they stand bumper to bumper; lower
+// occupancies spread them out and leave them moving.
+void placeBenchVehicles() {
+    resetRun(benchVehicles + 1); // And the slot benchSpawnVehicle() fills
+    seedRandom(1);
+    int numGroups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+    float spacing = (VEHICLE_LENGTH + IDM_MIN_GAP) / benchOccupancy;
+    for (int i = 0; i < benchVehicles && i < vehicleCapacity; i++) {
+        Vehicle* v = getVehicle(i);
+        int g = i % numGroups;
+        int junction = g / LANE_GROUPS_PER_JUNCTION;
+        char lane = 'A' + (g % LANE_GROUPS_PER_JUNCTION) / 3;
+        initVehicle(i, "BENCH", junction, lane, g % 3 + 1);
+
+        float progress = getStopLineProgress(junction, lane) - VEHICLE_LENGTH / 2 - (i / numGroups) * spacing;
+        switch (lane) {
+            case 'A': v->x = progress;  break;
+            case 'B': v->x = -progress; break;
+            case 'C': v->y = progress;  break;
+            case 'D': v->y = -progress; break;
+        }
+        v->speed *= 1.0f - benchOccupancy;
+    }
+    benchNextSlot = benchVehicles;
+
+    // Red everywhere, so the queues hold their shape while the kernels run
+    for (int j = 0; j < numJunctions; j++) {
+        requestSignalPhase(&junctions[j], 0, 0);
+        showSignal(&junctions[j], INTERVAL_GREEN, 0, 0);
+    }
+    memset(spawnQueues, 0, sizeof(spawnQueues));
+    resyncDetectors();
+    updateTrafficQueues();
+}
+
+void benchSpawnVehicle() {
+    spawnVehicle("BENCH", 'A', 2);
+    admitSpawns();
+    if (benchNextSlot < vehicleCapacity) getVehicle(benchNextSlot)->active = false; // Keep the count steady
+}
+
+void benchCountVehiclesPerLane() {
+    int laneQueue[NUM_LANES] = {0};
+    countVehiclesPerLane(0, laneQueue, 2);
+    benchSink = laneQueue[0] + laneQueue[1] + laneQueue[2] + laneQueue[3];
+}
+
+// A ring buffer filled to the occupancy, one vehicle in and one out per operation. It has
+// its own buffer, which never needs to grow, rather than one from the run arena.
+void fillBenchQueue() {
+    static int indices[BENCH_QUEUE_SIZE];
+    benchQueue = (TrafficQueue){ .vehicleIndices = indices, .capacity = BENCH_QUEUE_SIZE };
+    initQueue(&benchQueue);
+    int fill = (int)(benchOccupancy * (BENCH_QUEUE_SIZE - 1));
+    for (int k = 0; k < fill; k++) {
+        enqueue(&benchQueue, k);
+    }
+}
+
+void benchEnqueueDequeue() {
+    enqueue(&benchQueue, 1);
+    benchSink = dequeue(&benchQueue);
+}
+
+void benchFindNearestVehicle() {
+    float x = worldMinX + simRandom() % (worldMaxX - worldMinX + 1);
+    float y = worldMinY + simRandom() % (worldMaxY - worldMinY + 1);
+    benchSink = findNearestVehicle(x, y, 4 * SPATIAL_CELL);
+}
+
+void benchDrawVehicles() {
+    drawVehicles(benchRenderer);
+}
+
+void resetBenchParser() {
+    memset(spawnQueues, 0, sizeof(spawnQueues));
+}
+
+void benchParseVehicleLine() {
+    static const char* lines[] = { "V101:A:2\n", "V202:B:1\n", "V303:C:2\n", "V404:D:3\n", "V505:B:2\n", "bad line\n" };
+    char line[20];
+    snprintf(line, sizeof(line), "%s", lines[benchLine++ % (sizeof(lines) / sizeof(lines[0]))]);
+    parseVehicleLine(line);
+}
+
+// Time one benchmark at the current parameters and print a result line
+void runBenchmark(const Benchmark* bench) {
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    long iterations = 1;
+    for (;;) {
+        Uint64 elapsed = 0;
+        Uint64 allocations = 0;
+        for (long done = 0; done < iterations;) {
+            bench->setup();
+            long batch = bench->resetEvery > 0 && bench->resetEvery < iterations - done ? bench->resetEvery : iterations - done;
+            Uint64 allocationsBefore = atomic_load(&benchAllocations);
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (long n = 0; n < batch; n++) {
+                bench->op();
+            }
+            elapsed += SDL_GetPerformanceCounter() - start;
+            allocations += atomic_load(&benchAllocations) - allocationsBefore;
+            done += batch;
+        }
+
+        double seconds = elapsed / frequency;
+        if (seconds * 1000 >= BENCH_MIN_MS || iterations >= (1L << 30)) {
+            // Only the parameters the benchmark sweeps; the others do not apply to it
+            char vehicles[16] = "", occupancy[16] = "";
+            if (bench->byVehicles) snprintf(vehicles, sizeof(vehicles), "%4d vehicles", benchVehicles);
+            if (bench->byOccupancy) snprintf(occupancy, sizeof(occupancy), "%4.0f%% occupancy", benchOccupancy * 100);
+            printf("%-24s %13s %14s %12.1f ns/op %14.0f ops/s %8.3f allocs/op\n",
+                   bench->name, vehicles, occupancy, seconds * 1e9 / iterations,
+                   iterations / seconds, (double)allocations / iterations);
+            return;
+        }
+        // Aim straight for the target once the batch is long enough to measure
+        iterations = seconds * 1000 > 1 ? (long)(iterations * (BENCH_MIN_MS * 1.2 / (seconds * 1000))) + 1 : iterations * 10;
+    }
+}
+
+void resetBenchEnv(); // Defined with the environment API
+void benchEnvStep();
+TrafficEnv* benchEnv = NULL;
+
+// Run every benchmark whose name contains filter (all when NULL); returns the exit status
+int runBenchmarks(const char* filter, int threads) {
+    static const Benchmark benchmarks[] = {
+        { "spawnVehicle",         placeBenchVehicles, benchSpawnVehicle,         0,                 true,  true  },
+        { "updateVehicles",       placeBenchVehicles, updateVehicles,            1000 / TICK_MS,    true,  true  },
+        { "updateTrafficQueues",  placeBenchVehicles, updateTrafficQueues,       0,                 true,  true  },
+        { "countVehiclesPerLane", placeBenchVehicles, benchCountVehiclesPerLane, 0,                 true,  true  },
+        { "buildSpatialHash",     placeBenchVehicles, buildSpatialHash,          0,                 true,  true  },
+        { "findNearestVehicle",   placeBenchVehicles, benchFindNearestVehicle,   0,                 true,  true  },
+        { "enqueue/dequeue",      fillBenchQueue,     benchEnqueueDequeue,       0,                 false, true  },
+        { "drawVehicles",         placeBenchVehicles, benchDrawVehicles,         0,                 true,  true  },
+        { "parseVehicleLine",     resetBenchParser,   benchParseVehicleLine,     MAX_PENDING_SPAWNS, false, false },
+        { "envStep",              resetBenchEnv,      benchEnvStep,              ENV_BENCH_EPISODE_STEPS, false, false },
+    };
+    static const int vehicleCounts[] = { 50, 200, 500, 5000 };
+    static const float occupancies[] = { 0.25f, 1.0f };
+
+    SDL_GetMemoryFunctions(&sdlMalloc, &sdlCalloc, &sdlRealloc, &sdlFree);
+    SDL_SetMemoryFunctions(countingMalloc, countingCalloc, countingRealloc, sdlFree);
+
+    // Draw into a plain surface: no window or display needed
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, WINDOW_WIDTH, WINDOW_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+    benchRenderer = surface ? SDL_CreateSoftwareRenderer(surface) : NULL;
+    if (!initLocks() || !benchRenderer) {
+        SDL_Log("Failed to set up benchmarks: %s", SDL_GetError());
+        destroyLocks();
+        if (surface) SDL_FreeSurface(surface);
+        return -1;
+    }
+
+    pacedTicks = false;
+    logEvents = false;
+    initDefaultNetwork();
+    buildCorridors();
+    buildDetectors();
+    moveCamera(0, 0);
+    initTrafficLights();
+    initTurnPaths();
+    initWorkerPool(threads);
+
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const Benchmark* bench = &benchmarks[b];
+        if (filter && !strstr(bench->name, filter)) continue;
+        for (size_t v = 0; v < (bench->byVehicles ? sizeof(vehicleCounts) / sizeof(vehicleCounts[0]) : 1); v++) {
+            for (size_t o = 0; o < (bench->byOccupancy ? sizeof(occupancies) / sizeof(occupancies[0]) : 1); o++) {
+                benchVehicles = vehicleCounts[v];
+                benchOccupancy = occupancies[o];
+                runBenchmark(bench);
+            }
+        }
+    }
+    fflush(stdout);
+
+    shutdownWorkerPool();
+    envDestroy(benchEnv); // Releases the run too when it is the one in the globals
+    benchEnv = NULL;
+    releaseArena(&runArena);
+    SDL_DestroyRenderer(benchRenderer);
+    SDL_FreeSurface(surface);
+    destroyLocks();
+    return 0;
+}
+
+// End-to-end scenarios, run headless with --scenarios [name]. Each one drives the whole
+// simulation from a fixed seed with the controller stepped on the simulation clock, so
+// every run sees the same traffic and only the wall-clock time varies.
+typedef struct {
+    const char* name;
+    int gridSize;           // Junctions per side, 1 for the single default junction
+    float arrivalsPerSecond; // Vehicles entering across the whole network
+    float priorityShare;    // Fraction of them sent into lane C2 of the first junction
+    float simSeconds;
+    Uint64 seed;
+    bool actuated;          // Every junction on the actuated controller, with no corridor plans
+} Scenario;
+
+typedef struct {
+    const char* name;
+    Uint64 seed;
+    float simSeconds;
+    double wallSeconds;
+    double simSecondsPerWallSecond;
+    int peakVehicles;
+    double meanVehicles;
+} ScenarioResult;
+
+static const Scenario scenarios[] = {
+    { "light",        1, 0.5f, 0.0f, 600.0f, 1, false },
+    { "peak-hour",    1, 2.0f, 0.0f, 600.0f, 2, false },
+    { "saturated-c2", 1, 1.5f, 0.6f, 600.0f, 3, false },
+    { "gridlock",     3, 8.0f, 0.0f, 300.0f, 4, false },
+    { "actuated",     3, 2.0f, 0.0f, 300.0f, 5, true },
+};
+
+int countActiveVehicles() {
+    int count = 0;
+    for (int i = 0; i < vehicleSpan; i++) {
+        count += getVehicle(i)->active;
+    }
+    return count;
+}
+
+// Approaches entering from the edge of the running scenario's network, as j * NUM_LANES + lane
+int scenarioEntries[MAX_JUNCTIONS * NUM_LANES];
+int numScenarioEntries = 0;
+
+// Build the scenario's network and start an empty run on it from the seed
+void startScenario(const Scenario* scenario, Uint64 seed) {
+    if (scenario->gridSize > 1) {
+        initGridNetwork(scenario->gridSize, scenario->gridSize, MIN_JUNCTION_SPACING);
+    } else {
+        initDefaultNetwork();
+    }
+    buildCorridors();
+    buildDetectors();
+    resetRun((int)(scenario->arrivalsPerSecond * scenario->simSeconds)); // No more than ever arrive
+    initTrafficLights();
+    memset(spawnQueues, 0, sizeof(spawnQueues));
+    actuatedControl = scenario->actuated;
+    coordination = (CoordinationState){ .enabled = !scenario->actuated, .lostTime = COORD_LOST_TIME }; // Nothing carried over from the last run
+    simTick = 0;
+    seedRandom(seed);
+
+    numScenarioEntries = 0;
+    for (int j = 0; j < numJunctions; j++) {
+        for (int l = 0; l < NUM_LANES; l++) {
+            if (junctions[j].neighbour[getOppositeLane(l)] == -1) scenarioEntries[numScenarioEntries++] = j * NUM_LANES + l;
+        }
+    }
+}
+
+// One tick of arrivals. Every entry approach takes a share of them; the expected arrivals
+// are split into whole vehicles and a chance of one more.
+void spawnScenarioArrivals(const Scenario* scenario) {
+    float expected = scenario->arrivalsPerSecond * TICK_MS / 1000.0f;
+    while (expected > 0 && (simRandom() % 10000) / 10000.0f < expected) {
+        expected -= 1.0f;
+        if ((simRandom() % 10000) / 10000.0f < scenario->priorityShare) {
+            spawnVehicleAt("C2", findEntryJunction('C'), 'C', 2);
+            continue;
+        }
+        int entry = scenarioEntries[simRandom() % numScenarioEntries];
+        char lane = 'A' + entry % NUM_LANES;
+        int sublane = (simRandom() % 3) + 1;
+        if (canSpawnIn(lane, sublane)) spawnVehicleAt("S", entry / NUM_LANES, lane, sublane);
+    }
+}
+
+void runScenario(const Scenario* scenario, ScenarioResult* result) {
+    startScenario(scenario, scenario->seed);
+    int ticks = (int)(scenario->simSeconds * 1000 / TICK_MS);
+    long vehicleTicks = 0;
+    int peak = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int t = 0; t < ticks; t++) {
+        spawnScenarioArrivals(scenario);
+        updateVehicles();
+        updateTrafficQueues();
+        if (t % (1000 / TICK_MS) == 0) stepTrafficLightsAdvanced();
+
+        int active = countActiveVehicles();
+        vehicleTicks += active;
+        if (active > peak) peak = active;
     }
+    double wallSeconds = (SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+
+    result->name = scenario->name;
+    result->seed = scenario->seed;
+    result->simSeconds = scenario->simSeconds;
+    result->wallSeconds = wallSeconds;
+    result->simSecondsPerWallSecond = wallSeconds > 0 ? scenario->simSeconds / wallSeconds : 0;
+    result->peakVehicles = peak;
+    result->meanVehicles = ticks > 0 ? (double)vehicleTicks / ticks : 0;
 }
 
-void drawRoundedRect(SDL_Renderer* renderer, SDL_Rect* rect, int radius) {
-    // Draw the central rectangle
-    SDL_Rect centralRect = {rect->x + radius, rect->y, rect->w - 2 * radius, rect->h};
-    SDL_RenderFillRect(renderer, &centralRect);
+void writeScenarioResults(FILE* file, const ScenarioResult* results, int count) {
+    fprintf(file, "{\n  \"scenarios\": [\n");
+    for (int k = 0; k < count; k++) {
+        const ScenarioResult* r = &results[k];
+        fprintf(file, "    {\"name\": \"%s\", \"seed\": %llu, \"simSeconds\": %.1f, \"wallSeconds\": %.4f, "
+                      "\"simSecondsPerWallSecond\": %.2f, \"peakVehicles\": %d, \"meanVehicles\": %.2f}%s\n",
+                r->name, (unsigned long long)r->seed, r->simSeconds, r->wallSeconds,
+                r->simSecondsPerWallSecond, r->peakVehicles, r->meanVehicles, k + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
 
-    // Draw the left and right rectangles
-    SDL_Rect leftRect = {rect->x, rect->y + radius, radius, rect->h - 2 * radius};
-    SDL_RenderFillRect(renderer, &leftRect);
-    SDL_Rect rightRect = {rect->x + rect->w - radius, rect->y + radius, radius, rect->h - 2 * radius};
-    SDL_RenderFillRect(renderer, &rightRect);
+// Read back one scenario from a file written by writeScenarioResults
+bool readScenarioBaseline(const char* path, const char* name, ScenarioResult* baseline) {
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+    char line[512];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file)) {
+        if (!strstr(line, pattern)) continue;
+        char* rate = strstr(line, "\"simSecondsPerWallSecond\":");
+        char* peak = strstr(line, "\"peakVehicles\":");
+        if (rate && peak) {
+            baseline->simSecondsPerWallSecond = strtod(rate + strlen("\"simSecondsPerWallSecond\":"), NULL);
+            baseline->peakVehicles = atoi(peak + strlen("\"peakVehicles\":"));
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
 
-    // Draw the four corner circles
-    for (int w = 0; w < radius * 2; w++) {
-        for (int h = 0; h < radius * 2; h++) {
-            int dx = radius - w; // horizontal offset
-            int dy = radius - h; // vertical offset
-            if ((dx*dx + dy*dy) <= (radius * radius)) {
-                SDL_RenderDrawPoint(renderer, rect->x + radius + dx, rect->y + radius + dy); // top-left
-                SDL_RenderDrawPoint(renderer, rect->x + rect->w - radius + dx, rect->y + radius + dy); // top-right
-                SDL_RenderDrawPoint(renderer, rect->x + radius + dx, rect->y + rect->h - radius + dy); // bottom-left
-                SDL_RenderDrawPoint(renderer, rect->x + rect->w - radius + dx, rect->y + rect->h - radius + dy); // bottom-right
-            }
+// Run the scenarios whose name contains filter (all when NULL), write their results as JSON
+// to jsonPath (stdout when NULL) and compare them with a baseline written the same way.
+// Returns 1 if any scenario regressed by more than tolerance.
+int runScenarioBenchmarks(const char* filter, int threads, const char* jsonPath, const char* baselinePath, float tolerance) {
+    static ScenarioResult results[MAX_SCENARIOS];
+    if (!initLocks()) {
+        SDL_Log("Failed to create mutex: %s", SDL_GetError());
+        destroyLocks();
+        return -1;
+    }
+    pacedTicks = false;
+    logEvents = false;
+    initTurnPaths();
+    initWorkerPool(threads);
+
+    int count = 0;
+    for (size_t k = 0; k < sizeof(scenarios) / sizeof(scenarios[0]) && count < MAX_SCENARIOS; k++) {
+        if (filter && !strstr(scenarios[k].name, filter)) continue;
+        runScenario(&scenarios[k], &results[count++]);
+    }
+
+    FILE* file = jsonPath ? fopen(jsonPath, "w") : stdout;
+    if (!file) {
+        perror("Error opening results file");
+        file = stdout;
+    }
+    writeScenarioResults(file, results, count);
+    if (file != stdout) fclose(file);
+
+    // Throughput below the baseline by more than the tolerance is a regression, and so is a
+    // scenario that no longer sustains as many vehicles
+    int status = 0;
+    for (int k = 0; baselinePath && k < count; k++) {
+        ScenarioResult baseline;
+        if (!readScenarioBaseline(baselinePath, results[k].name, &baseline)) {
+            printf("%-14s no baseline\n", results[k].name);
+            continue;
         }
+        double change = baseline.simSecondsPerWallSecond > 0 ?
+            results[k].simSecondsPerWallSecond / baseline.simSecondsPerWallSecond - 1 : 0;
+        bool slower = change < -tolerance;
+        bool fewer = results[k].peakVehicles < baseline.peakVehicles * (1 - tolerance);
+        printf("%-14s %10.1f sim s/s (baseline %10.1f, %+6.1f%%), peak %d vehicles (baseline %d)%s\n",
+               results[k].name, results[k].simSecondsPerWallSecond, baseline.simSecondsPerWallSecond, change * 100,
+               results[k].peakVehicles, baseline.peakVehicles, slower || fewer ? "  REGRESSION" : "");
+        if (slower || fewer) status = 1;
     }
+    fflush(stdout);
+
+    shutdownWorkerPool();
+    releaseArena(&runArena);
+    destroyLocks();
+    return status;
 }
-void drawVehicles(SDL_Renderer* renderer) {
-    SDL_LockMutex(vehicleMutex);
-    for (int i = 0; i < MAX_VEHICLES; i++) {
-        if (!vehicles[i].active) continue;
 
-        // Use the color attribute
-        SDL_SetRenderDrawColor(renderer, vehicles[i].color.r, vehicles[i].color.g, vehicles[i].color.b, vehicles[i].color.a);
+// Environment for training signal policies, declared in traffic_env.h. An environment runs
+// one of the scenarios headless on the calling thread, with the agent in place of the light
+// controllers: reset to a scenario and seed, observe the queues and lights, and step with a
+// phase asked for at each junction. A process holds any number of environments, each with
+// its own arena. The simulation works on the run in the globals, so the environment being
+// called swaps its run in and the one that had it out, copying only what its network uses.
+// Environments share the worker pool: a call that finds another one running fails rather
+// than race it. A step allocates nothing once the reset has sized the run.
 
-        SDL_Rect carBody;
-        SDL_Rect carWindow;
-        SDL_Rect carWheel1, carWheel2, carWheel3, carWheel4;
+// Everything a run changes, held by an environment while another one is in the globals
+typedef struct {
+    Arena arena;
+    Vehicle* vehicleChunks[MAX_VEHICLE_CHUNKS];
+    int vehicleCapacity, vehicleSpan, nextFreeVehicle;
+    Junction junctions[MAX_JUNCTIONS];
+    int numJunctions;
+    SignalTiming signalTimings[MAX_JUNCTIONS];
+    bool actuatedControl;
+    Detector detectors[MAX_DETECTORS];
+    int numDetectors;
+    int detectorStart[MAX_LANE_GROUPS + 1];
+    DetectorFeed detectorFeeds[MAX_JUNCTIONS];
+    Uint64 lastDischargeTick[MAX_LANE_GROUPS];
+    int worldMinX, worldMinY, worldMaxX, worldMaxY;
+    Uint64 simTick;
+    Uint64 rngState;
+    TrafficQueue builtQueues[MAX_JUNCTIONS][NUM_LANES];
+    Corridor corridors[MAX_JUNCTIONS * 2];
+    int numCorridors;
+    CoordinationState coordination;
+    SpawnQueue spawnQueues[MAX_LANE_GROUPS];
+    LaneStore laneStore;
+    LaneView laneViews[MAX_LANE_GROUPS];
+    int* laneOrder;
+    int laneOrderCount;
+    Uint64* laneViewStamp;
+    Uint64 laneViewGeneration;
+    int* laneGroupOf;
+    int* laneCandidates;
+    int* turningVehicles;
+    int turningStart[MAX_JUNCTIONS + 1];
+    int* spatialStart;
+    int* spatialVehicle;
+    float* spatialX;
+    float* spatialY;
+    int* spatialBucketOf;
+    int spatialBuckets, spatialCount, laneStoreCapacity;
+    float laneQueueEntry[MAX_LANE_GROUPS];
+    int scenarioEntries[MAX_JUNCTIONS * NUM_LANES];
+    int numScenarioEntries;
+} RunState;
+
+struct TrafficEnv {
+    RunState run; // Stale while the environment is the active one
+    const Scenario* scenario;
+    Uint64 endTick;
+};
+
+static TrafficEnv* activeEnv = NULL; // Environment whose run is in the globals
+static _Atomic bool envCallRunning = false;
+
+static void moveRunPart(void* saved, void* live, size_t size, bool save) {
+    if (save) {
+        memcpy(saved, live, size);
+    } else {
+        memcpy(live, saved, size);
+    }
+}
 
-        if (vehicles[i].lane == 'A' || vehicles[i].lane == 'B') { 
-            // Vehicles moving horizontally (left/right)
-            carBody = (SDL_Rect){
-                vehicles[i].x - VEHICLE_LENGTH / 2, 
-                vehicles[i].y - VEHICLE_SIZE / 2, 
-                VEHICLE_LENGTH,
-                VEHICLE_SIZE
-            };
+// Copy the run in the globals into state, or the other way. The counts go first, so the
+// arrays after them are copied over the same length either way.
+static void moveRun(RunState* state, bool save) {
+    moveRunPart(&state->numJunctions, &numJunctions, sizeof(int), save);
+    moveRunPart(&state->numDetectors, &numDetectors, sizeof(int), save);
+    moveRunPart(&state->numCorridors, &numCorridors, sizeof(int), save);
+    moveRunPart(&state->numScenarioEntries, &numScenarioEntries, sizeof(int), save);
+    moveRunPart(&state->vehicleCapacity, &vehicleCapacity, sizeof(int), save);
+    int groups = numJunctions * LANE_GROUPS_PER_JUNCTION;
+
+    moveRunPart(&state->arena, &runArena, sizeof(Arena), save);
+    moveRunPart(state->vehicleChunks, vehicleChunks, sizeof(Vehicle*) * (vehicleCapacity / VEHICLE_CHUNK), save);
+    moveRunPart(&state->vehicleSpan, &vehicleSpan, sizeof(int), save);
+    moveRunPart(&state->nextFreeVehicle, &nextFreeVehicle, sizeof(int), save);
+    moveRunPart(state->junctions, junctions, sizeof(Junction) * numJunctions, save);
+    moveRunPart(state->signalTimings, signalTimings, sizeof(SignalTiming) * numJunctions, save);
+    moveRunPart(&state->actuatedControl, &actuatedControl, sizeof(bool), save);
+    moveRunPart(state->detectors, detectors, sizeof(Detector) * numDetectors, save);
+    moveRunPart(state->detectorStart, detectorStart, sizeof(int) * (groups + 1), save);
+    moveRunPart(state->detectorFeeds, detectorFeeds, sizeof(DetectorFeed) * numJunctions, save);
+    moveRunPart(state->lastDischargeTick, lastDischargeTick, sizeof(Uint64) * groups, save);
+    moveRunPart(&state->worldMinX, &worldMinX, sizeof(int), save);
+    moveRunPart(&state->worldMinY, &worldMinY, sizeof(int), save);
+    moveRunPart(&state->worldMaxX, &worldMaxX, sizeof(int), save);
+    moveRunPart(&state->worldMaxY, &worldMaxY, sizeof(int), save);
+    moveRunPart(state->builtQueues, builtQueues, sizeof(builtQueues[0]) * numJunctions, save);
+    moveRunPart(state->corridors, corridors, sizeof(Corridor) * numCorridors, save);
+    moveRunPart(&state->coordination, &coordination, sizeof(CoordinationState), save);
+    moveRunPart(state->spawnQueues, spawnQueues, sizeof(SpawnQueue) * groups, save);
+    moveRunPart(&state->laneStore, &laneStore, sizeof(LaneStore), save);
+    moveRunPart(state->laneViews, laneViews, sizeof(LaneView) * groups, save);
+    moveRunPart(&state->laneOrder, &laneOrder, sizeof(int*), save);
+    moveRunPart(&state->laneOrderCount, &laneOrderCount, sizeof(int), save);
+    moveRunPart(&state->laneViewStamp, &laneViewStamp, sizeof(Uint64*), save);
+    moveRunPart(&state->laneViewGeneration, &laneViewGeneration, sizeof(Uint64), save);
+    moveRunPart(&state->laneGroupOf, &laneGroupOf, sizeof(int*), save);
+    moveRunPart(&state->laneCandidates, &laneCandidates, sizeof(int*), save);
+    moveRunPart(&state->turningVehicles, &turningVehicles, sizeof(int*), save);
+    moveRunPart(state->turningStart, turningStart, sizeof(int) * (numJunctions + 1), save);
+    moveRunPart(&state->spatialStart, &spatialStart, sizeof(int*), save);
+    moveRunPart(&state->spatialVehicle, &spatialVehicle, sizeof(int*), save);
+    moveRunPart(&state->spatialX, &spatialX, sizeof(float*), save);
+    moveRunPart(&state->spatialY, &spatialY, sizeof(float*), save);
+    moveRunPart(&state->spatialBucketOf, &spatialBucketOf, sizeof(int*), save);
+    moveRunPart(&state->spatialBuckets, &spatialBuckets, sizeof(int), save);
+    moveRunPart(&state->spatialCount, &spatialCount, sizeof(int), save);
+    moveRunPart(&state->laneStoreCapacity, &laneStoreCapacity, sizeof(int), save);
+    moveRunPart(state->laneQueueEntry, laneQueueEntry, sizeof(float) * groups, save);
+    moveRunPart(state->scenarioEntries, scenarioEntries, sizeof(int) * numScenarioEntries, save);
+    if (save) {
+        state->simTick = atomic_load(&simTick);
+        state->rngState = atomic_load(&rngState);
+    } else {
+        atomic_store(&simTick, state->simTick);
+        atomic_store(&rngState, state->rngState);
+    }
+}
 
-            carWindow = (SDL_Rect){
-                vehicles[i].x - VEHICLE_LENGTH / 4, 
-                vehicles[i].y - VEHICLE_SIZE / 4, 
-                VEHICLE_LENGTH / 2,
-                VEHICLE_SIZE / 2
-            };
+// Put env's run in the globals
+static void activateEnv(TrafficEnv* env) {
+    if (env == activeEnv) return;
+    if (activeEnv) {
+        moveRun(&activeEnv->run, true);
+    } else {
+        releaseArena(&runArena); // A run from before the first environment has no owner to go back to
+    }
+    moveRun(&env->run, false);
+    activeEnv = env;
+}
 
-            carWheel1 = (SDL_Rect){
-                vehicles[i].x - VEHICLE_LENGTH / 2 + 5, 
-                vehicles[i].y - VEHICLE_SIZE / 2 - 5, 
-                10, 
-                10
-            };
+// Claim the globals for a call on env and put its run there; false, having changed
+// nothing, while another call holds them. leaveEnv() gives them back.
+static bool enterEnv(TrafficEnv* env, const char* call) {
+    if (atomic_exchange_explicit(&envCallRunning, true, memory_order_acquire)) {
+        SDL_Log("%s called during another environment call; environments take one call at a time", call);
+        return false;
+    }
+    activateEnv(env);
+    return true;
+}
 
-            carWheel2 = (SDL_Rect){
-                vehicles[i].x + VEHICLE_LENGTH / 2 - 15, 
-                vehicles[i].y - VEHICLE_SIZE / 2 - 5, 
-                10, 
-                10
-            };
+static void leaveEnv() {
+    atomic_store_explicit(&envCallRunning, false, memory_order_release);
+}
 
-            carWheel3 = (SDL_Rect){
-                vehicles[i].x - VEHICLE_LENGTH / 2 + 5, 
-                vehicles[i].y + VEHICLE_SIZE / 2 - 5, 
-                10, 
-                10
-            };
+int32_t envApiVersion(void) {
+    return TRAFFIC_ENV_API_VERSION;
+}
 
-            carWheel4 = (SDL_Rect){
-                vehicles[i].x + VEHICLE_LENGTH / 2 - 15, 
-                vehicles[i].y + VEHICLE_SIZE / 2 - 5, 
-                10, 
-                10
-            };
-        } else {  
-            // Vehicles moving vertically (up/down)
-            carBody = (SDL_Rect){
-                vehicles[i].x - VEHICLE_SIZE / 2 + 5, 
-                vehicles[i].y - VEHICLE_LENGTH / 2, 
-                VEHICLE_SIZE,
-                VEHICLE_LENGTH
-            };
+int32_t envOpen(int32_t threads) {
+    if (!initLocks()) {
+        SDL_Log("Failed to create mutex: %s", SDL_GetError());
+        destroyLocks();
+        return -1;
+    }
+    pacedTicks = false;
+    logEvents = false;
+    initTurnPaths();
+    initWorkerPool(threads);
+    return 0;
+}
 
-            carWindow = (SDL_Rect){
-                vehicles[i].x - VEHICLE_SIZE / 4 + 5, 
-                vehicles[i].y - VEHICLE_LENGTH / 4, 
-                VEHICLE_SIZE / 2,
-                VEHICLE_LENGTH / 2
-            };
+void envClose(void) {
+    shutdownWorkerPool();
+    destroyLocks();
+}
 
-            carWheel1 = (SDL_Rect){
-                vehicles[i].x - VEHICLE_SIZE / 2 , 
-                vehicles[i].y - VEHICLE_LENGTH / 2 + 5, 
-                10, 
-                10
-            };
+TrafficEnv* envCreate(void) {
+    TrafficEnv* env = SDL_calloc(1, sizeof(TrafficEnv)); // An empty run: no network, no vehicles
+    if (!env) SDL_Log("Out of memory creating an environment");
+    return env;
+}
 
-            carWheel2 = (SDL_Rect){
-                vehicles[i].x + VEHICLE_SIZE / 2 , 
-                vehicles[i].y - VEHICLE_LENGTH / 2 + 5, 
-                10, 
-                10
-            };
+int32_t envDestroy(TrafficEnv* env) {
+    if (!env) return 0;
+    if (atomic_exchange_explicit(&envCallRunning, true, memory_order_acquire)) {
+        SDL_Log("envDestroy called during another environment call; environments take one call at a time");
+        return -1;
+    }
+    if (env == activeEnv) {
+        releaseArena(&runArena);
+        activeEnv = NULL;
+    } else {
+        releaseArena(&env->run.arena);
+    }
+    SDL_free(env);
+    leaveEnv();
+    return 0;
+}
 
-            carWheel3 = (SDL_Rect){
-                vehicles[i].x - VEHICLE_SIZE / 2 , 
-                vehicles[i].y + VEHICLE_LENGTH / 2 - 15, 
-                10, 
-                10
-            };
+int32_t envReset(TrafficEnv* env, uint64_t seed, const char* scenario) {
+    const Scenario* found = NULL;
+    for (size_t k = 0; k < sizeof(scenarios) / sizeof(scenarios[0]); k++) {
+        if (strcmp(scenarios[k].name, scenario) == 0) found = &scenarios[k];
+    }
+    if (!found) {
+        SDL_Log("Unknown scenario: %s", scenario);
+        return -1;
+    }
+    if (!enterEnv(env, "envReset")) return -1;
+    env->scenario = found;
+    startScenario(found, seed);
+    actuatedControl = false;
+    coordination.enabled = false;
+    env->endTick = (Uint64)(found->simSeconds * 1000 / TICK_MS);
+    int count = numJunctions;
+    leaveEnv();
+    return count;
+}
 
-            carWheel4 = (SDL_Rect){
-                vehicles[i].x + VEHICLE_SIZE / 2 , 
-                vehicles[i].y + VEHICLE_LENGTH / 2 - 15, 
-                10, 
-                10
-            };
+int32_t envObserve(TrafficEnv* env, EnvJunctionObservation* observations, int32_t capacity, float* simSeconds) {
+    if (!enterEnv(env, "envObserve")) return -1;
+    for (int j = 0; j < numJunctions && j < capacity; j++) {
+        EnvJunctionObservation* observation = &observations[j];
+        for (int l = 0; l < NUM_LANES; l++) {
+            const TrafficQueue* queue = &builtQueues[j][l];
+            observation->queueLengths[l] = queue->size;
+            observation->waitTimes[l] = queue->size > 0 ?
+                (simTick - getVehicle(queue->vehicleIndices[queue->front])->queuedTick) * TICK_MS / 1000.0f : 0;
         }
+        SignalPhase phase;
+        readSignalPhase(&junctions[j], &phase);
+        observation->phase = phase.requestedMask == actuatedPhaseMasks[0] ? 0 :
+                             phase.requestedMask == actuatedPhaseMasks[1] ? 1 : -1;
+        observation->greenMask = phase.greenMask;
+        observation->yellowMask = phase.yellowMask;
+        observation->phaseAge = (simTick - phase.startTick) * TICK_MS / 1000.0f;
+    }
+    if (simSeconds) *simSeconds = simTick * TICK_MS / 1000.0f;
+    int count = numJunctions;
+    leaveEnv();
+    return count;
+}
 
-        // Draw car body with rounded corners
-        drawRoundedRect(renderer, &carBody, 10);
+// The lights get to the asked-for phase through yellow and all-red on the junction's timing
+float envStep(TrafficEnv* env, const int32_t* actions, int32_t numActions, int32_t numTicks, int32_t* done) {
+    if (!enterEnv(env, "envStep")) return NAN;
+    for (int j = 0; actions && j < numActions && j < numJunctions; j++) {
+        if (actions[j] == 0 || actions[j] == 1) requestSignalPhase(&junctions[j], actuatedPhaseMasks[actions[j]], 0);
+    }
+    float reward = 0;
+    for (int t = 0; t < numTicks && simTick < env->endTick; t++) {
+        spawnScenarioArrivals(env->scenario);
+        updateVehicles();
+        int queued = 0;
+        for (int j = 0; j < numJunctions; j++) {
+            for (int l = 0; l < NUM_LANES; l++) {
+                queued += builtQueues[j][l].size;
+            }
+        }
+        reward -= queued * TICK_MS / 1000.0f;
+    }
+    updateTrafficQueues();
+    if (done) *done = simTick >= env->endTick;
+    leaveEnv();
+    return reward;
+}
 
-        // Draw car window with rounded corners
-        SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255); // Light gray for windows
-        drawRoundedRect(renderer, &carWindow, 5);
+// A peak-hour episode stepped a second at a time, switching phase every ENV_BENCH_SWITCH_STEPS
+int benchEnvSteps;
 
-        // Draw car wheels
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Black for wheels
-        SDL_RenderFillRect(renderer, &carWheel1);
-        SDL_RenderFillRect(renderer, &carWheel2);
-        SDL_RenderFillRect(renderer, &carWheel3);
-        SDL_RenderFillRect(renderer, &carWheel4);
+void resetBenchEnv() {
+    if (!benchEnv) benchEnv = envCreate();
+    envReset(benchEnv, 2, "peak-hour");
+    benchEnvSteps = 0;
+}
+
+void benchEnvStep() {
+    int32_t actions[MAX_JUNCTIONS];
+    for (int j = 0; j < numJunctions; j++) {
+        actions[j] = (benchEnvSteps / ENV_BENCH_SWITCH_STEPS + j) % 2;
     }
-    SDL_UnlockMutex(vehicleMutex);
+    int32_t done;
+    benchSink = (int)envStep(benchEnv, actions, numJunctions, 1000 / TICK_MS, &done);
+    benchEnvSteps++;
 }
 
-void* readAndParseFile(void* arg) {
-    printf("Reading vehicle data...\n");
-    while(1) {
-        FILE* file = fopen("vehicles.data", "r");
-        if (!file) {
-            perror("Error opening file");
-            sleep(1);
-            continue;
-        }
+// Prometheus text exposition of the live counters, for --metrics
+void appendMetrics(char* body, size_t size, size_t* length, const char* format, ...) {
+    if (*length + 1 >= size) return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(body + *length, size - *length, format, args);
+    va_end(args);
+    if (written > 0) *length += (size_t)written < size - *length ? (size_t)written : size - *length - 1;
+}
 
-        char line[20];
-        while (fgets(line, sizeof(line), file)) {
-            line[strcspn(line, "\n")] = 0;
-            char* vehicleNumber = strtok(line, ":");
-            char* lane = strtok(NULL, ":");
-            char* sublane = strtok(NULL, ":");
-
-            if (vehicleNumber && lane && sublane) {
-                printf("Read vehicle: %s, Lane: %s, Sublane: %s\n", vehicleNumber, lane, sublane);
-                spawnVehicle(vehicleNumber, lane[0], atoi(sublane));
+size_t formatMetrics(char* body, size_t size) {
+    size_t length = 0;
+    int count = atomic_load_explicit(&metrics.junctions, memory_order_acquire);
+    Uint64 tick = atomic_load_explicit(&metrics.simTick, memory_order_relaxed);
+
+    appendMetrics(body, size, &length, "# HELP traffic_sim_time_seconds Simulated time since the run started\n"
+                  "# TYPE traffic_sim_time_seconds gauge\ntraffic_sim_time_seconds %.3f\n", tick * TICK_MS / 1000.0);
+    appendMetrics(body, size, &length, "# HELP traffic_vehicles_active Vehicles on the network\n"
+                  "# TYPE traffic_vehicles_active gauge\ntraffic_vehicles_active %d\n",
+                  atomic_load_explicit(&metrics.activeVehicles, memory_order_relaxed));
+    appendMetrics(body, size, &length, "# HELP traffic_spawns_total Vehicles admitted at the network edge\n"
+                  "# TYPE traffic_spawns_total counter\ntraffic_spawns_total %llu\n",
+                  (unsigned long long)atomic_load_explicit(&metrics.spawns, memory_order_relaxed));
+    appendMetrics(body, size, &length, "# HELP traffic_discharges_total Vehicles that crossed a stop line\n"
+                  "# TYPE traffic_discharges_total counter\ntraffic_discharges_total %llu\n",
+                  (unsigned long long)atomic_load_explicit(&metrics.discharges, memory_order_relaxed));
+    appendMetrics(body, size, &length, "# HELP traffic_conflict_wait_seconds_total Time vehicles waited at a path entry for conflict cells\n"
+                  "# TYPE traffic_conflict_wait_seconds_total counter\ntraffic_conflict_wait_seconds_total %.3f\n",
+                  atomic_load_explicit(&metrics.conflictWaits, memory_order_relaxed) * TICK_MS / 1000.0);
+
+    appendMetrics(body, size, &length, "# HELP traffic_dropped_spawns_total Spawn requests refused for lack of room\n"
+                  "# TYPE traffic_dropped_spawns_total counter\ntraffic_dropped_spawns_total %llu\n",
+                  (unsigned long long)atomic_load_explicit(&droppedSpawns, memory_order_relaxed));
+    appendMetrics(body, size, &length, "# HELP traffic_dropped_queue_entries_total Vehicles left out of a full lane queue\n"
+                  "# TYPE traffic_dropped_queue_entries_total counter\ntraffic_dropped_queue_entries_total %llu\n",
+                  (unsigned long long)atomic_load_explicit(&droppedQueueEntries, memory_order_relaxed));
+
+    appendMetrics(body, size, &length, "# HELP traffic_queue_length Vehicles queued on an approach\n"
+                  "# TYPE traffic_queue_length gauge\n");
+    for (int j = 0; j < count; j++) {
+        int id = atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed);
+        for (int l = 0; l < NUM_LANES; l++) {
+            appendMetrics(body, size, &length, "traffic_queue_length{junction=\"%d\",lane=\"%c\"} %d\n", id, 'A' + l,
+                          atomic_load_explicit(&metrics.queueLengths[j][l], memory_order_relaxed));
+        }
+    }
+    // Loops are numbered within their junction, in lane group order
+    int numLoops = atomic_load_explicit(&metrics.detectors, memory_order_relaxed);
+    for (int series = 0; series < 2; series++) {
+        appendMetrics(body, size, &length, series == 0 ?
+                      "# HELP traffic_detector_vehicles_total Vehicles that drove onto a loop detector\n"
+                      "# TYPE traffic_detector_vehicles_total counter\n" :
+                      "# HELP traffic_detector_occupied_seconds_total Simulated time a loop detector was occupied\n"
+                      "# TYPE traffic_detector_occupied_seconds_total counter\n");
+        int junction = -1, loop = 0;
+        for (int d = 0; d < numLoops; d++) {
+            int key = atomic_load_explicit(&metrics.detectorKeys[d], memory_order_relaxed);
+            int group = key / NUM_DETECTOR_TYPES;
+            if (group / LANE_GROUPS_PER_JUNCTION >= count) continue;
+            loop = group / LANE_GROUPS_PER_JUNCTION == junction ? loop + 1 : 0;
+            junction = group / LANE_GROUPS_PER_JUNCTION;
+            int id = atomic_load_explicit(&metrics.junctionIds[junction], memory_order_relaxed);
+            char lane = 'A' + (group % LANE_GROUPS_PER_JUNCTION) / 3;
+            const char* kind = key % NUM_DETECTOR_TYPES == DETECTOR_PRESENCE ? "presence" : "count";
+            if (series == 0) {
+                appendMetrics(body, size, &length, "traffic_detector_vehicles_total{junction=\"%d\",lane=\"%c%d\",loop=\"%d\",kind=\"%s\"} %llu\n",
+                              id, lane, group % 3 + 1, loop, kind,
+                              (unsigned long long)atomic_load_explicit(&metrics.detectorCounts[d], memory_order_relaxed));
+            } else {
+                appendMetrics(body, size, &length, "traffic_detector_occupied_seconds_total{junction=\"%d\",lane=\"%c%d\",loop=\"%d\",kind=\"%s\"} %.3f\n",
+                              id, lane, group % 3 + 1, loop, kind,
+                              atomic_load_explicit(&metrics.detectorOnTicks[d], memory_order_relaxed) * TICK_MS / 1000.0);
             }
         }
-        fclose(file);
-        sleep(1);
     }
+    appendMetrics(body, size, &length, "# HELP traffic_detector_events_dropped_total Loop events lost to a controller falling behind\n"
+                  "# TYPE traffic_detector_events_dropped_total counter\ntraffic_detector_events_dropped_total %llu\n",
+                  (unsigned long long)atomic_load_explicit(&droppedDetectorEvents, memory_order_relaxed));
+    appendMetrics(body, size, &length, "# HELP traffic_light_green 1 while the approach has a green light\n"
+                  "# TYPE traffic_light_green gauge\n");
+    for (int j = 0; j < count; j++) {
+        int id = atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed);
+        Uint32 mask = atomic_load_explicit(&metrics.greenMasks[j], memory_order_relaxed);
+        for (int l = 0; l < NUM_LANES; l++) {
+            appendMetrics(body, size, &length, "traffic_light_green{junction=\"%d\",lane=\"%c\"} %u\n", id, 'A' + l, (mask >> l) & 1);
+        }
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_light_yellow 1 while the approach has a yellow light\n"
+                  "# TYPE traffic_light_yellow gauge\n");
+    for (int j = 0; j < count; j++) {
+        int id = atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed);
+        Uint32 mask = atomic_load_explicit(&metrics.yellowMasks[j], memory_order_relaxed);
+        for (int l = 0; l < NUM_LANES; l++) {
+            appendMetrics(body, size, &length, "traffic_light_yellow{junction=\"%d\",lane=\"%c\"} %u\n", id, 'A' + l, (mask >> l) & 1);
+        }
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_light_phase_changes_total Changes of the lights at the junction, yellow and all-red included\n"
+                  "# TYPE traffic_light_phase_changes_total counter\n");
+    for (int j = 0; j < count; j++) {
+        appendMetrics(body, size, &length, "traffic_light_phase_changes_total{junction=\"%d\"} %u\n",
+                      atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed),
+                      atomic_load_explicit(&metrics.phaseIds[j], memory_order_relaxed));
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_light_phase_age_seconds Simulated time in the current phase\n"
+                  "# TYPE traffic_light_phase_age_seconds gauge\n");
+    for (int j = 0; j < count; j++) {
+        Uint64 start = atomic_load_explicit(&metrics.phaseStartTicks[j], memory_order_relaxed);
+        appendMetrics(body, size, &length, "traffic_light_phase_age_seconds{junction=\"%d\"} %.3f\n",
+                      atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed),
+                      tick > start ? (tick - start) * TICK_MS / 1000.0 : 0.0);
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_green_terminations_total Actuated greens ended by a gap in traffic or by max green\n"
+                  "# TYPE traffic_green_terminations_total counter\n");
+    for (int j = 0; j < count; j++) {
+        int id = atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed);
+        appendMetrics(body, size, &length, "traffic_green_terminations_total{junction=\"%d\",reason=\"gap\"} %llu\n"
+                      "traffic_green_terminations_total{junction=\"%d\",reason=\"max\"} %llu\n",
+                      id, (unsigned long long)atomic_load_explicit(&metrics.gapOuts[j], memory_order_relaxed),
+                      id, (unsigned long long)atomic_load_explicit(&metrics.maxOuts[j], memory_order_relaxed));
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_green_changes_total Changes of green cleared through yellow and all-red\n"
+                  "# TYPE traffic_green_changes_total counter\n");
+    for (int j = 0; j < count; j++) {
+        appendMetrics(body, size, &length, "traffic_green_changes_total{junction=\"%d\"} %llu\n",
+                      atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed),
+                      (unsigned long long)atomic_load_explicit(&metrics.greenChanges[j], memory_order_relaxed));
+    }
+    appendMetrics(body, size, &length, "# HELP traffic_lost_time_seconds_total Simulated time no vehicle used a change of green, "
+                  "clearing the old green and starting the new one\n"
+                  "# TYPE traffic_lost_time_seconds_total counter\n");
+    for (int j = 0; j < count; j++) {
+        int id = atomic_load_explicit(&metrics.junctionIds[j], memory_order_relaxed);
+        appendMetrics(body, size, &length, "traffic_lost_time_seconds_total{junction=\"%d\",kind=\"clearance\"} %.3f\n"
+                      "traffic_lost_time_seconds_total{junction=\"%d\",kind=\"startup\"} %.3f\n",
+                      id, atomic_load_explicit(&metrics.clearanceLostTicks[j], memory_order_relaxed) * TICK_MS / 1000.0,
+                      id, atomic_load_explicit(&metrics.startupLostTicks[j], memory_order_relaxed) * TICK_MS / 1000.0);
+    }
+
+    // The top bucket also takes everything slower, so it becomes +Inf
+    Uint64 buckets[PROFILE_BUCKETS], ticks = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        buckets[b] = atomic_load_explicit(&metrics.tickBuckets[b], memory_order_relaxed);
+        ticks += buckets[b];
+    }
+    Uint32 maxTick = atomic_load_explicit(&metrics.maxTickMicros, memory_order_relaxed);
+    appendMetrics(body, size, &length, "# HELP traffic_tick_duration_seconds Wall time of one simulation tick\n"
+                  "# TYPE traffic_tick_duration_seconds histogram\n");
+    Uint64 cumulative = 0;
+    for (int b = 0; b < PROFILE_BUCKETS - 1; b++) {
+        cumulative += buckets[b];
+        appendMetrics(body, size, &length, "traffic_tick_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                      (1u << b) / 1e6, (unsigned long long)cumulative);
+    }
+    appendMetrics(body, size, &length, "traffic_tick_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                  "traffic_tick_duration_seconds_sum %.6f\ntraffic_tick_duration_seconds_count %llu\n",
+                  (unsigned long long)ticks, atomic_load_explicit(&metrics.tickMicros, memory_order_relaxed) / 1e6,
+                  (unsigned long long)ticks);
+    appendMetrics(body, size, &length, "# HELP traffic_tick_duration_quantile_seconds Tick time percentiles over the run\n"
+                  "# TYPE traffic_tick_duration_quantile_seconds gauge\n");
+    const float quantiles[] = {0.5f, 0.9f, 0.99f};
+    for (int q = 0; q < 3; q++) {
+        appendMetrics(body, size, &length, "traffic_tick_duration_quantile_seconds{quantile=\"%g\"} %g\n", quantiles[q],
+                      ticks > 0 ? getProfilePercentile(buckets, ticks, quantiles[q], maxTick) / 1e6 : 0.0);
+    }
+    return length;
+}
+
+#ifndef _WIN32
+int metricsSocket = -1;
+char metricsSocketPath[sizeof(((struct sockaddr_un*)0)->sun_path)]; // Removed again on exit
+
+// Listen on a loopback TCP port, or on a Unix socket for "unix:<path>" or an absolute path
+int openMetricsSocket(const char* address) {
+    int server;
+    if (strncmp(address, "unix:", 5) == 0 || address[0] == '/') {
+        const char* path = address[0] == '/' ? address : address + 5;
+        struct sockaddr_un local = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(local.sun_path)) {
+            SDL_Log("Metrics socket path is too long: %s", path);
+            return -1;
+        }
+        strcpy(local.sun_path, path);
+        struct stat existing;
+        if (stat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+            unlink(path); // Left behind by an earlier run
+        }
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0 || bind(server, (struct sockaddr*)&local, sizeof(local)) < 0 || listen(server, 8) < 0) {
+            perror("Error opening metrics socket");
+            if (server >= 0) close(server);
+            return -1;
+        }
+        strcpy(metricsSocketPath, path);
+    } else {
+        int port = atoi(address);
+        if (port <= 0 || port > 65535) {
+            SDL_Log("Invalid metrics port: %s", address);
+            return -1;
+        }
+        struct sockaddr_in local = { .sin_family = AF_INET, .sin_port = htons(port) };
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (server < 0 || setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+            bind(server, (struct sockaddr*)&local, sizeof(local)) < 0 || listen(server, 8) < 0) {
+            perror("Error opening metrics socket");
+            if (server >= 0) close(server);
+            return -1;
+        }
+    }
+    printf("Serving metrics on %s\n", address);
+    return server;
+}
+
+void closeMetricsSocket() {
+    if (metricsSocket < 0) return;
+    close(metricsSocket);
+    metricsSocket = -1;
+    if (metricsSocketPath[0]) unlink(metricsSocketPath);
+    metricsSocketPath[0] = '\0';
+}
+
+// Answer one scrape. A client gets a second to send its request and take the reply, so a
+// stalled scraper cannot hold up shutdown for longer than that.
+void answerMetricsRequest(int client) {
+    static char body[METRICS_BODY_SIZE];
+    char request[1024];
+    struct timeval timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ssize_t received = recv(client, request, sizeof(request) - 1, 0);
+    if (received <= 0) return;
+    request[received] = '\0';
+
+    char header[256];
+    size_t length = 0;
+    bool found = strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0;
+    if (found) {
+        length = formatMetrics(body, sizeof(body));
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", length);
+    } else {
+        snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    if (send(client, header, strlen(header), METRICS_SEND_FLAGS) < 0) return;
+    for (size_t sent = 0; sent < length;) {
+        ssize_t written = send(client, body + sent, length - sent, METRICS_SEND_FLAGS);
+        if (written <= 0) return;
+        sent += written;
+    }
+}
+
+// Serves scrapes one at a time; only reads the metrics atomics, so it never takes a lock
+// the simulation needs
+void* serveMetrics(void* arg) {
+    traceThreadName("metrics");
+    while (!isStopRequested()) {
+        struct pollfd ready = { metricsSocket, POLLIN, 0 };
+        if (poll(&ready, 1, METRICS_POLL_MS) <= 0) continue;
+        int client = accept(metricsSocket, NULL, NULL);
+        if (client < 0) continue;
+        answerMetricsRequest(client);
+        close(client);
+    }
+    return NULL;
+}
+#else
+int metricsSocket = -1;
+
+int openMetricsSocket(const char* address) {
+    SDL_Log("--metrics needs POSIX sockets, which this platform does not provide");
+    return -1;
+}
+
+void closeMetricsSocket() {
+}
+
+void* serveMetrics(void* arg) {
     return NULL;
 }
+#endif
 
 const SDL_Color WHITE = {255, 255, 255, 255};
 const SDL_Color GRAY = {30, 30, 30, 1};
@@ -994,14 +5658,118 @@ void* readAndParseFile(void* arg);
 void* mainLoop(void* arg);
 
 
+// Rolling timings of every section over the last PROFILE_WINDOW samples, with each
+// section's histogram drawn as bars from the fastest bucket on the left
+void drawProfileOverlay(SDL_Renderer* renderer, TTF_Font* font) {
+    static ProfileStats snapshot[NUM_PROFILE_SECTIONS];
+    pthread_mutex_lock(&profileMutex);
+    memcpy(snapshot, profile, sizeof(snapshot));
+    pthread_mutex_unlock(&profileMutex);
+
+    const int rowHeight = 18;
+    int lockRows = 0;
+    for (int site = 0; site < NUM_LOCK_SITES; site++) {
+        lockRows += atomic_load(&lockStats[site].acquisitions) > 0;
+    }
+    SDL_Rect panel = { 10, 10, 540, 30 + (NUM_PROFILE_SECTIONS + (lockRows ? lockRows + 1 : 0)) * rowHeight };
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 190);
+    SDL_RenderFillRect(renderer, &panel);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    if (font) {
+        displayText(renderer, font, "section", 20, 14);
+        displayText(renderer, font, "mean", 170, 14);
+        displayText(renderer, font, "p95", 250, 14);
+        displayText(renderer, font, "max ms", 330, 14);
+    }
+
+    for (int s = 0; s < NUM_PROFILE_SECTIONS; s++) {
+        const ProfileStats* stats = &snapshot[s];
+        int y = 32 + s * rowHeight;
+        Uint64 total = 0;
+        Uint32 max = 0;
+        for (int k = 0; k < stats->filled; k++) {
+            total += stats->window[k];
+            if (stats->window[k] > max) max = stats->window[k];
+        }
+
+        if (font) {
+            char text[32];
+            displayText(renderer, font, (char*)profileNames[s], 20, y);
+            snprintf(text, sizeof(text), "%.2f", stats->filled ? total / 1000.0 / stats->filled : 0.0);
+            displayText(renderer, font, text, 170, y);
+            snprintf(text, sizeof(text), "%.2f", stats->filled ? getProfilePercentile(stats->buckets, stats->filled, 0.95f, max) / 1000.0 : 0.0);
+            displayText(renderer, font, text, 250, y);
+            snprintf(text, sizeof(text), "%.2f", max / 1000.0);
+            displayText(renderer, font, text, 330, y);
+        }
+
+        // Bars over 1 us .. 32 ms, the frame budget bucket in red
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            int height = stats->filled ? (int)(stats->buckets[b] * (rowHeight - 4) / stats->filled) : 0;
+            if (stats->buckets[b] > 0 && height == 0) height = 1;
+            SDL_Rect bar = { 400 + b * 8, y + rowHeight - 2 - height, 6, height };
+            if ((1u << b) > TICK_MS * 1000) {
+                SDL_SetRenderDrawColor(renderer, 230, 80, 80, 255);
+            } else {
+                SDL_SetRenderDrawColor(renderer, 120, 200, 120, 255);
+            }
+            SDL_RenderFillRect(renderer, &bar);
+        }
+    }
+
+    // Lock call sites, since the start of the run
+    if (!font || lockRows == 0) return;
+    int y = 32 + NUM_PROFILE_SECTIONS * rowHeight;
+    displayText(renderer, font, "lock site", 20, y);
+    displayText(renderer, font, "wait avg", 250, y);
+    displayText(renderer, font, "wait max", 330, y);
+    displayText(renderer, font, "hold avg us", 410, y);
+    for (int site = 0; site < NUM_LOCK_SITES; site++) {
+        LockStats* stats = &lockStats[site];
+        Uint64 count = atomic_load(&stats->acquisitions);
+        if (count == 0) continue;
+        y += rowHeight;
+        char text[32];
+        displayText(renderer, font, (char*)lockSiteNames[site], 20, y);
+        snprintf(text, sizeof(text), "%.1f", (double)atomic_load(&stats->waitMicros) / count);
+        displayText(renderer, font, text, 250, y);
+        snprintf(text, sizeof(text), "%u", atomic_load(&stats->maxWaitMicros));
+        displayText(renderer, font, text, 330, y);
+        snprintf(text, sizeof(text), "%.1f", (double)atomic_load(&stats->holdMicros) / count);
+        displayText(renderer, font, text, 410, y);
+    }
+}
+
 void printMessageHelper(const char* message, int count) {
     for (int i = 0; i < count; i++) printf("%s\n", message);
 }
+#ifndef TRAFFIC_ENV_LIBRARY // Built as a library for the environment API, see envOpen()
 int main(int argc, char *argv[]) {
-    pthread_t vehicleThread, trafficThread, fileThread;
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;
     TTF_Font* font = NULL;
+
+    // Headless runs that exit when done: --bench [name] for the microbenchmarks, --scenarios
+    // [name] for the scenario benchmarks with --json <file>, --baseline <file> and
+    // --tolerance <fraction>. --threads applies to both.
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 || strcmp(argv[i], "--scenarios") == 0) {
+            const char* filter = i + 1 < argc && argv[i + 1][0] != '-' ? argv[i + 1] : NULL;
+            const char* jsonPath = NULL;
+            const char* baselinePath = NULL;
+            float tolerance = SCENARIO_TOLERANCE;
+            int threads = 1;
+            for (int k = 1; k + 1 < argc; k++) {
+                if (strcmp(argv[k], "--threads") == 0) threads = atoi(argv[k + 1]);
+                if (strcmp(argv[k], "--json") == 0) jsonPath = argv[k + 1];
+                if (strcmp(argv[k], "--baseline") == 0) baselinePath = argv[k + 1];
+                if (strcmp(argv[k], "--tolerance") == 0) tolerance = strtof(argv[k + 1], NULL);
+            }
+            if (strcmp(argv[i], "--bench") == 0) return runBenchmarks(filter, threads);
+            return runScenarioBenchmarks(filter, threads, jsonPath, baselinePath, tolerance);
+        }
+    }
     
     // Initialize SDL and create window and renderer
     if (!initializeSDL(&window, &renderer)) {
@@ -1019,10 +5787,10 @@ int main(int argc, char *argv[]) {
         return -1;
     }
     
-    // Initialize vehicle system and mutex
-    vehicleMutex = SDL_CreateMutex();
-    if (!vehicleMutex) {
+    // Initialize the locks shared with the generator, file and controller threads
+    if (!initLocks() || !initRunControl()) {
         SDL_Log("Failed to create mutex: %s", SDL_GetError());
+        destroyLocks();
         TTF_CloseFont(font);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
@@ -1031,13 +5799,86 @@ int main(int argc, char *argv[]) {
         return -1;
     }
     
-    initVehicles();
+    // Optional: --network <file> loads a road network, --restore <file> resumes from a
+    // checkpoint, --seed <n> forks its random stream, --threads <n> sets the step workers,
+    // --uncoordinated leaves every junction to its own adaptive controller, --actuated puts
+    // the junctions off the corridor plans on the actuated controller, --trace <file>
+    // records a Chrome trace of the run, --metrics <port|unix:path> serves live metrics,
+    // --telemetry <file> streams per-tick samples, one tick in --telemetry-every <n>,
+    // --max-vehicles <n> and --max-queue <n> cap the vehicle pool and each lane queue
+    int threads = 0;
+    int telemetryEvery = 1;
+    const char* networkPath = NETWORK_FILE;
+    const char* restorePath = NULL;
+    const char* tracePath = NULL;
+    const char* metricsAddress = NULL;
+    const char* telemetryPath = NULL;
+    bool seedGiven = false;
+    Uint64 seed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--network") == 0 && i + 1 < argc) {
+            networkPath = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restorePath = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+            seedGiven = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--uncoordinated") == 0) {
+            coordination.enabled = false;
+        } else if (strcmp(argv[i], "--actuated") == 0) {
+            actuatedControl = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metricsAddress = argv[++i];
+        } else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            telemetryPath = argv[++i];
+        } else if (strcmp(argv[i], "--telemetry-every") == 0 && i + 1 < argc) {
+            telemetryEvery = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-vehicles") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[++i]);
+            if (limit > 0 && limit < vehicleLimit) vehicleLimit = limit;
+            limitsConfigured = true;
+        } else if (strcmp(argv[i], "--max-queue") == 0 && i + 1 < argc) {
+            queueLimit = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 0;
+            limitsConfigured = true;
+        }
+    }
+
+    loadNetwork(networkPath);
+    buildCorridors();
+    buildDetectors();
+    moveCamera(0, 0);
+    resetRun(vehicleLimit < MAX_VEHICLE_CHUNKS * VEHICLE_CHUNK ? vehicleLimit : VEHICLE_CHUNK);
     initTrafficLights();
+    initTurnPaths();
+    seedRandom((Uint64)time(NULL));
+
+    if (restorePath && !loadCheckpoint(restorePath)) {
+        SDL_Log("Starting from an empty junction");
+    }
+    if (seedGiven) {
+        seedRandom(seed);
+    }
+    if (tracePath) {
+        traceOrigin = SDL_GetPerformanceCounter();
+        tracing = true;
+        traceThreadName("simulation");
+    }
+    initWorkerPool(threads);
+    profiling = true; // Before any thread that reads it starts
     
     // Create threads
-    if (pthread_create(&vehicleThread, NULL, generateVehicles, NULL) != 0) {
-        SDL_Log("Failed to create vehicle thread");
-        SDL_DestroyMutex(vehicleMutex);
+    if (!startRunThread("vehicle generator", generateVehicles) ||
+        !startRunThread("traffic light", updateTrafficLightsAdvanced) ||
+        !startRunThread("file parsing", readAndParseFile)) {
+        // Stop whichever threads did start
+        stopRunThreads();
+        shutdownWorkerPool();
+        destroyRunControl();
+        destroyLocks();
         TTF_CloseFont(font);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
@@ -1045,70 +5886,103 @@ int main(int argc, char *argv[]) {
         SDL_Quit();
         return -1;
     }
-    
-    if (pthread_create(&trafficThread, NULL, updateTrafficLightsAdvanced, NULL) != 0) {
-        SDL_Log("Failed to create traffic light thread");
-        // Cancel the vehicle thread
-        pthread_cancel(vehicleThread);
-        SDL_DestroyMutex(vehicleMutex);
-        TTF_CloseFont(font);
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        TTF_Quit();
-        SDL_Quit();
-        return -1;
+
+    // The simulation runs on without the endpoint if it cannot be opened
+    if (metricsAddress) {
+        metricsSocket = openMetricsSocket(metricsAddress);
+        metricsEnabled = metricsSocket >= 0 && startRunThread("metrics", serveMetrics);
+        if (!metricsEnabled) closeMetricsSocket();
     }
-    
-    if (pthread_create(&fileThread, NULL, readAndParseFile, NULL) != 0) {
-        SDL_Log("Failed to create file parsing thread");
-        // Cancel the other threads
-        pthread_cancel(vehicleThread);
-        pthread_cancel(trafficThread);
-        SDL_DestroyMutex(vehicleMutex);
-        TTF_CloseFont(font);
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        TTF_Quit();
-        SDL_Quit();
-        return -1;
+    if (telemetryPath && openTelemetry(telemetryPath, telemetryEvery)) {
+        telemetryEnabled = startRunThread("telemetry", writeTelemetry);
+        if (!telemetryEnabled) closeTelemetry(telemetryPath);
     }
     
     // Main application loop
     bool running = true;
     Uint32 lastFrameTime = SDL_GetTicks();
+    TTF_Font* profileFont = TTF_OpenFont(MAIN_FONT, 14);
     
     while (running) {
         // Handle SDL events
+        Uint64 profileStart = profileBegin();
+        Uint64 frameStart = profileStart;
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 running = false;
             }
+            // F5 saves the world, F9 restores the last save
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5) {
+                saveCheckpoint(CHECKPOINT_FILE);
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F9) {
+                loadCheckpoint(CHECKPOINT_FILE);
+            }
+            // F3 shows where each frame's time goes
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F3) {
+                showProfile = !showProfile;
+            }
+            // A click prints the vehicle under the mouse
+            if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
+                int i = findNearestVehicle(event.button.x + cameraX, event.button.y + cameraY, VEHICLE_LENGTH / 2);
+                if (i >= 0) {
+                    Vehicle* v = getVehicle(i);
+                    printf("Vehicle %s in slot %d: junction %d lane %c%d, %.0f px/s, waited %.1f s\n", v->id, i,
+                           junctions[v->junction].id, v->lane, v->sublane, v->speed, v->waitTime);
+                }
+            }
+            // Arrow keys pan across a network larger than the window
+            if (event.type == SDL_KEYDOWN) {
+                switch (event.key.keysym.sym) {
+                    case SDLK_LEFT:  moveCamera(-40, 0); break;
+                    case SDLK_RIGHT: moveCamera(40, 0);  break;
+                    case SDLK_UP:    moveCamera(0, -40); break;
+                    case SDLK_DOWN:  moveCamera(0, 40);  break;
+                }
+            }
             // Add any other event handling here as needed
         }
+        profileEnd(PROF_EVENTS, profileStart);
         
         // Calculate delta time
         Uint32 currentTime = SDL_GetTicks();
         float deltaTime = (currentTime - lastFrameTime) / 1000.0f;
         lastFrameTime = currentTime;
+        if (profiling) recordProfile(PROF_INTERVAL, (Uint32)(deltaTime * 1000000));
         
         // Update simulation
         updateVehicles();
+        profileStart = profileBegin();
         updateTrafficQueues();
+        profileEnd(PROF_QUEUES, profileStart);
         
         // Render frame
         SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
         SDL_RenderClear(renderer);
         
+        profileStart = profileBegin();
         drawRoadsAndLane(renderer, font);
+        profileEnd(PROF_DRAW_ROADS, profileStart);
+        profileStart = profileBegin();
         drawTrafficLights(renderer);
+        profileEnd(PROF_DRAW_LIGHTS, profileStart);
+        profileStart = profileBegin();
         drawVehicles(renderer);
+        profileEnd(PROF_DRAW_VEHICLES, profileStart);
+        profileStart = profileBegin();
         drawQueueVisualization(renderer);
+        profileEnd(PROF_DRAW_QUEUES, profileStart);
+        if (showProfile) {
+            drawProfileOverlay(renderer, profileFont ? profileFont : font);
+        }
         
+        profileStart = profileBegin();
         SDL_RenderPresent(renderer);
+        profileEnd(PROF_PRESENT, profileStart);
         
         // Cap the frame rate
-        Uint32 frameTime = SDL_GetTicks() - currentTime;
+        profileEnd(PROF_FRAME, frameStart);
         Uint32 targetFrameTime = 16; // 60 FPS
         Uint32 frameEndTime = SDL_GetTicks();
         if (frameEndTime - currentTime < targetFrameTime) {
@@ -1117,12 +5991,20 @@ int main(int argc, char *argv[]) {
         
     }
     
-    // Cleanup and shutdown
-    pthread_cancel(vehicleThread);
-    pthread_cancel(trafficThread);
-    pthread_cancel(fileThread);
+    // Cleanup and shutdown: every thread leaves at a safe point before its locks go away
+    stopRunThreads();
+    closeMetricsSocket();
+    if (telemetryPath) closeTelemetry(telemetryPath);
+    shutdownWorkerPool();
+    printProfile();
+    printLockStats();
+    printDrops();
+    if (tracePath) writeTrace(tracePath);
+    releaseArena(&runArena);
     
-    SDL_DestroyMutex(vehicleMutex);
+    destroyRunControl();
+    destroyLocks();
+    if (profileFont) TTF_CloseFont(profileFont);
     TTF_CloseFont(font);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
@@ -1131,13 +6013,14 @@ int main(int argc, char *argv[]) {
     
     return 0;
 }
+#endif
 
 // Modified main loop
 void* mainLoop(void* arg) {
     SDL_Renderer* renderer = (SDL_Renderer*)arg;
     Uint32 lastFrame = SDL_GetTicks();
 
-    while (1) {
+    while (!isStopRequested()) {
         Uint32 currentFrame = SDL_GetTicks();
         float deltaTime = (currentFrame - lastFrame) / 1000.0f;
         lastFrame = currentFrame;
@@ -1238,56 +6121,72 @@ void drawArrwow(SDL_Renderer* renderer, int x1, int y1, int x2, int y2, int x3,
 
 
 void drawRoadsAndLane(SDL_Renderer *renderer, TTF_Font *font) {
-    // Set road color
-    SDL_SetRenderDrawColor(renderer, GRAY.r, GRAY.g, GRAY.b, GRAY.a);
-
-    // Draw intersection
-    SDL_Rect intersection = {
-        (WINDOW_WIDTH - ROAD_WIDTH) / 2,
-        (WINDOW_HEIGHT - ROAD_WIDTH) / 2,
-        ROAD_WIDTH,
-        ROAD_WIDTH
-    };
-    SDL_RenderFillRect(renderer, &intersection);
-
-    // Draw horizontal road
-    SDL_Rect horizontalRoad = { 0, (WINDOW_HEIGHT - ROAD_WIDTH) / 2, WINDOW_WIDTH, ROAD_WIDTH };
-    SDL_RenderFillRect(renderer, &horizontalRoad);
-
-    // Draw vertical road
-    SDL_Rect verticalRoad = { (WINDOW_WIDTH - ROAD_WIDTH) / 2, 0, ROAD_WIDTH, WINDOW_HEIGHT };
-    SDL_RenderFillRect(renderer, &verticalRoad);
-
-    // Draw lane markings
-    SDL_SetRenderDrawColor(renderer, 251, 255, 0, 1);
-
-    // Horizontal lane markings
-    for (int i = 1; i < 3; i++) {
-        int y = (WINDOW_HEIGHT - ROAD_WIDTH) / 1.95  + i * LANE_WIDTH;
-        for (int x = 0; x < WINDOW_WIDTH; x += 60) {
-            SDL_Rect dash = {x, y - 5, 30, 6};
-            if (x < (WINDOW_WIDTH - ROAD_WIDTH) / 1.99 || x > (WINDOW_WIDTH + ROAD_WIDTH) / 2.1) {
-                SDL_RenderFillRect(renderer, &dash);
+    for (int j = 0; j < numJunctions; j++) {
+        Junction* junction = &junctions[j];
+        int cx = junction->cx - cameraX;
+        int cy = junction->cy - cameraY;
+
+        // Each arm runs to the neighbouring junction, or to the edge of the world
+        int west = (junction->neighbour[1] >= 0 ? junctions[junction->neighbour[1]].cx : worldMinX) - cameraX;
+        int east = (junction->neighbour[0] >= 0 ? junctions[junction->neighbour[0]].cx : worldMaxX) - cameraX;
+        int north = (junction->neighbour[3] >= 0 ? junctions[junction->neighbour[3]].cy : worldMinY) - cameraY;
+        int south = (junction->neighbour[2] >= 0 ? junctions[junction->neighbour[2]].cy : worldMaxY) - cameraY;
+
+        // Set road color
+        SDL_SetRenderDrawColor(renderer, GRAY.r, GRAY.g, GRAY.b, GRAY.a);
+
+        // Draw intersection
+        SDL_Rect intersection = { cx - ROAD_WIDTH / 2, cy - ROAD_WIDTH / 2, ROAD_WIDTH, ROAD_WIDTH };
+        SDL_RenderFillRect(renderer, &intersection);
+
+        // Draw horizontal road
+        SDL_Rect horizontalRoad = { west, cy - ROAD_WIDTH / 2, east - west, ROAD_WIDTH };
+        SDL_RenderFillRect(renderer, &horizontalRoad);
+
+        // Draw vertical road
+        SDL_Rect verticalRoad = { cx - ROAD_WIDTH / 2, north, ROAD_WIDTH, south - north };
+        SDL_RenderFillRect(renderer, &verticalRoad);
+
+        // Draw lane markings
+        SDL_SetRenderDrawColor(renderer, 251, 255, 0, 1);
+
+        // Horizontal lane markings, on a world-aligned dash pattern so adjacent arms line up
+        for (int i = 1; i < 3; i++) {
+            int y = cy - ROAD_WIDTH / 2 + i * LANE_WIDTH;
+            for (int x = west - ((west + cameraX - worldMinX) % 60); x < east; x += 60) {
+                SDL_Rect dash = {x, y - 5, 30, 6};
+                if (x + 30 < cx - ROAD_WIDTH / 2 || x > cx + ROAD_WIDTH / 2) {
+                    SDL_RenderFillRect(renderer, &dash);
+                }
             }
         }
-    }
 
-    // Vertical lane markings
-    for (int i = 1; i < 3; i++) {
-        int x = (WINDOW_WIDTH - ROAD_WIDTH) / 1.98 + i * LANE_WIDTH;
-        for (int y = 0; y < WINDOW_HEIGHT; y += 60) {
-            SDL_Rect dash = {x - 2, y, 6, 30};
-            if (y < (WINDOW_HEIGHT - ROAD_WIDTH) / 2 || y > (WINDOW_HEIGHT + ROAD_WIDTH) / 2.098) {
-                SDL_RenderFillRect(renderer, &dash);
+        // Vertical lane markings
+        for (int i = 1; i < 3; i++) {
+            int x = cx - ROAD_WIDTH / 2 + i * LANE_WIDTH;
+            for (int y = north - ((north + cameraY - worldMinY) % 60); y < south; y += 60) {
+                SDL_Rect dash = {x - 2, y, 6, 30};
+                if (y + 30 < cy - ROAD_WIDTH / 2 || y > cy + ROAD_WIDTH / 2) {
+                    SDL_RenderFillRect(renderer, &dash);
+                }
             }
         }
+
+        if (font && numJunctions > 1) {
+            char label[16];
+            snprintf(label, sizeof(label), "J%d", junction->id);
+            displayText(renderer, font, label, cx + ROAD_WIDTH / 2 + 5, cy + ROAD_WIDTH / 2 + 5);
+        }
     }
 
     if (font) {
-        displayText(renderer, font, "Lane A", 10, (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 30);
-        displayText(renderer, font, "Lane B", WINDOW_WIDTH - 100, (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 30);
-        displayText(renderer, font, "Lane C", (WINDOW_WIDTH - ROAD_WIDTH) / 2 - 90, 5);
-        displayText(renderer, font, "Lane D", (WINDOW_WIDTH - ROAD_WIDTH) / 2 + 220, WINDOW_HEIGHT - 30);
+        // Labels follow the junction whose queues are on screen
+        int ox = junctions[getFocusJunction()].cx - cameraX - WINDOW_WIDTH / 2;
+        int oy = junctions[getFocusJunction()].cy - cameraY - WINDOW_HEIGHT / 2;
+        displayText(renderer, font, "Lane A", ox + 10, oy + (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 30);
+        displayText(renderer, font, "Lane B", ox + WINDOW_WIDTH - 100, oy + (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 30);
+        displayText(renderer, font, "Lane C", ox + (WINDOW_WIDTH - ROAD_WIDTH) / 2 - 90, oy + 5);
+        displayText(renderer, font, "Lane D", ox + (WINDOW_WIDTH - ROAD_WIDTH) / 2 + 220, oy + WINDOW_HEIGHT - 30);
         displayText(renderer, font, "A - ", 15, (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 207);
         displayText(renderer, font, "C - ", 15, (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 178);
         displayText(renderer, font, "B - ", (WINDOW_HEIGHT - ROAD_WIDTH) + 560, (WINDOW_HEIGHT - ROAD_WIDTH) / 2 - 207);
@@ -0,0 +1,82 @@
+// Training environment API of the traffic simulator. Build simulator.c as a shared library
+// with -DTRAFFIC_ENV_LIBRARY and load these functions from any language with a C FFI.
+// Every struct here has a fixed size and explicit field widths; a binding checks
+// envApiVersion() against the TRAFFIC_ENV_API_VERSION it was written for.
+//
+// Environments are not independent. The simulator works on one run at a time, held in
+// process-wide state, and every environment steps on the same worker threads. A call on
+// an environment copies its run in and copies the run of the last environment called out.
+// That copy is about a few hundred KB for the larger networks, paid only when the
+// environment called changes. So:
+// - Call from one thread at a time. A call made while another environment call is
+//   running does nothing and fails: -1 or NaN, as noted below.
+// - Environments in one process never step in parallel. Step a batch in turn, or run one
+//   process per core to use several.
+#ifndef TRAFFIC_ENV_H
+#define TRAFFIC_ENV_H
+
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(TRAFFIC_ENV_LIBRARY)
+#define TRAFFIC_ENV_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define TRAFFIC_ENV_API
+#else
+#define TRAFFIC_ENV_API __attribute__((visibility("default")))
+#endif
+
+#define TRAFFIC_ENV_API_VERSION 3 // Raised whenever a struct or a signature below changes
+#define TRAFFIC_ENV_APPROACHES 4  // Lanes A to D of a junction
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One simulation: its network, vehicles, lights and clock
+typedef struct TrafficEnv TrafficEnv;
+
+// What the agent sees of one junction, 48 bytes
+typedef struct {
+    int32_t queueLengths[TRAFFIC_ENV_APPROACHES]; // Vehicles queued on the signal-controlled sublane
+    float waitTimes[TRAFFIC_ENV_APPROACHES];      // s the vehicle at the front of each queue has waited
+    int32_t phase;      // Asked for: 0 east-west, 1 north-south, -1 none
+    uint32_t greenMask; // Bit n set while lane 'A' + n has a green light
+    uint32_t yellowMask;
+    float phaseAge;     // s since the lights last changed
+} EnvJunctionObservation;
+
+TRAFFIC_ENV_API int32_t envApiVersion(void);
+
+// Set the process up, stepping on the given number of worker threads; 0 on success
+TRAFFIC_ENV_API int32_t envOpen(int32_t threads);
+
+// Stop the workers; destroy the environments first
+TRAFFIC_ENV_API void envClose(void);
+
+// An environment with no episode yet, or NULL when out of memory
+TRAFFIC_ENV_API TrafficEnv* envCreate(void);
+
+// Free the environment and its run; 0 on success, -1 during another call
+TRAFFIC_ENV_API int32_t envDestroy(TrafficEnv* env);
+
+// Start an episode of the named scenario from seed, every light red; returns the number
+// of junctions, or -1 for an unknown scenario or during another call
+TRAFFIC_ENV_API int32_t envReset(TrafficEnv* env, uint64_t seed, const char* scenario);
+
+// Fill in up to capacity junctions and the simulated time; returns the number of
+// junctions, which may be more than capacity, or -1 during another call
+TRAFFIC_ENV_API int32_t envObserve(TrafficEnv* env, EnvJunctionObservation* observations, int32_t capacity,
+                                   float* simSeconds);
+
+// Ask for phase actions[j] at each of the first numActions junctions (-1 keeps what it
+// has) and run up to numTicks 16 ms ticks, no further than the end of the episode.
+// Returns the reward: minus the time vehicles spent queued, in vehicle-seconds, or NaN
+// during another call. done is set once the episode is over.
+TRAFFIC_ENV_API float envStep(TrafficEnv* env, const int32_t* actions, int32_t numActions, int32_t numTicks,
+                              int32_t* done);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif